@@ -19,6 +19,7 @@
 #ifndef INCLUDED_IFCTL_HH
 #define INCLUDED_IFCTL_HH
 
+#include <stdlib.h> // for strtoul
 #include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -138,6 +139,22 @@ public:
     return _ifr.ifr_mtu;
   }
 
+  int getIndex() {
+    if (ioctl(_sock, SIOCGIFINDEX, &_ifr)) {
+      fail("Could not get index");
+      return -1;
+    }
+    return _ifr.ifr_ifindex;
+  }
+
+  int getHwType() { // ARPHRD_XX
+    if (ioctl(_sock, SIOCGIFHWADDR, &_ifr)) {
+      fail("Could not get hardware type");
+      return -1;
+    }
+    return _ifr.ifr_hwaddr.sa_family;
+  }
+
   bool getHwAddress(uint8_t *addr) {
     if (ioctl(_sock, SIOCGIFHWADDR, &_ifr)) {
       return false;
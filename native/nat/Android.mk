@@ -22,4 +22,14 @@ LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
 
 LOCAL_LDLIBS := -llog
 
+include $(BUILD_EXECUTABLE)
+
+LOCAL_MODULE := bench
+
+LOCAL_SRC_FILES := bench.cc barnacle.cc
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CFLAGS := -Wall -Wextra -Werror -O3
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_LDLIBS := -llog
+
 include $(BUILD_EXECUTABLE)
\ No newline at end of file
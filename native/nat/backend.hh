@@ -0,0 +1,373 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: packet I/O backends */
+#ifndef INCLUDED_BACKEND_HH
+#define INCLUDED_BACKEND_HH
+
+#include "ifctl.hh"
+#include "natcommon.hh" // for finish_partial_cksum
+#include "neighbors.hh"
+#include "txring.hh"
+#include "filtersocket.hh"
+
+/**
+ * Where Barnacle gets its IP packets from, and where it sends them to.
+ * Packets come in on either side (WAN or LAN), and go out routed by their
+ * destination. Every loop Barnacle calls want() and select(), then recv()
+ * from each side that canRecv() until there is nothing more or no room, and
+ * send() the queue while canSend(), with a flush() at the end of the burst.
+ */
+class Backend {
+public:
+  enum { WAN = 0, LAN = 1 };
+
+  struct Stats {
+    unsigned rx[2];   // packets received from each side
+    unsigned tx;      // packets sent
+    unsigned drops;   // dropped by the backend
+    unsigned toobig;  // sends that failed with EMSGSIZE after the fact
+  };
+
+  /// what Barnacle needs to know about the interface on a side
+  struct Link {
+    int       mtu;
+    in_addr_t addr;
+    in_addr_t mask;
+  };
+
+protected:
+  const char *_ifs[2];
+  Stats _stats;
+  bool _unsupported;
+  int _busy_poll; // SO_BUSY_POLL for the capture sockets
+  int _sndbuf;    // SO_SNDBUF for injection
+  int _mark;      // SO_MARK for injection to the WAN
+
+public:
+  Backend() : _unsupported(false), _busy_poll(0), _sndbuf(0), _mark(0) {
+    _ifs[WAN] = _ifs[LAN] = "";
+    ::memset(&_stats, 0, sizeof(_stats));
+  }
+  virtual ~Backend() {}
+
+  void setInterfaces(const char *outif, const char *inif) {
+    _ifs[WAN] = outif;
+    _ifs[LAN] = inif;
+  }
+  /// from the next open(), 0 for none
+  void setBusyPoll(int us) { _busy_poll = us; }
+  /// from the next open(), 0 for the default
+  void setSndBuf(int bytes) { _sndbuf = bytes; }
+  /// from the next open(), 0 for none
+  void setMark(int mark) { _mark = mark; }
+  const Stats &stats() const { return _stats; }
+  /// the backend can't work here, no point trying it again
+  bool unsupported() const { return _unsupported; }
+
+  /// open on the interfaces, register the fds with sel, return false on fail
+  virtual bool open(Selector &sel) = 0;
+  virtual void close() = 0;
+
+  virtual void link(int side, Link &l) {
+    IfCtl ic(_ifs[side]);
+    l.mtu = ic.getMTU();
+    l.addr = ic.getAddress();
+    l.mask = ic.getMask();
+  }
+  virtual bool setMtu(int side, int mtu) { return IfCtl(_ifs[side]).setMTU(mtu); }
+
+  /// (re)attach the filter of the WAN side (see Rewriter::wanFilter) and of
+  /// the LAN side, return false on fail
+  virtual bool attach(const BPFProgram &wan) = 0;
+
+  /// set up sel for the next select(), return false on fail
+  virtual bool want(Selector &sel, bool rx, bool tx) = 0;
+  /// timeout as in Selector::select()
+  virtual int select(Selector &sel, timeval *timeout = NULL) { return sel.select(timeout); }
+  virtual bool canRecv(const Selector &sel, int side) = 0;
+  virtual bool canSend(const Selector &sel) = 0;
+
+  /// return length, 0 on try again, -1 on fail
+  virtual int recv(int side, Buffer &b) = 0;
+  /// GRO aggregates bigger than the MTU might come in
+  virtual bool aggregates() const { return false; }
+  /// the last packet did not fit in the Buffer, it's in the GSOBuffer
+  virtual bool spilled() const { return false; }
+
+  /// return 0 on try again, -1 on fail
+  virtual int send(const Buffer &b) = 0;
+  /// end of a burst of send(), return false on fail
+  virtual bool flush() { return true; }
+
+  /// a LAN host has this MAC address (e.g. from a DHCP lease)
+  virtual void learn(in_addr_t, const uint8_t *) {}
+};
+
+/**
+ * The capture sockets and the raw IP socket for injection. The LAN socket
+ * belongs to Barnacle, since it holds the MAC filter. Packets to LAN hosts
+ * whose MAC address we have seen go out as frames on the LAN socket, which
+ * skips routing and ARP, the rest through the raw IP socket.
+ * With setTxRing(), packets to the WAN go into a TxRing on the WAN socket
+ * instead, as soon as we know where to send them: anywhere on a link without
+ * L2 addresses (ppp, rmnet), else to the router once it has sent us a frame.
+ */
+class SocketIO : public Backend {
+protected:
+  PacketSocket  _outs;  // ppp capture
+  FilterSocket  &_ins;  // wifi capture
+  IPSocket      _ips;   // injection
+  GSOBuffer     *_big;
+  const PacketSocket *_last; // of the last recv()
+  Neighbors     _lan_neigh;
+  TxRing        _txr;
+  bool          _use_txr;
+  bool          _txr_full; // wait for the kernel to free a frame of _txr
+  bool          _wan_p2p;  // no link-layer addresses on the WAN
+  in_addr_t     _wan_addr, _wan_mask;
+  Neighbors     _wan_neigh; // only the router
+
+  PacketSocket &socket(int side) { return (side == WAN) ? _outs : _ins; }
+
+public:
+  SocketIO(FilterSocket &ins, GSOBuffer *big)
+    : _ins(ins), _big(big), _last(&_outs), _use_txr(false), _txr_full(false), _wan_p2p(false),
+      _wan_addr(0), _wan_mask(0) { _outs.close(); _ips.close(); }
+
+  /// inject to the WAN through a PACKET_TX_RING, from the next open()
+  void setTxRing(bool use) { _use_txr = use; }
+
+  bool open(Selector &sel) {
+    close();
+    _outs = PacketSocket(); // NOTE: this depends on not having destructors
+    _ins.reset(); // NOTE: can't use constructor for the destructor will kill the hash
+    _ips = IPSocket();
+    _lan_neigh.clear();
+    _wan_neigh.clear();
+
+    if(_outs.fd() < 0 || !_outs.bind(_ifs[WAN])) {
+      ERR("Could not bind outif to %s : %s\n", _ifs[WAN], strerror(errno));
+      return false;
+    }
+    if(_ins.fd() < 0 || !_ins.bind(_ifs[LAN])) {
+      ERR("Could not bind inif to %s : %s\n", _ifs[LAN], strerror(errno));
+      return false;
+    }
+    if(_ips.fd() < 0 || !_ips.bind()) {
+      ERR("Could not bind IP raw socket: %s\n", strerror(errno));
+      return false;
+    }
+
+    // NOTE: without it, GRO and checksum offload better be off
+    if (!_outs.setAuxData(_big) || !_ins.setAuxData(_big))
+      LOG("Could not enable PACKET_AUXDATA: %s\n", strerror(errno));
+    if (_busy_poll && (!_outs.setBusyPoll(_busy_poll) || !_ins.setBusyPoll(_busy_poll)))
+      LOG("Could not enable SO_BUSY_POLL: %s\n", strerror(errno));
+    // keep the backlog in our queue, where FlowQueue can manage it
+    if (_sndbuf && (!_ips.setSndBuf(_sndbuf) || !_ins.setSndBuf(_sndbuf)))
+      LOG("Could not set SO_SNDBUF: %s\n", strerror(errno));
+    if (_mark && !_ips.setMark(_mark))
+      LOG("Could not set SO_MARK: %s\n", strerror(errno));
+    if (_use_txr && !openTxRing())
+      LOG("Could not set up PACKET_TX_RING: %s\n", strerror(errno));
+
+    sel.newFd(_outs.fd());
+    sel.newFd(_ins.fd());
+    sel.newFd(_ips.fd());
+    return true;
+  }
+
+  void close() {
+    _txr.close();
+    _txr_full = false;
+    _outs.close();
+    _ins.close();
+    _ips.close();
+  }
+
+  // NOTE: failure is non-critical, we filter in userspace anyway
+  bool attach(const BPFProgram &wan) {
+    return wan.attach(_outs.fd());
+  }
+
+  bool want(Selector &sel, bool rx, bool tx) {
+    sel.wantRead(_ins.fd(), rx);
+    sel.wantRead(_outs.fd(), rx);
+    // NOTE: _ips is about always writable, the ring only once a frame is free
+    sel.wantWrite(_ips.fd(), tx && !_txr_full);
+    sel.wantWrite(_outs.fd(), tx && _txr_full);
+    return true;
+  }
+  bool canRecv(const Selector &sel, int side) { return sel.canRead(socket(side).fd()); }
+  bool canSend(const Selector &sel) {
+    return sel.canWrite(_txr_full ? _outs.fd() : _ips.fd());
+  }
+
+  int recv(int side, Buffer &b) {
+    _last = &socket(side);
+    int l = (side == WAN) ? _outs.recv(b) : _ins.recv(b);
+    if (l > 0) {
+      ++_stats.rx[side];
+      if (_last->csumNotReady() && !_last->spilled())
+        finish_partial_cksum(b);
+      if (side == LAN && !_last->spilled())
+        learnFrom(b, _ins.source());
+      else if (side == WAN && _txr.ok() && !_wan_p2p && !onWanLink(((const iphdr *)b.data())->saddr))
+        _wan_neigh.learnRouter(_outs.source());
+    }
+    return l;
+  }
+  bool aggregates() const { return _last->auxData(); }
+  bool spilled() const { return _last->spilled(); }
+
+  int send(const Buffer &b) {
+    const uint8_t *mac = neighbor(b);
+    int l;
+    if (mac) {
+      l = _ins.send(b, mac);
+    } else if (toTxRing(b)) {
+      l = _txr.put(b);
+      _txr_full = (l == 0);
+    } else {
+      l = _ips.send(b); // the kernel will ARP for us
+    }
+    if (l > 0) ++_stats.tx;
+    return l;
+  }
+  bool flush() {
+    if (_wan_p2p)
+      return _txr.flush();
+    const uint8_t *router = _wan_neigh.find(0, false);
+    if (!router)
+      return true; // nothing went into the ring
+    sockaddr_ll to;
+    _outs.address(to, router);
+    return _txr.flush(&to);
+  }
+
+  void learn(in_addr_t addr, const uint8_t *mac) {
+    if (_ins.local(addr))
+      _lan_neigh.learn(addr, mac);
+  }
+
+protected:
+  bool openTxRing() {
+    IfCtl ic(_ifs[WAN]);
+    _wan_addr = ic.getAddress();
+    _wan_mask = ic.getMask();
+    _wan_p2p = (ic.getHwType() != ARPHRD_ETHER);
+    return _txr.open(_outs.fd());
+  }
+  bool onWanLink(in_addr_t addr) const {
+    return (addr & _wan_mask) == (_wan_addr & _wan_mask);
+  }
+  /// b leaves through the WAN, and we know how to get it there
+  bool toTxRing(const Buffer &b) const {
+    if (!_txr.ok()) return false;
+    const iphdr *ip = (const iphdr *)b.data();
+    if (_ins.local(ip->daddr) || (ip->daddr == _wan_addr) || !TxRing::fits(ntohs(ip->tot_len)))
+      return false;
+    return _wan_p2p || (!onWanLink(ip->daddr) && _wan_neigh.find(0, false));
+  }
+  void learnFrom(const Buffer &b, const uint8_t *mac) {
+    learn(((const iphdr *)b.data())->saddr, mac);
+  }
+  /// the MAC address of the LAN host b goes to, NULL if not known
+  const uint8_t *neighbor(const Buffer &b) const {
+    in_addr_t daddr = ((const iphdr *)b.data())->daddr;
+    return _ins.local(daddr) ? _lan_neigh.find(daddr, true) : 0;
+  }
+};
+
+/**
+ * In-memory packets, so that Barnacle can be driven without the kernel, e.g.
+ * by a benchmark. What is push()ed is received, what is sent is kept in
+ * sent() (while there's room). With replay, every received packet goes back
+ * to the end of its queue, so a few packets make an endless stream.
+ */
+class LoopIO : public Backend {
+protected:
+  Queue<Buffer> _wan, _lan, _tx;
+  Link _links[2];
+  bool _replay;
+
+  Queue<Buffer> &rx(int side) { return (side == WAN) ? _wan : _lan; }
+
+public:
+  LoopIO(unsigned size, bool replay = false)
+    : _wan(size), _lan(size), _tx(size), _replay(replay) {
+    ::memset(_links, 0, sizeof(_links));
+  }
+
+  void setLink(int side, int mtu, in_addr_t addr, in_addr_t mask) {
+    _links[side].mtu = mtu;
+    _links[side].addr = addr;
+    _links[side].mask = mask;
+  }
+  void setReplay(bool replay) { _replay = replay; }
+  /// false if full
+  bool push(int side, const Buffer &b) {
+    Queue<Buffer> &q = rx(side);
+    if (q.full()) return false;
+    q.tail().copy(b);
+    q.pushTail();
+    return true;
+  }
+  Queue<Buffer> &sent() { return _tx; }
+
+  bool open(Selector &) { return true; }
+  void close() { _wan.clear(); _lan.clear(); _tx.clear(); }
+  void link(int side, Link &l) { l = _links[side]; }
+  bool setMtu(int side, int mtu) { _links[side].mtu = mtu; return true; }
+  bool attach(const BPFProgram &) { return true; }
+
+  bool want(Selector &, bool, bool) { return true; }
+  /// never blocks, but still serves ctrl
+  int select(Selector &sel, timeval * = NULL) {
+    timeval tv = { 0, 0 };
+    int r = sel.select(&tv);
+    return (r < 0) ? r : 1;
+  }
+  bool canRecv(const Selector &, int side) { return !rx(side).empty(); }
+  bool canSend(const Selector &) { return true; }
+
+  int recv(int side, Buffer &b) {
+    Queue<Buffer> &q = rx(side);
+    if (q.empty()) return 0;
+    b.copy(q.head());
+    q.popHead();
+    if (_replay) {
+      q.tail().copy(b);
+      q.pushTail();
+    }
+    ++_stats.rx[side];
+    return b.size();
+  }
+
+  int send(const Buffer &b) {
+    ++_stats.tx;
+    if (!_tx.full()) {
+      _tx.tail().copy(b);
+      _tx.pushTail();
+    }
+    return b.size();
+  }
+};
+
+#endif // INCLUDED_BACKEND_HH
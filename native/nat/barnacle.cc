@@ -19,6 +19,11 @@
 #define TAG "NAT: "
 #include "barnacle.hh"
 
+Barnacle::Barnacle(const Config &c, Backend *io)
+  : _cfg(c), _q(c.queuelen, c), _gso(new GSOBuffer()), _sio(_ins, _gso), _uio(_ins, _gso),
+    _xio(_ins), _io(&_sio), _given(io), _toobig(0), _seg_mss(0), _proxy(_ins), _rw(c),
+    _last_rx(0), _last_wake(0), _batch(0), _lag(0) { }
+
 Barnacle::~Barnacle() {
   if (have_ctrl()) {
     if (_ctrl_server.ok()) {
@@ -28,14 +33,16 @@ Barnacle::~Barnacle() {
     _ctrl.close();
   }
 
-  _outs.close();
-  _ins.close();
-  _ips.close();
+  _io->close();
+  _tun.close();
+  if (_gso) delete _gso;
+  _gso = 0;
 }
 
 bool Barnacle::init_ctrl() {
   _nin = _nout = _bin = _bout = 0; // FIXME: remove
   _lastcleanup = _lastcleanup_tcp = 0;
+  _stats[0] = '\0';
 
   _ctrl.close();
   if (have_ctrl()) {
@@ -51,55 +58,125 @@ bool Barnacle::init_ctrl() {
   return true;
 }
 
+void Barnacle::stop() {
+  _nf.close(); // turns ip_forward back
+}
+
 bool Barnacle::start() {
   _sel.clear();
   _q.clear(); // is this necessary?
 
-  _outs.close();
-  _ins.close();
-  _ips.close();
-
-  _outs = PacketSocket(); // NOTE: this depends on not having destructors
-  _ins.reset(); // NOTE: can't use constructor for the destructor will kill the hash
-  _ips = IPSocket();
+  _io->close();
+  _tun.close();
+  _proxy.close();
+  _rw.setSlowPath(false);
+  _rw.setOffload(0);
+  _offload.close();
+  _rw.setConntrack(0);
+  _nf.close();
+  _seg_mss = 0;
 
-  if(_outs.fd() < 0 || !_outs.bind(_cfg.outif)) {
-    ERR("Could not bind outif to %s : %s\n", _cfg.outif, strerror(errno));
-    return false;
+  if (_uio.unsupported()) _cfg.uring = false;
+  if (_xio.unsupported()) _cfg.xdp = false;
+  if (_cfg.proxy && _cfg.xdp) {
+    // XDP takes the frames before the stack could divert them to the proxy
+    LOG("XDP disabled for the TCP proxy\n");
+    _cfg.xdp = false;
   }
-  if(_ins.fd() < 0 || !_ins.bind(_cfg.inif)) {
-    ERR("Could not bind inif to %s : %s\n", _cfg.inif, strerror(errno));
-    return false;
+  if ((_cfg.offload || _cfg.flowtable) && _cfg.xdp) {
+    // XDP takes the frames before the kernel could forward them
+    LOG("XDP disabled for the kernel fast path\n");
+    _cfg.xdp = false;
   }
-  if(_ips.fd() < 0 || !_ips.bind()) {
-    ERR("Could not bind IP raw socket: %s\n", strerror(errno));
+  _io = _given ? _given : _cfg.xdp ? (Backend *)&_xio
+      : _cfg.uring ? (Backend *)&_uio : (Backend *)&_sio;
+  _io->setInterfaces(_cfg.outif, _cfg.inif);
+  _sio.setTxRing(_cfg.txring);
+  _io->setBusyPoll(_cfg.busypoll);
+  _io->setSndBuf(_cfg.sndbuf);
+  _io->setMark(_cfg.flowtable ? NfOffload::SkbMark : 0);
+  _toobig = _io->stats().toobig;
+
+  if (have_tun()) {
+    // NOTE: the routing into the device is set up from outside
+    if (!_tun.open(_cfg.tunif) || !IfCtl(_cfg.tunif).setState(true)) {
+      ERR("Could not open tun %s : %s\n", _cfg.tunif, strerror(errno));
+      return false;
+    }
+    _sel.newFd(_tun.fd());
+  } else if (!_io->open(_sel)) {
     return false;
   }
-
-  _sel.newFd(_outs.fd());
-  _sel.newFd(_ins.fd());
-  _sel.newFd(_ips.fd());
   if (have_ctrl()) {
     _sel.newFd(_ctrl_server.fd());
   }
 
-  IfCtl ic_in(_cfg.inif);
-  IfCtl ic_out(_cfg.outif);
+  Backend::Link wan, lan;
   // If this fails, we'll be sending "Fragmentation needed" when neccessary.
-  ic_out.setMTU(1500);
-  _mtu = ic_out.getMTU();
+  _io->setMtu(Backend::WAN, 1500);
+  _io->link(Backend::WAN, wan);
+  _io->link(Backend::LAN, lan);
+  _mtu = wan.mtu;
+  _rw.setMtu(_mtu);
+  _rw.setWindowCtl(_cfg.rwnd);
+  _lan_mtu = lan.mtu;
+  _lan_addr = lan.addr;
 
   // configure subnet, netmask and out_addr from interfaces
-  _cfg.netmask   = ic_in.getMask();
-  _cfg.subnet    = ic_in.getAddress() & _cfg.netmask;
-  _cfg.out_addr  = ic_out.getAddress(); // if this is unset, somebody needs to set it
+  _cfg.netmask   = lan.mask;
+  _cfg.subnet    = lan.addr & _cfg.netmask;
+  _cfg.out_addr  = wan.addr; // if this is unset, somebody needs to set it
 
   _rw.configure(_cfg);
+  _q.setLan(_cfg.subnet, _cfg.netmask);
+  _load.configure(_cfg.overload, _cfg.codel_interval); // a step per interval
+  _rw.setShedding(false, 0);
 
   if ((_cfg.out_addr == INADDR_NONE) || (_cfg.netmask == INADDR_NONE)) {
     // not good
     return false;
   }
+  _ins.setSubnet(_cfg.subnet, _cfg.netmask); // also for the proxy
+  if (!have_tun() && !attachFilters() && _io->unsupported())
+    return false;
+  if (_cfg.proxy && !_proxy.open(_sel, _lan_addr, _cfg.proxy, _cfg.inif,
+                                 _cfg.proxy_cc, _cfg.proxy_buf, _cfg.timeout_tcp)) {
+    // the REDIRECT is in place, so TCP would go nowhere
+    ERR("Could not open proxy on port %u: %s\n", _cfg.proxy, strerror(errno));
+    return false;
+  }
+  if (_proxy.ok() && (_cfg.fq || _cfg.conn_rate || _cfg.client_maps || _load.enabled()))
+    LOG("Proxied TCP skips fq, rate caps, mapping quotas and shedding\n");
+  if (_cfg.offload && !have_tun() && !_given) {
+    if (_offload.open(_cfg.inif, _cfg.outif, _cfg.subnet, _cfg.netmask, Rewriter::Cone))
+      _rw.setOffload(&_offload);
+    else // carry on in userspace
+      LOG("Could not attach TC fast path (needs Linux 6.6): %s\n", strerror(errno));
+    if (_offload.ok() && (_cfg.fq || _cfg.codel_target || _load.enabled()))
+      LOG("Established flows skip fq, CoDel, rate caps and shedding in the TC fast path\n");
+  }
+  if (_cfg.flowtable && !_offload.ok() && !have_tun() && !_given) {
+    if (_nf.open(_cfg.inif, _cfg.outif)) {
+      _rw.setConntrack(&_nf);
+      _sel.newFd(_nf.fd());
+      if (!_nf.flowtable())
+        LOG("No flowtable, flows take the whole forward path\n");
+    } else { // carry on in userspace
+      LOG("Could not set up netfilter fast path (needs Linux 5.18): %s\n", strerror(errno));
+    }
+  }
+  if (_cfg.slowpath && _rw.setSlowPath(true))
+    _sel.newFd(_rw.slowFd());
+  return true;
+}
+
+bool Barnacle::attachFilters() {
+  BPFProgram p;
+  _rw.wanFilter(p);
+  if (!_io->attach(p)) {
+    ERR("Could not attach filters: %s\n", p.ok() ? strerror(errno) : "too long");
+    return false;
+  }
   return true;
 }
 
@@ -117,6 +194,8 @@ void Barnacle::handle_ctrl() {
         // MACD|<mac>
         // FILT|<1|0>
         // DMZ|<ip>
+        // LEAS|<mac>|<ip>
+        // RATE|<ip>|<weight>|<up kbit/s>|<down kbit/s>
         DBG("--- CONTROL --- %d : %s\n", _msg.msg_size(), b);
         if (_msg.msg_size() > 21 && !strncmp("MAC", b, 3)) {
           bool allowed = (b[3] == 'A');
@@ -124,17 +203,43 @@ void Barnacle::handle_ctrl() {
           if (mac.read(b + 5)) {
             _ins.setFilter(mac, allowed);
             _ins.setFiltering(true); // for now we assume you want filtering
+            _rw.clearOffload(); // the fast path does not know the filter
+            if (!have_tun())
+              attachFilters();
           } else DBG("Could not parse MAC %s\n", b + 4);
         } else if (_msg.msg_size() > 5 && !strncmp("FILT", b, 4)) {
           bool enabled = (b[5] == '1');
           _ins.setFiltering(enabled);
+          _rw.clearOffload();
+          if (!have_tun())
+            attachFilters();
           DBG("Filtering %s\n", enabled ? "enabled" : "disabled");
         } else if (_msg.msg_size() > 10 && !strncmp("DMZ", b, 3)) {
 #ifdef NAT_OPEN
           in_addr_t dmz = inet_addr(b + 4);
-          if (dmz != INADDR_NONE)
+          if (dmz != INADDR_NONE) {
             _rw.setDmz(dmz);
+            if (!have_tun())
+              attachFilters();
+          }
 #endif
+        } else if (_msg.msg_size() > 29 && !strncmp("LEAS", b, 4)) {
+          MACAddress mac;
+          in_addr_t ip = inet_addr(b + 23);
+          if (mac.read(b + 5) && (ip != INADDR_NONE))
+            _io->learn(ip, mac.addr);
+          else DBG("Could not parse lease %s\n", b + 5);
+        } else if (_msg.msg_size() > 17 && !strncmp("RATE", b, 4)) {
+          char ip[16];
+          unsigned weight, up, down;
+          if ((sscanf(b + 5, "%15[0-9.]|%u|%u|%u", ip, &weight, &up, &down) == 4) &&
+              (inet_addr(ip) != INADDR_NONE)) {
+            if (!_q.setClient(inet_addr(ip), weight, up * 125, down * 125)) {
+              DBG("No room for client %s\n", ip);
+            } else if (_offload.ok() && (up || down)) {
+              LOG("Rate caps of %s do not apply in the TC fast path\n", ip);
+            }
+          } else DBG("Could not parse rate %s\n", b + 5);
         }
         _msg.clear();
       }
@@ -155,19 +260,15 @@ void Barnacle::handle_ctrl() {
 
 // packets coming out -> in
 bool Barnacle::handle_in() {
-  if (_sel.canRead(_outs.fd())) {
-    while(!_q.full()) {
-      int l = _outs.recv(_q.tail());
+  if (_io->canRecv(_sel, Backend::WAN)) {
+    while(!_q.full() && !_seg_mss) {
+      int l = _io->recv(Backend::WAN, _q.tail());
       if (l == 0) {
         break;
       } else if (l > 0) {
-        // packets out -> in
         Buffer &b = _q.tail();
-        if (_rw.packetIn(b)) {
-          _q.pushTail();
-          _nin+= 1;
-          _bin+= b.size(); // FIXME: remove
-        }
+        if (!offloaded(b, Backend::WAN))
+          arrived_in(b);
       } else {
         return false;
       }
@@ -177,23 +278,15 @@ bool Barnacle::handle_in() {
 }
 
 bool Barnacle::handle_out() {
-  if (_sel.canRead(_ins.fd())) {
-    while(!_q.full()) {
-      int l = _ins.recv(_q.tail());
+  if (_io->canRecv(_sel, Backend::LAN)) {
+    while(!_q.full() && !_seg_mss) {
+      int l = _io->recv(Backend::LAN, _q.tail());
       if (l == 0) {
         break;
       } else if (l > 0) {
-        // packets in -> out
         Buffer &b = _q.tail();
-        // check MTU
-        if (b.size() > (unsigned)_mtu) {
-          make_icmp_mtu(b, IfCtl(_cfg.inif).getAddress(), _mtu);
-          _q.pushTail();
-        } else if (_rw.packetOut(b)) {
-          _q.pushTail();
-          _nout+= 1;
-          _bout+= b.size(); // FIXME: remove
-        }
+        if (!offloaded(b, Backend::LAN))
+          arrived_out(b);
       } else {
         return false;
       }
@@ -202,29 +295,268 @@ bool Barnacle::handle_out() {
   return true;
 }
 
+// packets out -> in, b is _q.tail()
+void Barnacle::arrived_in(Buffer &b) {
+  if (_rw.packetIn(b)) {
+    // too big for LAN and can't be fragmented
+    if ((b.size() > (unsigned)_lan_mtu) && dont_fragment(b) &&
+        !bounce(b, _lan_mtu))
+      return;
+    _q.pushTail();
+    _nin+= 1;
+    _bin+= b.size(); // FIXME: remove
+  }
+}
+
+// packets in -> out, b is _q.tail()
+void Barnacle::arrived_out(Buffer &b) {
+  const iphdr *ip = (const iphdr *)b.data();
+  if ((ip->protocol == IPPROTO_TCP) && _proxy.ok())
+    return; // the stack diverts it to _proxy
+  in_addr_t client = ip->saddr; // before translation
+  // check MTU, drain() will fragment if allowed
+  if ((b.size() > (unsigned)_mtu) && dont_fragment(b)) {
+    make_icmp_mtu(b, _lan_addr, _mtu);
+    _q.pushTail();
+  } else if (_rw.packetOut(b)) {
+    _q.pushTail(client);
+    _nout+= 1;
+    _bout+= b.size(); // FIXME: remove
+  }
+}
+
+/**
+ * Take care of the offloads on a packet just received from side into b.
+ * Return true if it was consumed: TCP packets bigger than the MTU they came
+ * in on can only be GRO aggregates, so they are translated once and cut back
+ * into segments by push_segments(). The backend completes the checksums of
+ * the rest.
+ */
+bool Barnacle::offloaded(Buffer &b, int side) {
+  if (!_io->aggregates())
+    return false;
+  bool out = (side == Backend::LAN);
+  bool spilled = _io->spilled();
+  unsigned mtu = out ? _lan_mtu : _mtu; // where it came from
+  if (!spilled && (b.size() <= mtu))
+    return false;
+  if (!spilled) {
+    memcpy(_gso->data(), b.data(), b.size());
+    _gso->put(b.size());
+  }
+  const iphdr *ip = (const iphdr *)_gso->data();
+  unsigned hlen = ip->ihl << 2;
+  if ((ip->protocol != IPPROTO_TCP) || (ip->frag_off & htons(IP_MF | IP_OFFMASK)) ||
+      (_gso->size() < hlen + sizeof(tcphdr))) {
+    if (!spilled)
+      return false; // let drain() deal with it
+    DBG("Dropped packet of %d bytes\n", _gso->size()); // jumbo frame?
+    return true;
+  }
+  if (out && _proxy.ok())
+    return true; // see arrived_out()
+  hlen+= ((const tcphdr *)(_gso->data() + hlen))->doff << 2;
+  _seg_client = out ? ip->saddr : 0;
+  // NOTE: DF segments too big for the way out would only bounce in drain()
+  unsigned mss = gso_mss(mtu, out ? _mtu : _lan_mtu, hlen);
+  if (!mss || !translate_big(out))
+    return true;
+  _seg_off = 0;
+  _seg_mss = mss;
+  push_segments();
+  return true;
+}
+
+// cut the pending GSO super-packet in _gso into the queue
+void Barnacle::push_segments() {
+  while (_seg_mss && !_q.full()) {
+    unsigned len = gso_segment(*_gso, _seg_off, _seg_mss, _q.tail());
+    if (!len) {
+      _seg_mss = 0; // done
+      break;
+    }
+    _seg_off+= len;
+    _q.pushTail(_seg_client);
+  }
+}
+
+// fragments that were waiting for their first fragment, and first packets
+// that were waiting for the slow path to map their flow
+// NOTE: outbound ones are already translated, so they go to the shared class
+void Barnacle::handle_fragments() {
+  while (!_q.full() && _rw.nextFragment(_q.tail()))
+    _q.pushTail();
+  while (!_q.full() && _rw.nextPublished(_q.tail()))
+    _q.pushTail();
+}
+
+// MTU on the way to the destination of a translated packet
+unsigned Barnacle::mtu(const Buffer &b) const {
+  in_addr_t daddr = ((const iphdr *)b.data())->daddr;
+  return ((daddr & _cfg.netmask) == _cfg.subnet) ? _lan_mtu : _mtu;
+}
+
+// return true if any MTU went down
+bool Barnacle::updateMtu() {
+  bool lowered = false;
+  Backend::Link l;
+  _io->link(Backend::WAN, l);
+  if ((l.mtu > 0) && (l.mtu < _mtu)) { // not if the link is gone
+    _mtu = l.mtu;
+    _rw.setMtu(_mtu);
+    LOG("MTU adjusted to %d\n", _mtu);
+    lowered = true;
+  }
+  _io->link(Backend::LAN, l);
+  if ((l.mtu > 0) && (l.mtu < _lan_mtu)) {
+    _lan_mtu = l.mtu;
+    LOG("LAN MTU adjusted to %d\n", _lan_mtu);
+    lowered = true;
+  }
+  // or the kernel fast path would send what no longer fits
+  if (lowered && _offload.ok() && !_offload.setMtu(_lan_mtu, _mtu))
+    ERR("Could not update TC fast path: %s\n", strerror(errno));
+  return lowered;
+}
+
+// Replace a translated packet that is too big (and DF) with "fragmentation
+// needed" for its sender. Since the quoted header is already translated,
+// the rewriter translates the ICMP error back like it came from the far end.
+bool Barnacle::bounce(Buffer &b, unsigned mtu) {
+  bool out = (((const iphdr *)b.data())->saddr == _cfg.out_addr);
+  make_icmp_mtu(b, _lan_addr, mtu);
+  if (out ? _rw.packetIn(b) : _rw.packetOut(b))
+    return true;
+  DBG("Dropped packet too big for MTU %d\n", mtu);
+  return false;
+}
+
 bool Barnacle::drain() {
-  if (_sel.canWrite(_ips.fd())) {
+  if (_io->stats().toobig != _toobig) {
+    // some sends failed after the fact, lower the MTU for the next ones
+    _toobig = _io->stats().toobig;
+    if (!updateMtu())
+      LOG("Dropped packets too big for MTU %d\n", _mtu);
+  }
+  if (_io->canSend(_sel)) {
     while(!_q.empty()) {
-      int l = _ips.send(_q.head());
+      Buffer &b = _q.head();
+      unsigned m = mtu(b);
+      if (b.size() > m) {
+        if (dont_fragment(b)) {
+          if (!bounce(b, m))
+            _q.popHead();
+          continue; // send the ICMP instead
+        }
+        // send one fragment at a time, b keeps the rest
+        unsigned len = ip_fragment(b, _frag, m);
+        int l = _io->send(_frag);
+        if (l == 0) {
+          break;
+        } else if (l > 0) {
+          ip_fragment_shift(b, len);
+        } else if (errno != EMSGSIZE) {
+          return false;
+        } else if (!updateMtu()) {
+          LOG("Dropped fragment of %d bytes, MTU %d\n", _frag.size(), m);
+          _q.popHead();
+        }
+        continue;
+      }
+      int l = _io->send(b);
       if (l == 0) {
         break;
       } else if (l > 0) {
         _q.popHead();
       } else {
         if (errno == EMSGSIZE) {
-          // un-applying the translation is tough, so we just adjust mtu
-          int new_mtu = IfCtl(_cfg.outif).getMTU();
-          if (new_mtu < _mtu) {
-            _mtu = new_mtu;
-            LOG("MTU adjusted to %d\n", _mtu);
+          // un-applying the translation is tough, but with the lower mtu
+          // the packet will be fragmented or bounced on the next try
+          if (!updateMtu()) {
+            LOG("Dropped packet of %d bytes, MTU %d\n", b.size(), m);
+            _q.popHead();
           }
-          _q.popHead();
         } else {
           // unhandled, need to restart
           return false;
         }
       }
     }
+    if (!_io->flush())
+      return false;
+  }
+  return true;
+}
+
+// Translate the packet in _gso in place. The rewriter only ever touches the
+// headers, so a GSO super-packet is translated once through a copy of them.
+bool Barnacle::translate_big(bool out) {
+  GSOBuffer &p = *_gso;
+  const iphdr *ip = (const iphdr *)p.data();
+  unsigned n = p.size();
+  _hdr.reset();
+  if (n >= _hdr.room()) {
+    n = _hdr.room() - 1;
+    if (ip->frag_off & htons(IP_MF | IP_OFFMASK)) {
+      DBG("Dropped fragment of %d bytes\n", p.size()); // could not be held
+      return false;
+    }
+  }
+  memcpy(_hdr.data(), p.data(), n);
+  _hdr.put(n);
+
+  // NOTE: a truncated copy can't be held for the slow path
+  if (!(out ? _rw.packetOut(_hdr, n == p.size()) : _rw.packetIn(_hdr)))
+    return false;
+  memcpy(p.data(), _hdr.data(), n);
+  if (out) {
+    _nout+= 1;
+    _bout+= p.size(); // FIXME: remove
+  } else {
+    _nin+= 1;
+    _bin+= p.size(); // FIXME: remove
+  }
+  return true;
+}
+
+bool Barnacle::translate_tun() {
+  GSOBuffer &p = *_gso;
+  const iphdr *ip = (const iphdr *)p.data();
+  bool out = ((ip->saddr & _cfg.netmask) == _cfg.subnet);
+  if (!translate_big(out))
+    return false;
+
+  if (_vh.flags & VNET_F_NEEDS_CSUM) {
+    // the rewriter took the partial checksum for a full one, redo it
+    unsigned off = _vh.csum_start + _vh.csum_offset;
+    if (off + sizeof(uint16_t) <= _hdr.size()) {
+      uint16_t check = pseudo_cksum(ip->saddr, ip->daddr, ip->protocol,
+                                    ntohs(ip->tot_len) - (ip->ihl << 2));
+      memcpy(p.data() + off, &check, sizeof(check));
+    }
+  }
+  return true;
+}
+
+// TUN replaces handle_in, handle_out and drain
+bool Barnacle::handle_tun() {
+  if (_sel.canRead(_tun.fd())) {
+    for (unsigned i = 0; i < _cfg.queuelen; ++i) { // don't starve ctrl
+      int l = _tun.recv(_vh, *_gso);
+      if (l == 0) {
+        break;
+      } else if (l < 0) {
+        return false;
+      }
+      if (translate_tun() && (_tun.send(_vh, _gso->data(), _gso->size()) < 0))
+        return false;
+    }
+  }
+  TunSocket::Header vh;
+  memset(&vh, 0, sizeof(vh)); // no offloads
+  while (_rw.nextFragment(_hdr) || _rw.nextPublished(_hdr)) {
+    if (_tun.send(vh, _hdr.data(), _hdr.size()) < 0)
+      return false;
   }
   return true;
 }
@@ -240,36 +572,150 @@ void Barnacle::cleanup() {
       _lastcleanup_tcp = now;
     DBG("--- Cleanup --- %d maps IN: %d %d OUT: %d %d\n",
         _rw.size(), _nin, _bin, _nout, _bout); // FIXME: remove
+    report();
+  }
+}
+
+// the counters since start, if they moved since the last report
+void Barnacle::report() {
+  char s[sizeof(_stats)];
+  snprintf(s, sizeof(s), "Stats: cache %u/%u, queue %u dropped %u marked %u thinned, "
+           "shed %u/%u, limited %u/%u, fast %u, slow %u dropped\n",
+           _rw.cacheHits(), _rw.cacheMisses(), _q.drops(), _q.marks(), _q.thinned(),
+           _rw.shedNew(), _rw.shedEstablished(), _rw.limited(), _rw.capped(),
+           _rw.offloaded(), _rw.slowDrops());
+  if (strcmp(s, _stats)) {
+    strcpy(_stats, s);
+    LOG("%s", s);
+  }
+}
+
+static uint64_t now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Busy-poll: for a while after the last packet, spin on select() instead of
+// sleeping in it, so that the next packet does not wait for a wakeup. Only
+// while packets come a few at a time: bigger batches share their wakeup, and
+// spinning for them would just burn the CPU.
+// Whatever is queued over its rate cap has to be woken up for.
+timeval *Barnacle::pollTimeout(timeval &tv) {
+  uint64_t now = now_us();
+  if (_cfg.busypoll && ((_batch >> 3) < SpinBatch) && (now - _last_rx < _cfg.busypoll)) {
+    tv.tv_sec = tv.tv_usec = 0;
+    return &tv;
+  }
+  if (!_q.throttled())
+    return NULL;
+  uint64_t next = _q.nextTime();
+  uint64_t wait = (next > now) ? next - now : 0;
+  tv.tv_sec = wait / 1000000;
+  tv.tv_usec = wait % 1000000;
+  return &tv;
+}
+
+// Coalescing: while packets keep waking us up more often than every
+// coalesce us, but only a few at a time, give the next batch that long to
+// build up before reading it. Once batches fill half the queue, waiting no
+// longer saves wakeups.
+void Barnacle::coalesce() {
+  if (!_cfg.coalesce || _cfg.busypoll)
+    return;
+  uint64_t now = now_us();
+  if ((now - _last_wake < _cfg.coalesce) && ((_batch >> 3) < _cfg.queuelen / 2)) {
+    timespec ts = { 0, (long)_cfg.coalesce * 1000 };
+    nanosleep(&ts, NULL);
+    now = now_us();
   }
+  _last_wake = now;
+}
+
+void Barnacle::countBatch(unsigned rx0) {
+  const Backend::Stats &s = _io->stats();
+  unsigned n = s.rx[Backend::WAN] + s.rx[Backend::LAN] - rx0;
+  if (!n)
+    return; // e.g. a spin, which would only dilute the average
+  _batch += n - (_batch >> 3);
+  if (_cfg.busypoll)
+    _last_rx = now_us();
 }
 
 // return false on I/O failure
 bool Barnacle::run() {
-  _sel.wantRead(_ins.fd(), !_q.full());
-  _sel.wantRead(_outs.fd(), !_q.full());
-  _sel.wantWrite(_ips.fd(), !_q.empty());
+  if (have_tun()) {
+    _sel.wantRead(_tun.fd(), true);
+  } else {
+    push_segments(); // resume the last GSO super-packet, if any
+    // don't overwrite _gso before all of it is in the queue
+    if (!_io->want(_sel, !_q.full() && !_seg_mss, !_q.empty()))
+      return false;
+  }
 
+  _proxy.want(_sel);
+  if (_nf.ok())
+    _sel.wantRead(_nf.fd(), true);
+  if (_rw.slowFd() >= 0)
+    _sel.wantRead(_rw.slowFd(), true);
   if (_ctrl.ok()) {
     _sel.wantRead(_ctrl.fd(), true);
   } else if (_ctrl_server.ok()) {
     _sel.wantRead(_ctrl_server.fd(), true);
   }
 
-  if ((_sel.select() <= 0) && (errno != EBADF)) {
+  timeval tv;
+  int n = have_tun() ? _sel.select() : _io->select(_sel, pollTimeout(tv));
+  if ((n < 0) && (errno != EBADF)) {
     return false;
   }
+  uint64_t now = 0;
+  if (_cfg.fq || _cfg.codel_target || _cfg.rwnd || _cfg.conn_rate || _load.enabled()) {
+    now = now_us();
+    _q.setTime(now); // for the sojourn time of what we queue and send
+    _rw.setTime(now);
+  }
+  if (_load.enabled()) {
+    _load.update(now, _lag, _q.size(), _q.maxsize(), _q.full());
+    _rw.setShedding(_load.shedFlows(), _load.shed());
+  }
 
   // update filter first
   if (have_ctrl())
     handle_ctrl();
+  _proxy.handle(_sel);
+  if (_nf.ok() && _sel.canRead(_nf.fd()))
+    _rw.conntrackEvents();
+  if ((_rw.slowFd() >= 0) && _sel.canRead(_rw.slowFd()))
+    _rw.slowWoken(); // see handle_fragments()
 
-  // LAN is faster, so first read packets from WAN
-  if (!handle_in() ||
-      !handle_out() ||
-      !drain())
-    return false;
+  if (have_tun()) {
+    if (!handle_tun())
+      return false;
+  } else {
+    if (_cfg.coalesce && (n > 0) && _q.empty() &&
+        (_io->canRecv(_sel, Backend::WAN) || _io->canRecv(_sel, Backend::LAN))) {
+      coalesce();
+      if (_load.enabled())
+        now = now_us(); // waiting on purpose is no lag
+    }
+    const Backend::Stats &s = _io->stats();
+    unsigned rx0 = s.rx[Backend::WAN] + s.rx[Backend::LAN];
+    // LAN is faster, so first read packets from WAN
+    if (!handle_in() ||
+        !handle_out())
+      return false;
+    if (_nf.ok() && !_q.full() && !_seg_mss) // the LAN is drained
+      _rw.commitConntrack();
+    countBatch(rx0);
+    handle_fragments();
+    if (!drain())
+      return false;
+  }
 
   cleanup();
+  if (_load.enabled())
+    _lag = now_us() - now;
   return true;
 }
 
@@ -27,17 +27,40 @@
 #else
 #include "natsym.hh"
 #endif
-#include "filtersocket.hh"
+#include "backend.hh"
+#include "fqcodel.hh"
+#include "tunsocket.hh"
+#include "xdpsocket.hh"
+#include "uring.hh"
+#include "tcpproxy.hh"
+#include "overload.hh"
+#include "tcoffload.hh"
+#include "nfoffload.hh"
 
 class Barnacle {
 public:
-  struct Config : public Rewriter::Config {
+  struct Config : public Rewriter::Config, public FlowQueue::Config {
     char      outif[IFNAMSIZ];
     char      inif[IFNAMSIZ];
     unsigned  queuelen;
     time_t    timeout; // in seconds (UDP and ICMP traffic)
     time_t    timeout_tcp; // in seconds (TCP only)
     char      ctrl[UNIX_PATH_MAX]; // for control
+    char      tunif[IFNAMSIZ]; // if set, use TUN instead of the sockets
+    bool      xdp;     // capture and inject with AF_XDP if possible
+    bool      uring;   // drive the sockets through io_uring if possible
+    bool      txring;  // inject to the WAN through a PACKET_TX_RING if possible
+    unsigned  busypoll; // in us, keep polling that long after the last packet, if batches are small
+    unsigned  coalesce; // in us, let small batches build up (unless busypoll)
+    unsigned  sndbuf;  // bytes the kernel may hold of what we inject, 0 for default
+    bool      rwnd;    // cap TCP receive windows near the downlink BDP
+    unsigned  proxy;   // port of the TCP proxy, 0 to rewrite TCP like the rest
+    char      proxy_cc[16]; // congestion control of the proxy upstream
+    unsigned  proxy_buf; // socket buffers of the proxy upstream, 0 for default
+    unsigned  overload; // in us, loop lag at which we start to shed load, 0 = never
+    bool      offload; // forward established flows in the kernel if possible
+    bool      flowtable; // or through netfilter, if TC is not there
+    bool      slowpath; // make and expire mappings on a thread of their own
   };
 protected:
   Config _cfg;
@@ -47,31 +70,78 @@ protected:
   LocalSocket   _ctrl; // the currently opened control socket
   LocalSocket::Message _msg;
 
-  PacketSocket  _outs;  // ppp capture
-  FilterSocket  _ins;   // wifi capture
-  IPSocket      _ips;   // injection
-  Queue<Buffer> _q;     // injection
+  FilterSocket  _ins;   // wifi capture, holds the MAC filter for all backends
+  FlowQueue     _q;     // injection
+  GSOBuffer     *_gso;  // packet from _tun, or too big for _q
+
+  SocketIO      _sio;
+  UringIO       _uio;
+  XdpIO         _xio;
+  Backend       *_io;   // one of the above, or the one we were given
+  Backend       *_given;
+  unsigned      _toobig; // last seen in the stats of _io
+
+  TunSocket     _tun;   // alternative to all of the above
+  TunSocket::Header _vh;
+  Buffer        _hdr;   // headers of _gso for the rewriter
+  unsigned      _seg_off; // next segment of _gso to push_segments()
+  unsigned      _seg_mss; // 0 if there's nothing left
+  in_addr_t     _seg_client; // LAN address behind _gso, 0 if inbound
 
   Selector      _sel;
+  TcpProxy      _proxy; // takes TCP from the LAN if enabled
 
   Rewriter      _rw;
+  TcOffload     _offload; // fast path of _rw, if enabled
+  NfOffload     _nf;      // or this one
   time_t        _lastcleanup;     // time of last cleanup
   time_t        _lastcleanup_tcp; // time of last cleanup
 
-  int _mtu;
+  // loop policy, see pollTimeout() and coalesce()
+  uint64_t      _last_rx;   // in us, when we last got packets
+  uint64_t      _last_wake; // in us
+  unsigned      _batch;     // packets per wakeup (that got any), moving average x8
+  enum { SpinBatch = 4 };   // no busy-poll from this _batch on
+
+  Overload      _load;
+  uint64_t      _lag;       // in us, of the last pass if _load is enabled()
+
+  int _mtu;      // uplink
+  int _lan_mtu;
+  in_addr_t _lan_addr; // our address on inif
+  Buffer _frag; // fragment being sent
 
   // stats
   int _nin, _nout, _bin, _bout; // FIXME: remove
+  char _stats[160]; // last report()
 
   bool have_ctrl() { return _cfg.ctrl[0] != '\0'; }
+  bool have_tun() { return _cfg.tunif[0] != '\0'; }
+  bool attachFilters();
   void handle_ctrl();
   bool handle_in();
   bool handle_out();
+  void arrived_in(Buffer &b);
+  void arrived_out(Buffer &b);
+  bool offloaded(Buffer &b, int side);
+  void push_segments();
+  void handle_fragments();
+  unsigned mtu(const Buffer &b) const;
+  bool updateMtu();
+  bool bounce(Buffer &b, unsigned mtu);
   bool drain();
+  bool translate_big(bool out);
+  bool translate_tun();
+  bool handle_tun();
+  timeval *pollTimeout(timeval &tv);
+  void coalesce();
+  void countBatch(unsigned rx0);
   void cleanup();
+  void report();
 
 public:
-  Barnacle(const Config &c) : _cfg(c), _q(c.queuelen), _rw(c) { }
+  /// io replaces the sockets, e.g. LoopIO to benchmark
+  Barnacle(const Config &c, Backend *io = 0);
   ~Barnacle();
 
   // configure ctrl
@@ -80,6 +150,8 @@ public:
   bool start();
   // return false on I/O failure
   bool run();
+  // undo what the kernel keeps after we are gone, before exit()
+  void stop();
 };
 
 #endif //INCLUDED_BARNACLE_HH
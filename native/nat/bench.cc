@@ -0,0 +1,123 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Benchmark of the whole Barnacle loop, without the kernel: LoopIO replays
+ * UDP packets from a number of LAN clients and the replies to them.
+ *   usage: bench [seconds] [clients] [size]
+ */
+
+#define TAG "BENCH: "
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "barnacle.hh"
+
+static double now() {
+  timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void make_udp(Buffer &b, in_addr_t src, in_addr_t dst,
+                     uint16_t sport, uint16_t dport, unsigned len) {
+  b.clear();
+  b.put(sizeof(iphdr) + sizeof(udphdr) + len);
+  iphdr *ip = (iphdr *)b.data();
+  ip->version = IPVERSION;
+  ip->ihl = 5;
+  ip->ttl = 64;
+  ip->tot_len = htons(b.size());
+  ip->protocol = IPPROTO_UDP;
+  ip->saddr = src;
+  ip->daddr = dst;
+  ip->check = in_cksum(ip, sizeof(iphdr));
+  udphdr *udp = (udphdr *)transport_header(b);
+  udp->source = htons(sport);
+  udp->dest = htons(dport);
+  udp->len = htons(sizeof(udphdr) + len);
+}
+
+int main(int argc, const char **argv) {
+  double secs = (argc > 1) ? atof(argv[1]) : 2.0;
+  unsigned clients = (argc > 2) ? atoi(argv[2]) : 16;
+  unsigned size = (argc > 3) ? atoi(argv[3]) : 64;
+  if (!clients || (clients > 250) || (size > 1400)) {
+    fprintf(stderr, "usage: %s [seconds] [clients <= 250] [size <= 1400]\n", argv[0]);
+    return 1;
+  }
+
+  Barnacle::Config c;
+  memset(&c, 0, sizeof(c));
+  strcpy(c.outif, "wan");
+  strcpy(c.inif, "lan");
+  c.queuelen    = 100;
+  c.firstport   = 32000;
+  c.numports    = 1000;
+  c.timeout     = 30;
+  c.timeout_tcp = 90;
+
+  LoopIO io(2 * clients + c.queuelen);
+  in_addr_t mask = inet_addr("255.255.255.0");
+  io.setLink(Backend::WAN, 1500, inet_addr("10.0.0.1"), mask);
+  io.setLink(Backend::LAN, 1500, inet_addr("192.168.5.1"), mask);
+  Barnacle brncl(c, &io);
+  if (!brncl.start()) {
+    fprintf(stderr, "start failed\n");
+    return 1;
+  }
+
+  // the first pass creates the mappings, the replies are made from what was sent
+  Buffer b;
+  in_addr_t server = inet_addr("8.8.8.8");
+  uint32_t client = ntohl(inet_addr("192.168.5.2"));
+  for (unsigned i = 0; i < clients; ++i) {
+    make_udp(b, htonl(client + i), server, 4000 + i, 53, size);
+    io.push(Backend::LAN, b);
+  }
+  while (io.stats().tx < clients) {
+    if (!brncl.run())
+      return 1;
+  }
+  Queue<Buffer> &sent = io.sent();
+  for (; !sent.empty(); sent.popHead()) {
+    const Buffer &s = sent.head();
+    const iphdr *ip = (const iphdr *)s.data();
+    const udphdr *udp = (const udphdr *)(s.data() + (ip->ihl << 2));
+    make_udp(b, ip->daddr, ip->saddr, ntohs(udp->dest), ntohs(udp->source), size);
+    io.push(Backend::WAN, b);
+  }
+
+  io.setReplay(true);
+  unsigned rx0 = io.stats().rx[Backend::WAN] + io.stats().rx[Backend::LAN];
+  unsigned tx0 = io.stats().tx;
+  double start = now(), elapsed = 0;
+  while (elapsed < secs) {
+    for (unsigned i = 0; i < 1024; ++i) {
+      if (!brncl.run())
+        return 1;
+      sent.clear();
+    }
+    elapsed = now() - start;
+  }
+  unsigned rx = io.stats().rx[Backend::WAN] + io.stats().rx[Backend::LAN] - rx0;
+  unsigned tx = io.stats().tx - tx0;
+  printf("%u clients, %u bytes: %u in, %u out in %.2fs, %.0f pps\n",
+         clients, size, rx, tx, elapsed, tx / elapsed);
+  return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: classic BPF socket filters */
+#ifndef INCLUDED_BPF_HH
+#define INCLUDED_BPF_HH
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h> // for BPF_XX and sock_fprog
+#include <linux/bpf.h> // for eBPF, see sys_bpf()
+
+/// bpf(2), for the eBPF maps and programs of the XDP and TC fast paths
+static inline int sys_bpf(int cmd, bpf_attr &attr) {
+  return ::syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+/**
+ * Builder for a classic BPF program, to be attached to a capture socket so
+ * that packets we would drop anyway never get copied to userspace.
+ *
+ * Jumps are relative (0 = next instruction) or to one of the symbolic
+ * targets ACCEPT and DROP which are appended and resolved by finish().
+ * NOTE: on SOCK_DGRAM packet sockets, offset 0 is the IP header, and the
+ * link-layer header is at SKF_LL_OFF.
+ */
+class BPFProgram {
+public:
+  static const unsigned MaxLen = 256;
+  enum { ACCEPT = 0xFF, DROP = 0xFE };
+protected:
+  sock_filter _insns[MaxLen];
+  unsigned short _len;
+  bool _ok;
+
+  void add(uint16_t code, uint8_t jt, uint8_t jf, uint32_t k) {
+    if (_len >= MaxLen) { _ok = false; return; }
+    sock_filter &f = _insns[_len++];
+    f.code = code; f.jt = jt; f.jf = jf; f.k = k;
+  }
+
+  bool resolve(uint8_t &j, unsigned i, unsigned accept, unsigned drop) {
+    unsigned target;
+    if (j == ACCEPT)    target = accept;
+    else if (j == DROP) target = drop;
+    else return true;
+    if (target - i - 1 > 0xFF) return false; // out of jump range
+    j = target - i - 1;
+    return true;
+  }
+
+public:
+  BPFProgram() : _len(0), _ok(true) {}
+
+  void clear() { _len = 0; _ok = true; }
+  void stmt(uint16_t code, uint32_t k) { add(code, 0, 0, k); }
+  void jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf) {
+    add(code, jt, jf, k);
+  }
+
+  /// append the return statements, resolve ACCEPT and DROP
+  bool finish() {
+    unsigned accept = _len, drop = _len + 1;
+    stmt(BPF_RET | BPF_K, 0xFFFFFFFF);
+    stmt(BPF_RET | BPF_K, 0);
+    for (unsigned i = 0; _ok && (i < accept); ++i) {
+      sock_filter &f = _insns[i];
+      if ((BPF_CLASS(f.code) != BPF_JMP) || (BPF_OP(f.code) == BPF_JA))
+        continue;
+      _ok = resolve(f.jt, i, accept, drop) && resolve(f.jf, i, accept, drop);
+    }
+    return _ok;
+  }
+
+  bool ok() const { return _ok; }
+  unsigned size() const { return _len; }
+  const sock_filter *insns() const { return _insns; }
+
+  /// replaces whatever filter was attached, atomically
+  bool attach(int fd) const {
+    if (!_ok) return false;
+    sock_fprog prog = { _len, const_cast<sock_filter *>(_insns) };
+    return ::setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == 0;
+  }
+};
+
+#endif // INCLUDED_BPF_HH
@@ -36,6 +36,7 @@ protected:
 public:
   BufferT() : _size(0) {}
   void clear() { ::memset(_buf, 0, MaxSize); _size = 0; }
+  void reset() { _size = 0; } // like clear() without the memset
   char *data() { return _buf; }
   char *tail() { return _buf + _size; }
   const char *data() const { return _buf; }
@@ -43,9 +44,12 @@ public:
   unsigned room() const { return MaxSize - _size; }
   void put(unsigned n) { _size+= n; assert(_size < MaxSize); }
   void trim(unsigned n) { assert(n < _size); _size = n; }
+  /// explicit copy, used sparingly
+  void copy(const BufferT &b) { ::memcpy(_buf, b._buf, b._size); _size = b._size; }
 };
 
 typedef BufferT<> Buffer;
+typedef BufferT<0x10000> GSOBuffer; // fits any IP packet, e.g. TSO/GRO ones
 
 
 /**
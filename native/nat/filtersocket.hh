@@ -20,7 +20,9 @@
 #ifndef INCLUDED_FILTERSOCKET_HH
 #define INCLUDED_FILTERSOCKET_HH
 
+#include <stddef.h> // for offsetof
 #include "socket.hh"
+#include "bpf.hh"
 #include "hashtable.hh"
 #include "macaddress.hh"
 
@@ -29,16 +31,77 @@ protected:
   typedef HashTable< HashAdapter<MACAddress> > hash_t;
   hash_t _hash;
   bool filtering;
+  in_addr_t _subnet;  // LAN, in network order
+  in_addr_t _netmask;
+
+  /**
+   * The socket filter drops broadcast and LAN-local destinations (which the
+   * rewriter ignores) and, when filtering, MACs that are not allowed.
+   */
+  bool compile(BPFProgram &p, bool macs) const {
+    p.clear();
+    p.stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(iphdr, daddr));
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFFFFFF, BPFProgram::DROP, 0);
+    p.stmt(BPF_ALU | BPF_AND | BPF_K, ntohl(_netmask));
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(_subnet), BPFProgram::DROP, 0);
+    if (macs) {
+      // source address in the link-layer header
+      for (hash_t::const_iterator it = _hash.begin(); it.live(); ++it) {
+        const uint8_t *a = it->u.addr;
+        p.stmt(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + 6);
+        p.jump(BPF_JMP | BPF_JEQ | BPF_K,
+               (a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3], 0, 2);
+        p.stmt(BPF_LD | BPF_H | BPF_ABS, SKF_LL_OFF + 10);
+        p.jump(BPF_JMP | BPF_JEQ | BPF_K, (a[4] << 8) | a[5], BPFProgram::ACCEPT, 0);
+      }
+      p.stmt(BPF_RET | BPF_K, 0);
+    }
+    return p.finish();
+  }
+
+  /// (re)attach the socket filter, replaces the old one atomically
+  void attach() {
+    if (!ok() || !_netmask) return; // not configured yet
+    BPFProgram p;
+    // if the allow list is too long, leave MAC filtering to recv()
+    if (!(compile(p, filtering) || compile(p, false)) || !p.attach(_fd))
+      DBG("Could not attach LAN filter: %s\n", strerror(errno));
+  }
+
 public:
-  FilterSocket(bool filt = false) : filtering(filt) {}
+  FilterSocket(bool filt = false) : filtering(filt), _subnet(0), _netmask(0) {}
 
   void reset() {
     // FIXME: this is C&P from PacketSocket::PacketSocket()
     _fd = ::socket(AF_PACKET, SOCK_DGRAM | O_NONBLOCK, htons(ETHERTYPE_IP));
+    _big = 0;
+    _spilled = false;
+    _status = 0;
     _hash.clear();
   }
 
-  void setFiltering(bool filt) { filtering = filt; }
+  /// in network order, call after bind()
+  void setSubnet(in_addr_t subnet, in_addr_t netmask) {
+    _subnet = subnet;
+    _netmask = netmask;
+    attach();
+  }
+
+  /// the filter for an XDP program, see XdpSocket::attach()
+  bool program(BPFProgram &p) const {
+    return compile(p, filtering) || compile(p, false);
+  }
+
+  /// for when the filter could not check it
+  bool allowed(const uint8_t *mac) const {
+    return !filtering || _hash.find(MACAddress(mac)).live();
+  }
+
+  void setFiltering(bool filt) {
+    if (filt == filtering) return;
+    filtering = filt;
+    attach();
+  }
 
   void setFilter(const MACAddress &addr, bool allowed) {
     const uint8_t *a = addr.addr;
@@ -50,24 +113,22 @@ public:
       _hash.erase(addr);
       assert(!_hash.find(addr).live());
     }
+    attach();
   }
 
+  /// in network order, on the LAN subnet
+  bool local(in_addr_t addr) const { return _netmask && ((addr & _netmask) == _subnet); }
+
   /// return 0 on try again, -1 on fail
   int recv(Buffer &b) {
-    b.clear();
-    sockaddr_ll sll;
-    socklen_t slen = sizeof(sll);
-    int len = ::recvfrom(_fd, b.data(), b.room(), MSG_TRUNC, (sockaddr *)&sll, &slen);
+    int len = receive(b, _from);
     if (len > 0) {
-      if(sll.sll_pkttype != PACKET_OUTGOING) {
-        if (filtering && !_hash.find(sll.sll_addr).live())
-          return 0; // no packet
-        b.put(len);
-        return len;
-      }
-      return 0;
+      if (_from.sll_pkttype == PACKET_OUTGOING)
+        return 0;
+      if (filtering && !_hash.find(_from.sll_addr).live())
+        return 0; // no packet
     }
-    return ((len < 0) && (errno == EAGAIN)) ? 0 : -1;
+    return len;
   }
 };
 
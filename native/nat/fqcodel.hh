@@ -0,0 +1,669 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: flow queuing with CoDel */
+#ifndef INCLUDED_FQCODEL_HH
+#define INCLUDED_FQCODEL_HH
+
+#include <stdint.h>
+#include "buffer.hh"
+#include "hashmap.hh"
+#include "natcommon.hh" // for IPFlowId
+
+#ifndef IPTOS_ECN_MASK
+#define IPTOS_ECN_MASK  0x03
+#define IPTOS_ECN_CE    0x03
+#endif
+
+/**
+ * A Queue<Buffer> for the injection queue that schedules like FQ-CoDel
+ * (RFC 8290), one level up per LAN client. Each client gets a class per
+ * direction, served by weighted deficit round robin, so a backup on one
+ * client only takes its share of the uplink. A class may be capped by a token
+ * bucket; once it runs out, it waits on a separate list until setTime()
+ * refills it. Packets of a class are hashed by IPFlowId into ClassFlows
+ * sub-queues served by deficit round robin, new flows first, so that a sparse
+ * flow (DNS, ssh, VoIP) does not wait behind a bulk one. In each sub-queue,
+ * CoDel (RFC 8289) drops packets, or marks them if ECN-capable, once they
+ * keep sitting in the queue for longer than target. When there's no room and
+ * the queue has been standing, the head of the longest sub-queue of the
+ * longest class goes.
+ *
+ * With ack_prio, pure ACKs going up skip all that in a lane of their own
+ * (they are small, and a download waits for them), and with ack_thin a
+ * queued one is replaced by the next cumulative ACK of its flow, see
+ * supersedes(). They are still charged to their class, and only take the
+ * lane while it is within its share of the queue and the class within its
+ * cap, else they queue with the rest.
+ *
+ * Clients are told apart by their LAN address, see setLan() and pushTail().
+ * The first MaxClients - 1 get a class of their own, the rest share one.
+ * Without fq all packets share one sub-queue, and without a target there is
+ * no CoDel, so with neither it is a plain FIFO.
+ *
+ * NOTE: unlike Queue, empty() picks the next packet and may drop some, so
+ * call it before head(). The packet stays at the head until popHead().
+ */
+class FlowQueue {
+public:
+  struct Config {
+    bool      fq;             // one sub-queue per flow, else FIFO
+    unsigned  codel_target;   // in us, 0 for no CoDel
+    unsigned  codel_interval; // in us
+    bool      ecn;            // mark instead of drop when ECN-capable
+    bool      ack_prio;       // pure ACKs to the WAN go first
+    bool      ack_thin;       // and replace the ones they make redundant
+  };
+
+  static const unsigned FlowBits = 5;
+  static const unsigned ClassFlows = 1 << FlowBits;
+  static const unsigned MaxClients = 64;
+  static const int Quantum = 1514; // bytes per round and unit of weight
+  static const unsigned AckBits = 6;
+  static const unsigned LaneShare = 4; // at most 1/LaneShare of the queue
+
+protected:
+  struct Flow {
+    int       head, tail;   // packets, -1 if none
+    unsigned  bytes;
+    int       deficit;
+    int       next;         // in the list of new or old flows
+    bool      listed;
+    // CoDel
+    bool      dropping;
+    unsigned  count, lastcount;
+    uint64_t  first_above;  // 0 if below target
+    uint64_t  drop_next;
+  };
+  struct List {
+    int head, tail;
+  };
+  /// one direction of a client
+  struct Class {
+    Flow      flows[ClassFlows];
+    List      fresh, old;   // of flows
+    unsigned  size, bytes;
+    int       deficit;
+    unsigned  weight;
+    unsigned  rate;         // bytes per second, 0 for no cap
+    int64_t   tokens;       // in bytes x 10^6, i.e., rate x us
+    uint64_t  filled;       // in us, when tokens were last added
+    int       next;         // in _active or _throttled
+    bool      listed;
+  };
+
+  Config    _cfg;
+  unsigned  _num;
+  Buffer    *_bufs;
+  int       *_next;   // next packet in the same flow, or the next free one
+  unsigned  *_len;    // as enqueued
+  uint64_t  *_stamp;  // in us, when enqueued
+  int       _free;    // -1 if none
+  int       _spare;   // tail() while none is free, see pushTail()
+  Class     *_classes; // 2 per client, up then down
+  List      _active, _throttled; // of classes
+  in_addr_t _subnet, _netmask; // of the LAN, 0 if unknown
+  HashMap<in_addr_t, unsigned> _slots; // client address -> index, 0 is shared
+  in_addr_t _addrs[MaxClients];
+  uint8_t   _recent[256]; // index by the last byte of the address, to skip _slots
+  List      _lane;    // pure ACKs, linked by _next
+  unsigned  _lanesize;
+  int       _acks[1 << AckBits]; // last ACK in _lane by hash of flow, or -1
+  unsigned  _size;    // in the flows and _lane
+  int       _cur;     // picked by empty(), -1 if none
+  int       _curclass; // -1 for _lane
+  unsigned  _curflow;
+  uint64_t  _now;
+  unsigned  _drops, _marks, _thinned;
+  unsigned  _evicted; // since the last setTime()
+  mutable int _victim; // class found by victim(), Stale until the queue changes
+  mutable unsigned _vflow;
+  enum { Stale = -2 };
+
+  template <typename T>
+  static void push(T *v, List &l, int i) {
+    v[i].next = -1;
+    if (l.tail < 0) l.head = i; else v[l.tail].next = i;
+    l.tail = i;
+  }
+  template <typename T>
+  static void pop(T *v, List &l) {
+    l.head = v[l.head].next;
+    if (l.head < 0) l.tail = -1;
+  }
+
+  bool lan(in_addr_t addr) const {
+    return _netmask && ((addr & _netmask) == _subnet);
+  }
+  /// index of the client, a new one if there's room
+  unsigned slot(in_addr_t addr) {
+    uint8_t &r = _recent[ntohl(addr) & 0xff];
+    if (r && (_addrs[r] == addr)) return r;
+    unsigned s = _slots.get(addr);
+    if (s) return r = s;
+    for (s = 1; s < MaxClients; ++s) {
+      if (!_addrs[s]) break;
+      const Class &up = _classes[2 * s], &down = _classes[2 * s + 1];
+      // reuse one that is idle and not configured
+      if (!up.size && !down.size && (up.weight == 1) && (down.weight == 1) &&
+          !up.rate && !down.rate) {
+        _slots.erase(_addrs[s]);
+        break;
+      }
+    }
+    if (s == MaxClients) return 0;
+    _addrs[s] = addr;
+    _slots.set(addr, s);
+    return r = s;
+  }
+  /// the class of a packet from or to the LAN client
+  unsigned classOf(const Buffer &b, in_addr_t client) {
+    if (!_cfg.fq || !_netmask) return 0;
+    const iphdr *ip = (const iphdr *)b.data();
+    bool down = lan(ip->daddr);
+    if (!client)
+      client = down ? ip->daddr : ip->saddr;
+    return 2 * (lan(client) ? slot(client) : 0) + down;
+  }
+  unsigned classify(const Buffer &b) const {
+    if (!_cfg.fq) return 0;
+    IPFlowId id(b);
+    if (((const iphdr *)b.data())->frag_off & htons(IP_MF | IP_OFFMASK))
+      id.sport = id.dport = 0; // keep the fragments of a packet together
+    return ((uint32_t)id.hashcode() * 2654435761u) >> (32 - FlowBits);
+  }
+
+  static unsigned ackSlot(const Buffer &b) {
+    return ((uint32_t)IPFlowId(b).hashcode() * 2654435761u) >> (32 - AckBits);
+  }
+  /// only timestamps, i.e., nothing that a later ACK doesn't tell
+  static bool plain(const tcphdr *tcp) {
+    const uint8_t *opt = (const uint8_t *)tcp + sizeof(tcphdr);
+    const uint8_t *end = (const uint8_t *)tcp + (tcp->doff << 2);
+    while (opt < end) {
+      if (*opt == TCPOPT_EOL) break;
+      if (*opt == TCPOPT_NOP) { ++opt; continue; }
+      if ((*opt != TCPOPT_TIMESTAMP) || (opt + 1 >= end) || (opt[1] < 2))
+        return false;
+      opt += opt[1];
+    }
+    return true;
+  }
+  /// the ACK in b makes the queued one in old redundant: same flow and
+  /// flags, no SACK, and it acknowledges more, or as much with a new window.
+  /// NOTE: a duplicate ACK is not, the sender counts them to retransmit
+  static bool supersedes(const Buffer &b, const Buffer &old) {
+    const tcphdr *t = pure_ack(b), *o = pure_ack(old);
+    const iphdr *ip = (const iphdr *)b.data(), *oip = (const iphdr *)old.data();
+    if (!o) return false;
+    int32_t d = ntohl(t->ack_seq) - ntohl(o->ack_seq);
+    return (ip->saddr == oip->saddr) && (ip->daddr == oip->daddr) &&
+        (t->source == o->source) && (t->dest == o->dest) &&
+        (((const uint8_t *)t)[13] == ((const uint8_t *)o)[13]) &&
+        ((d > 0) || ((d == 0) && (t->window != o->window))) &&
+        plain(t) && plain(o);
+  }
+  /// queue the pure ACK in free buffer i, charged to class k, or overwrite
+  /// the queued one of its flow with it, so that it goes out in that one's place
+  void pushAck(int i, unsigned k) {
+    unsigned h = ackSlot(_bufs[i]);
+    int j = _acks[h];
+    if (_cfg.ack_thin && (j >= 0) && supersedes(_bufs[i], _bufs[j])) {
+      Buffer &b = _bufs[j];
+      b.clear();
+      b.put(_bufs[i].size());
+      memcpy(b.data(), _bufs[i].data(), b.size());
+      _len[j] = b.size();
+      ++_thinned;
+      return; // i stays free
+    }
+    Class &c = _classes[k];
+    c.deficit -= _bufs[i].size();
+    if (c.rate) {
+      // NOTE: if that makes it ineligible, popHead() throttles it after its next packet
+      refill(c);
+      c.tokens -= (int64_t)_bufs[i].size() * 1000000;
+    }
+    _free = _next[i];
+    _next[i] = -1;
+    if (_lane.tail < 0) _lane.head = i; else _next[_lane.tail] = i;
+    _lane.tail = i;
+    _len[i] = _bufs[i].size();
+    _stamp[i] = _now;
+    _acks[h] = i;
+    ++_lanesize;
+    ++_size;
+  }
+
+  int quantum(const Class &c) const { return Quantum * c.weight; }
+  /// bucket size, 20ms worth of rate but at least a few packets
+  int64_t burst(const Class &c) const {
+    int64_t b = c.rate / 50;
+    if (b < 4 * Quantum) b = 4 * Quantum;
+    return b * 1000000;
+  }
+  void refill(Class &c) {
+    if (!c.rate) return;
+    c.tokens += (int64_t)(_now - c.filled) * c.rate;
+    if (c.tokens > burst(c)) c.tokens = burst(c);
+    c.filled = _now;
+  }
+  static bool eligible(const Class &c) { return !c.rate || (c.tokens > 0); }
+  /// capped classes that got their tokens back return to the round
+  void unthrottle() {
+    int k = _throttled.head;
+    _throttled.head = _throttled.tail = -1;
+    while (k >= 0) {
+      Class &c = _classes[k];
+      int n = c.next;
+      refill(c);
+      if (!eligible(c)) {
+        push(_classes, _throttled, k);
+      } else if (c.size) {
+        push(_classes, _active, k);
+      } else {
+        c.listed = false;
+      }
+      k = n;
+    }
+  }
+
+  void release(int i) {
+    _next[i] = _free;
+    _free = i;
+  }
+  /// unlink the head of fl, -1 if none
+  int dequeue(Class &c, Flow &fl) {
+    int i = fl.head;
+    if (i < 0) return -1;
+    fl.head = _next[i];
+    if (fl.head < 0) fl.tail = -1;
+    fl.bytes -= _len[i];
+    c.bytes -= _len[i];
+    --c.size;
+    --_size;
+    _victim = Stale;
+    return i;
+  }
+  void drop(int i) {
+    ++_drops;
+    release(i);
+  }
+  /// set CE if the packet is ECN-capable
+  bool mark(int i) {
+    if (!_cfg.ecn) return false;
+    iphdr *ip = (iphdr *)_bufs[i].data();
+    if (!(ip->tos & IPTOS_ECN_MASK)) return false;
+    if ((ip->tos & IPTOS_ECN_MASK) != IPTOS_ECN_CE) {
+      ip->tos |= IPTOS_ECN_CE;
+      ip->check = 0;
+      ip->check = in_cksum(ip, ip->ihl << 2);
+    }
+    ++_marks;
+    return true;
+  }
+
+  static uint64_t isqrt(uint64_t x) {
+    uint64_t r = 0, bit = (uint64_t)1 << 62;
+    while (bit > x) bit >>= 2;
+    for (; bit; bit >>= 2) {
+      if (x >= r + bit) {
+        x -= r + bit;
+        r = (r >> 1) + bit;
+      } else {
+        r >>= 1;
+      }
+    }
+    return r;
+  }
+  uint64_t controlLaw(uint64_t t, unsigned count) const {
+    return t + (uint64_t)_cfg.codel_interval * 1024 / isqrt((uint64_t)count << 20);
+  }
+  /// dequeue() and tell if CoDel would drop it
+  int codelDequeue(Class &c, Flow &fl, bool &ok) {
+    ok = false;
+    int i = dequeue(c, fl);
+    if (i < 0) {
+      fl.first_above = 0;
+      return -1;
+    }
+    if ((_now - _stamp[i] < _cfg.codel_target) || (fl.bytes <= (unsigned)Quantum)) {
+      fl.first_above = 0;
+    } else if (!fl.first_above) {
+      fl.first_above = _now + _cfg.codel_interval;
+    } else {
+      ok = (_now >= fl.first_above);
+    }
+    return i;
+  }
+  /// the next packet of fl that CoDel lets through, -1 if none
+  int next(Class &c, Flow &fl) {
+    bool ok;
+    int i = codelDequeue(c, fl, ok);
+    if (!_cfg.codel_target || (i < 0))
+      return i;
+    if (fl.dropping) {
+      if (!ok) {
+        fl.dropping = false;
+      } else {
+        while (fl.dropping && (_now >= fl.drop_next)) {
+          ++fl.count;
+          if (mark(i)) {
+            fl.drop_next = controlLaw(fl.drop_next, fl.count);
+            break;
+          }
+          drop(i);
+          i = codelDequeue(c, fl, ok);
+          if (!ok)
+            fl.dropping = false;
+          else
+            fl.drop_next = controlLaw(fl.drop_next, fl.count);
+        }
+      }
+    } else if (ok) {
+      if (!mark(i)) {
+        drop(i);
+        i = codelDequeue(c, fl, ok);
+      }
+      fl.dropping = true;
+      unsigned delta = fl.count - fl.lastcount;
+      fl.count = ((delta > 1) && (_now - fl.drop_next < 16 * (uint64_t)_cfg.codel_interval)) ? delta : 1;
+      fl.lastcount = fl.count;
+      fl.drop_next = controlLaw(_now, fl.count);
+    }
+    return i;
+  }
+  /// the next packet of class c, -1 if none, flow f is where it came from
+  int pick(Class &c, unsigned &f) {
+    while (c.size) {
+      bool fresh = (c.fresh.head >= 0);
+      List &l = fresh ? c.fresh : c.old;
+      f = l.head;
+      Flow &fl = c.flows[f];
+      if (fl.deficit <= 0) {
+        fl.deficit += Quantum;
+        pop(c.flows, l);
+        push(c.flows, c.old, f);
+        continue;
+      }
+      int i = next(c, fl);
+      if (i < 0) {
+        pop(c.flows, l);
+        if (fresh) push(c.flows, c.old, f); // so it can't cut in line again
+        else fl.listed = false;
+        continue;
+      }
+      return i;
+    }
+    return -1;
+  }
+  /// the longest flow of the longest class, if it has been standing for
+  /// longer than target, -1 if none, e.g. when the queue just filled up in
+  /// one go. full() asks for every packet read, so it is kept until the
+  /// next push, pop or setTime()
+  int victim(unsigned &f) const {
+    if (_victim != Stale) {
+      f = _vflow;
+      return _victim;
+    }
+    _victim = -1;
+    unsigned most = 0;
+    int k = -1;
+    for (unsigned j = 0; j < 2 * MaxClients; ++j) {
+      if (_classes[j].bytes > most) {
+        most = _classes[j].bytes;
+        k = j;
+      }
+    }
+    if (k < 0) return -1;
+    const Class &c = _classes[k];
+    most = 0;
+    for (unsigned j = 0; j < ClassFlows; ++j) {
+      if (c.flows[j].bytes > most) {
+        most = c.flows[j].bytes;
+        f = j;
+      }
+    }
+    if (_now - _stamp[c.flows[f].head] < _cfg.codel_target)
+      return -1;
+    _vflow = f;
+    return _victim = k;
+  }
+  /// drop the head of the longest flow
+  void evict() {
+    unsigned f = 0;
+    int k = victim(f);
+    if (k < 0) return;
+    drop(dequeue(_classes[k], _classes[k].flows[f]));
+    ++_evicted;
+  }
+
+public:
+  FlowQueue(unsigned size, const Config &c)
+    : _cfg(c), _num(size ? size : 1), _bufs(new Buffer[_num + 1]), _next(new int[_num + 1]),
+      _len(new unsigned[_num + 1]), _stamp(new uint64_t[_num + 1]),
+      _classes(new Class[2 * MaxClients]), _subnet(0), _netmask(0), _now(0),
+      _drops(0), _marks(0), _thinned(0) {
+    clear();
+  }
+  ~FlowQueue() {
+    delete [] _bufs;
+    delete [] _next;
+    delete [] _len;
+    delete [] _stamp;
+    delete [] _classes;
+  }
+
+  /// where the clients are, until then there is one class per direction
+  void setLan(in_addr_t subnet, in_addr_t netmask) {
+    _subnet = subnet;
+    _netmask = netmask;
+  }
+  /// share of a client relative to the others, and caps in bytes per second
+  /// in each direction, 0 for none; return false if there's no room for it
+  bool setClient(in_addr_t addr, unsigned weight, unsigned up, unsigned down) {
+    unsigned s = lan(addr) ? slot(addr) : 0;
+    if (!s) return false;
+    for (unsigned d = 0; d < 2; ++d) {
+      Class &c = _classes[2 * s + d];
+      c.weight = weight ? weight : 1;
+      c.rate = d ? down : up;
+      c.tokens = c.rate ? burst(c) : 0;
+      c.filled = _now;
+    }
+    unthrottle(); // e.g. its cap was just lifted
+    return true;
+  }
+
+  /// the time to stamp and judge packets by, in us, once per burst
+  void setTime(uint64_t now) {
+    _now = now;
+    _evicted = 0;
+    _victim = Stale;
+    unthrottle();
+  }
+  /// is all that is queued over its cap?
+  bool throttled() const {
+    return (_active.head < 0) && (_lane.head < 0) && (_throttled.head >= 0);
+  }
+  /// when the first capped class may send again, in us
+  uint64_t nextTime() const {
+    uint64_t t = ~(uint64_t)0;
+    for (int k = _throttled.head; k >= 0; k = _classes[k].next) {
+      const Class &c = _classes[k];
+      if (!c.rate) continue; // not for long, see setClient()
+      uint64_t at = c.filled + (uint64_t)(1 - c.tokens) / c.rate + 1;
+      if (at < t) t = at;
+    }
+    return t;
+  }
+  unsigned size() const { return _size + (_cur >= 0); }
+  unsigned maxsize() const { return _num; }
+  /// dropped and marked by CoDel or for room
+  unsigned drops() const { return _drops; }
+  unsigned marks() const { return _marks; }
+  /// ACKs replaced by later ones
+  unsigned thinned() const { return _thinned; }
+
+  /// is the tail unavailable? with fq, not while the longest flow could give
+  /// up a packet, but only a queue's worth per burst, so that reading ends
+  bool full() const {
+    unsigned f = 0;
+    return (_free < 0) && !(_cfg.fq && (_evicted < _num) && (victim(f) >= 0));
+  }
+  /// place to add to the queue
+  Buffer &tail() {
+    return _bufs[(_free >= 0) ? _free : _spare];
+  }
+  /// the LAN address of the client, if the packet no longer has it, e.g.
+  /// after translation, else 0 to take it from the packet
+  void pushTail(in_addr_t client = 0) {
+    if (_free < 0) {
+      // only now that there is a packet for it, make room and swap it in
+      evict();
+      assert(_free >= 0);
+      int j = _free;
+      _next[_spare] = _next[j];
+      _free = _spare;
+      _spare = j;
+    }
+    int i = _free;
+    unsigned k = classOf(_bufs[i], client);
+    if (_cfg.ack_prio && !lan(((const iphdr *)_bufs[i].data())->daddr) &&
+        ((_lanesize + 1) * LaneShare <= _num) && eligible(_classes[k]) &&
+        pure_ack(_bufs[i])) {
+      pushAck(i, k);
+      return;
+    }
+    _free = _next[i];
+    _next[i] = -1;
+    _len[i] = _bufs[i].size();
+    _stamp[i] = _now;
+    Class &c = _classes[k];
+    unsigned f = classify(_bufs[i]);
+    Flow &fl = c.flows[f];
+    if (fl.tail < 0) fl.head = i; else _next[fl.tail] = i;
+    fl.tail = i;
+    fl.bytes += _len[i];
+    c.bytes += _len[i];
+    ++c.size;
+    ++_size;
+    _victim = Stale;
+    if (!fl.listed) {
+      fl.listed = true;
+      fl.deficit = Quantum;
+      push(c.flows, c.fresh, f);
+    }
+    if (!c.listed) {
+      c.listed = true;
+      c.deficit = quantum(c);
+      push(_classes, _active, k);
+    }
+  }
+
+  /// pick the next packet, true if there is none (or all is over its cap)
+  bool empty() {
+    if ((_cur < 0) && (_lane.head >= 0)) {
+      int i = _lane.head;
+      _lane.head = _next[i];
+      if (_lane.head < 0) _lane.tail = -1;
+      unsigned h = ackSlot(_bufs[i]);
+      if (_acks[h] == i) _acks[h] = -1;
+      --_lanesize;
+      --_size;
+      _cur = i;
+      _curclass = -1;
+    }
+    while ((_cur < 0) && (_active.head >= 0)) {
+      unsigned k = _active.head;
+      Class &c = _classes[k];
+      if (c.deficit <= 0) {
+        c.deficit += quantum(c);
+        pop(_classes, _active);
+        push(_classes, _active, k);
+        continue;
+      }
+      unsigned f;
+      int i = pick(c, f);
+      if (i < 0) {
+        pop(_classes, _active);
+        c.listed = false;
+        continue;
+      }
+      _cur = i;
+      _curclass = k;
+      _curflow = f;
+    }
+    return _cur < 0;
+  }
+  /// next packet to read from the queue
+  Buffer &head() { assert(_cur >= 0); return _bufs[_cur]; }
+  void popHead() {
+    assert(_cur >= 0);
+    if (_curclass < 0) {
+      release(_cur);
+      _cur = -1;
+      return;
+    }
+    Class &c = _classes[_curclass];
+    c.flows[_curflow].deficit -= _len[_cur];
+    c.deficit -= _len[_cur];
+    if (c.rate) {
+      refill(c);
+      c.tokens -= (int64_t)_len[_cur] * 1000000;
+      if (!eligible(c)) {
+        assert(_active.head == _curclass);
+        pop(_classes, _active);
+        push(_classes, _throttled, _curclass);
+      }
+    }
+    release(_cur);
+    _cur = -1;
+  }
+
+  void clear() {
+    for (unsigned i = 0; i < _num; ++i)
+      _next[i] = i + 1;
+    _next[_num - 1] = -1;
+    _free = 0;
+    _spare = _num;
+    for (unsigned k = 0; k < 2 * MaxClients; ++k) {
+      Class &c = _classes[k];
+      ::memset(&c, 0, sizeof(c));
+      for (unsigned f = 0; f < ClassFlows; ++f)
+        c.flows[f].head = c.flows[f].tail = c.flows[f].next = -1;
+      c.fresh.head = c.fresh.tail = c.old.head = c.old.tail = -1;
+      c.next = -1;
+      c.weight = 1;
+    }
+    _active.head = _active.tail = _throttled.head = _throttled.tail = -1;
+    _lane.head = _lane.tail = -1;
+    _lanesize = 0;
+    for (unsigned h = 0; h < (1u << AckBits); ++h)
+      _acks[h] = -1;
+    _slots.clear();
+    ::memset(_addrs, 0, sizeof(_addrs));
+    ::memset(_recent, 0, sizeof(_recent));
+    _size = 0;
+    _cur = -1;
+    _evicted = 0;
+    _victim = Stale;
+  }
+};
+
+#endif // INCLUDED_FQCODEL_HH
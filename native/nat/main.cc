@@ -56,7 +56,10 @@ struct PortList : public Config::Parser {
   }
 };
 
+Barnacle *running = 0; // for die()
+
 void die(int) {
+  if (running) running->stop();
   exit(1);
 }
 
@@ -65,6 +68,8 @@ int main(int, const char **) {
   struct sigaction act;
   act.sa_handler = die;
   sigaction(SIGTERM, &act, 0);
+  act.sa_handler = SIG_IGN; // the proxy splices into sockets that may be gone
+  sigaction(SIGPIPE, &act, 0);
 
   // configure, then run barnacle, bam!
   Barnacle::Config c;
@@ -78,6 +83,29 @@ int main(int, const char **) {
   c.timeout_tcp = 90;
   c.log         = false;
   c.ctrl[0]     = '\0';
+  c.tunif[0]    = '\0';
+  c.xdp         = false;
+  c.uring       = false;
+  c.txring      = false;
+  c.busypoll    = 0;
+  c.fq          = true;
+  c.codel_target = 5000;
+  c.codel_interval = 100000;
+  c.ecn         = true;
+  c.ack_prio    = true;
+  c.ack_thin    = true;
+  c.sndbuf      = 16384;
+  c.rwnd        = false;
+  c.proxy       = 0;
+  strcpy(c.proxy_cc, "bbr");
+  c.proxy_buf   = 2097152;
+  c.overload    = 0;
+  c.conn_rate   = 0;
+  c.client_maps = 0;
+  c.offload     = false;
+  c.flowtable   = false;
+  c.slowpath    = false;
+  c.coalesce    = 0;
 
   {
     using namespace Config;
@@ -92,6 +120,29 @@ int main(int, const char **) {
      { "brncl_nat_log",       new Bool(c.log),            false },
      { "brncl_nat_ctrl",      new String(c.ctrl, UNIX_PATH_MAX), false },
      { "brncl_nat_preserve",  new PortList(c.numpreserved, c.preserved), false },
+     { "brncl_nat_tun",       new String(c.tunif, IFNAMSIZ), false },
+     { "brncl_nat_xdp",       new Bool(c.xdp),            false },
+     { "brncl_nat_uring",     new Bool(c.uring),          false },
+     { "brncl_nat_txring",    new Bool(c.txring),         false },
+     { "brncl_nat_busypoll",  new Uint(c.busypoll),       false },
+     { "brncl_nat_coalesce",  new Uint(c.coalesce),       false },
+     { "brncl_nat_fq",        new Bool(c.fq),             false },
+     { "brncl_nat_codel_target", new Uint(c.codel_target), false },
+     { "brncl_nat_codel_interval", new Uint(c.codel_interval), false },
+     { "brncl_nat_ecn",       new Bool(c.ecn),            false },
+     { "brncl_nat_ack_prio",  new Bool(c.ack_prio),       false },
+     { "brncl_nat_ack_thin",  new Bool(c.ack_thin),       false },
+     { "brncl_nat_sndbuf",    new Uint(c.sndbuf),         false },
+     { "brncl_nat_rwnd",      new Bool(c.rwnd),           false },
+     { "brncl_nat_proxy",     new Uint(c.proxy),          false },
+     { "brncl_nat_proxy_cc",  new String(c.proxy_cc, sizeof(c.proxy_cc)), false },
+     { "brncl_nat_proxy_buf", new Uint(c.proxy_buf),      false },
+     { "brncl_nat_overload",  new Uint(c.overload),       false },
+     { "brncl_nat_conn_rate", new Uint(c.conn_rate),      false },
+     { "brncl_nat_client_maps", new Uint(c.client_maps),  false },
+     { "brncl_nat_offload",   new Bool(c.offload),        false },
+     { "brncl_nat_flowtable", new Bool(c.flowtable),      false },
+     { "brncl_nat_slowpath",  new Bool(c.slowpath),       false },
      { 0, NULL, false }
     };
     if (!configure(params))
@@ -101,6 +152,7 @@ int main(int, const char **) {
   close(0); open("/dev/null", O_RDONLY);
 
   Barnacle brncl(c);
+  running = &brncl;
   if (!brncl.init_ctrl()) {
     LOG("init_ctrl failed: %s\n", strerror(errno));
     return -1;
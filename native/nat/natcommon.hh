@@ -20,6 +20,7 @@
 #define INCLUDED_NATCOMMON_HH
 
 #include <stdio.h>
+#include <stddef.h> // for offsetof
 #include <netinet/ip.h> // <linux/ip.h>
 #include <netinet/tcp.h> // can't use linux/tcp.h in userspace
 #include <netinet/udp.h> // <linux/udp.h>
@@ -33,6 +34,10 @@
 #include "hashmap.hh"
 #include "buffer.hh"
 #include "socket.hh" // for PlugSocket
+#include "bpf.hh"
+#include "tcoffload.hh"
+#include "nfoffload.hh"
+#include "slowpath.hh"
 #include "log.hh"
 
 static inline const void *transport_header(const Buffer& b) {
@@ -41,6 +46,10 @@ static inline const void *transport_header(const Buffer& b) {
 static inline void *transport_header(Buffer& b) {
   return b.data() + (((const iphdr *)b.data())->ihl << 2);
 }
+/// only the first fragment (or an unfragmented packet) has the L4 header
+static inline bool has_transport_header(const Buffer& b) {
+  return (((const iphdr *)b.data())->frag_off & htons(IP_OFFMASK)) == 0;
+}
 
 // NOTE: this is very primitive header based on http://tools.ietf.org/html/rfc2637#section-4.1
 struct grehdr {
@@ -78,32 +87,40 @@ struct IPFlowId {
   }
 
   /// extract flowid from the packet
-  IPFlowId(const Buffer &b) : sport(0) {
+  IPFlowId(const Buffer &b) { parse((const iphdr *)b.data()); }
+  /// extract flowid from the IP header quoted in an ICMP error
+  explicit IPFlowId(const iphdr *ip) { parse(ip); }
+
+  void parse(const iphdr *ip) {
     // FIXME: check sanity! (check if packet is long enough)
-    const iphdr *ip = (const iphdr *)b.data();
     saddr = ip->saddr;
     daddr = ip->daddr;
     protocol = ip->protocol;
+    sport = dport = 0;
+    // ports of non-first fragments are filled in by FragmentCache
+    if (ip->frag_off & htons(IP_OFFMASK))
+      return;
+    const char *th = (const char *)ip + (ip->ihl << 2);
     switch (protocol) {
     case IPPROTO_ICMP: {
-      const icmphdr *icmp = (const icmphdr *)transport_header(b);
+      const icmphdr *icmp = (const icmphdr *)th;
       if ((icmp->type == ICMP_ECHO) || (icmp->type == ICMP_ECHOREPLY)) {
         sport = icmp->un.echo.id;
         dport = icmp->un.echo.id; // so that the echoreply matches too
       } // else we will ignore it
       break;
     } case IPPROTO_TCP: {
-      const tcphdr *tcp = (const tcphdr *)transport_header(b);
+      const tcphdr *tcp = (const tcphdr *)th;
       sport = tcp->source;
       dport = tcp->dest;
       break;
     } case IPPROTO_UDP: {
-      const udphdr *udp = (const udphdr *)transport_header(b);
+      const udphdr *udp = (const udphdr *)th;
       sport = udp->source;
       dport = udp->dest;
       break;
     } case IPPROTO_GRE: {
-      const grehdr *gre = (const grehdr *)transport_header(b);
+      const grehdr *gre = (const grehdr *)th;
       if (gre->version == GRE_VERSION_PPTP) // only support PPTP with call_id
         sport = dport = gre->call_id;
       break;
@@ -155,6 +172,43 @@ update_in_cksum(uint16_t &csum, uint16_t delta) {
   csum = ~(sum + (sum >> 16));
 }
 
+/// delta for update_in_cksum when a 32bit word changes from -> to
+static inline uint16_t
+in_cksum_delta(uint32_t from, uint32_t to) {
+  const uint16_t *f = (const uint16_t *)&from;
+  const uint16_t *t = (const uint16_t *)&to;
+  uint32_t delta = (~f[0] & 0xFFFF) + t[0] + (~f[1] & 0xFFFF) + t[1];
+  delta = (delta & 0xFFFF) + (delta >> 16);
+  return delta + (delta >> 16);
+}
+
+/**
+ * Sum of the TCP/UDP pseudo-header, not complemented. This is what the
+ * checksum field holds while the checksum is left to the NIC (offloads).
+ */
+static inline uint16_t
+pseudo_cksum(in_addr_t saddr, in_addr_t daddr, uint8_t protocol, uint16_t len) {
+  uint32_t sum = (saddr & 0xFFFF) + (saddr >> 16) +
+                 (daddr & 0xFFFF) + (daddr >> 16) +
+                 htons(protocol) + htons(len);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return sum + (sum >> 16);
+}
+
+/// internet checksum from scratch
+static inline uint16_t
+in_cksum(const void *data, unsigned len) {
+  const uint16_t *words = (const uint16_t *)data;
+  unsigned check = 0;
+  for (; len > 1; len -= 2)
+    check += *words++;
+  if (len) // odd byte, padded with zero
+    check += htons(*(const uint8_t *)words << 8);
+  while (check & ~0xFFFF)
+    check = (check & 0xFFFF) + (check >> 16);
+  return 0xFFFF ^ check;
+}
+
 static inline void
 make_icmp(Buffer &b, in_addr_t src, const icmphdr *hdr) {
   const size_t IcmpDataSize = sizeof(iphdr) + 8; // Data = old IP + 8 bytes
@@ -163,7 +217,7 @@ make_icmp(Buffer &b, in_addr_t src, const icmphdr *hdr) {
   iphdr *old_ip = (iphdr *)(b.data() + sizeof(iphdr) + sizeof(icmphdr));
   iphdr *ip = (iphdr *)b.data();
   memcpy(old_ip, ip, IcmpDataSize);
-  memset(ip, sizeof(iphdr), 0);
+  memset(ip, 0, sizeof(iphdr));
   ip->saddr = src;
   ip->daddr = old_ip->saddr;
   ip->version = IPVERSION;
@@ -171,19 +225,349 @@ make_icmp(Buffer &b, in_addr_t src, const icmphdr *hdr) {
   ip->ihl = sizeof(iphdr) >> 2;
   ip->tot_len = htons(size);
   ip->protocol = IPPROTO_ICMP;
-  ip->check = 0; // NOTE: IPSocket will update this anyway
+  ip->check = 0;
+  ip->check = in_cksum(ip, sizeof(iphdr)); // IPSocket would do it, but not L2
   icmphdr *icmp = (icmphdr *)(b.data() + sizeof(iphdr));
   memcpy(icmp, hdr, sizeof(icmphdr));
   icmp->checksum = 0;
-  const uint16_t *words = (const uint16_t *)icmp;
-  unsigned check = 0;
-  const int IcmpWords = (sizeof(icmphdr) + IcmpDataSize)/sizeof(uint16_t);
-  for (int i = 0; i < IcmpWords; ++i) {
-    check += words[i];
+  icmp->checksum = in_cksum(icmp, sizeof(icmphdr) + IcmpDataSize);
+}
+
+static inline bool dont_fragment(const Buffer &b) {
+  return (((const iphdr *)b.data())->frag_off & htons(IP_DF)) != 0;
+}
+
+/// TCP header of a segment that carries nothing but an ACK (and maybe ECE
+/// or CWR, and options), else NULL
+static inline const tcphdr *pure_ack(const Buffer &b) {
+  const iphdr *ip = (const iphdr *)b.data();
+  if ((ip->protocol != IPPROTO_TCP) || (ip->frag_off & htons(IP_MF | IP_OFFMASK)))
+    return NULL;
+  unsigned hlen = ip->ihl << 2;
+  if (b.size() < hlen + sizeof(tcphdr)) return NULL;
+  const tcphdr *tcp = (const tcphdr *)(b.data() + hlen);
+  uint8_t flags = ((const uint8_t *)tcp)[13] & ~0xC0; // but ECE and CWR
+  if ((flags != TH_ACK) || (ntohs(ip->tot_len) != hlen + (tcp->doff << 2)))
+    return NULL;
+  return tcp;
+}
+
+/**
+ * Copy the first piece of b that fits in mtu into frag, as a fragment.
+ * Returns the number of payload bytes in frag, pass it to ip_fragment_shift
+ * once frag is out. NOTE: all IP options are copied to every fragment.
+ */
+static inline unsigned
+ip_fragment(const Buffer &b, Buffer &frag, unsigned mtu) {
+  const iphdr *ip = (const iphdr *)b.data();
+  unsigned hlen = ip->ihl << 2;
+  unsigned len = (mtu - hlen) & ~7u;
+  frag.clear();
+  frag.put(hlen + len);
+  memcpy(frag.data(), b.data(), hlen + len);
+  iphdr *fip = (iphdr *)frag.data();
+  fip->tot_len = htons(hlen + len);
+  fip->frag_off |= htons(IP_MF);
+  fip->check = 0;
+  fip->check = in_cksum(fip, hlen);
+  return len;
+}
+
+/// drop len payload bytes (already sent by ip_fragment) from the front of b
+static inline void
+ip_fragment_shift(Buffer &b, unsigned len) {
+  iphdr *ip = (iphdr *)b.data();
+  unsigned hlen = ip->ihl << 2;
+  unsigned rest = b.size() - hlen - len;
+  memmove(b.data() + hlen, b.data() + hlen + len, rest);
+  b.trim(hlen + rest);
+  uint16_t off = ntohs(ip->frag_off);
+  ip->frag_off = htons((off & ~IP_OFFMASK) | ((off & IP_OFFMASK) + (len >> 3)));
+  ip->tot_len = htons(hlen + rest);
+  ip->check = 0;
+  ip->check = in_cksum(ip, hlen);
+}
+
+/**
+ * Complete a checksum that was left to the NIC: the field at start + offset
+ * holds the pseudo-header sum, the rest is summed from start to the end.
+ */
+static inline void
+finish_cksum(char *data, unsigned size, unsigned start, unsigned offset) {
+  if (start + offset + sizeof(uint16_t) > size)
+    return;
+  uint16_t check = in_cksum(data + start, size - start);
+  if (!check) check = 0xFFFF; // same thing, but 0 means none to UDP
+  memcpy(data + start + offset, &check, sizeof(check));
+}
+
+/// finish_cksum() for a captured TCP or UDP packet (TP_STATUS_CSUMNOTREADY)
+static inline void
+finish_partial_cksum(Buffer &b) {
+  if (!has_transport_header(b)) return;
+  const iphdr *ip = (const iphdr *)b.data();
+  if (ip->protocol == IPPROTO_TCP)
+    finish_cksum(b.data(), b.size(), ip->ihl << 2, offsetof(tcphdr, check));
+  else if (ip->protocol == IPPROTO_UDP)
+    finish_cksum(b.data(), b.size(), ip->ihl << 2, offsetof(udphdr, check));
+}
+
+/**
+ * Payload per segment of a GRO aggregate with hlen bytes of headers, which
+ * came in on a link of in_mtu and goes out on one of out_mtu: the segments
+ * must fit both. 0 if not even the headers do.
+ */
+static inline unsigned
+gso_mss(unsigned in_mtu, unsigned out_mtu, unsigned hlen) {
+  unsigned mtu = in_mtu < out_mtu ? in_mtu : out_mtu;
+  return (hlen < mtu) ? mtu - hlen : 0;
+}
+
+/**
+ * Copy the segment of a TCP (or UDP) GSO super-packet p that starts at
+ * payload offset off into seg, with at most mss payload bytes, and compute
+ * its checksums. Returns the number of payload bytes, 0 when there are none
+ * left (or the segment does not fit). NOTE: translate p first.
+ */
+template <unsigned N>
+static inline unsigned
+gso_segment(const BufferT<N> &p, unsigned off, unsigned mss, Buffer &seg) {
+  const iphdr *ip = (const iphdr *)p.data();
+  unsigned hlen = ip->ihl << 2;
+  bool tcp = (ip->protocol == IPPROTO_TCP);
+  unsigned hdrs = hlen + (tcp ? ((const tcphdr *)(p.data() + hlen))->doff << 2
+                              : sizeof(udphdr));
+  if (hdrs + off >= p.size())
+    return 0;
+  unsigned len = p.size() - hdrs - off;
+  bool last = (len <= mss);
+  if (!last) len = mss;
+  seg.reset();
+  if (hdrs + len >= seg.room())
+    return 0;
+  seg.put(hdrs + len);
+  memcpy(seg.data(), p.data(), hdrs);
+  memcpy(seg.data() + hdrs, p.data() + hdrs + off, len);
+
+  iphdr *sip = (iphdr *)seg.data();
+  sip->tot_len = htons(hdrs + len);
+  sip->id = htons(ntohs(ip->id) + off / mss);
+  sip->check = 0;
+  sip->check = in_cksum(sip, hlen);
+  uint16_t check = pseudo_cksum(sip->saddr, sip->daddr, sip->protocol,
+                                hdrs - hlen + len);
+  if (tcp) {
+    tcphdr *th = (tcphdr *)(seg.data() + hlen);
+    uint8_t &flags = ((uint8_t *)th)[13]; // no cwr in struct tcphdr
+    th->seq = htonl(ntohl(th->seq) + off);
+    if (off)   flags &= ~0x80; // CWR
+    if (!last) flags &= ~(TH_FIN | TH_PUSH);
+    th->check = check;
+    finish_cksum(seg.data(), seg.size(), hlen, offsetof(tcphdr, check));
+  } else {
+    udphdr *uh = (udphdr *)(seg.data() + hlen);
+    uh->len = htons(sizeof(udphdr) + len);
+    uh->check = check;
+    finish_cksum(seg.data(), seg.size(), hlen, offsetof(udphdr, check));
   }
-  while (check & ~0xFFFF)
-    check = (check & 0xFFFF) + (check >> 16);
-  icmp->checksum = 0xFFFF ^ check;
+  return len;
+}
+
+/**
+ * Clamp the MSS option of a TCP SYN (or SYN-ACK) to mss (in host order),
+ * so that the endpoints never send segments that won't fit the uplink.
+ */
+static inline void
+clamp_mss(Buffer &b, uint16_t mss) {
+  if (!has_transport_header(b)) return;
+  tcphdr *tcp = (tcphdr *)transport_header(b);
+  if (!tcp->syn) return;
+  uint8_t *opt = (uint8_t *)tcp + sizeof(tcphdr);
+  uint8_t *end = (uint8_t *)tcp + (tcp->doff << 2);
+  if (end > (uint8_t *)b.data() + b.size()) return; // truncated
+  while (opt < end) {
+    if (*opt == TCPOPT_EOL) break;
+    if (*opt == TCPOPT_NOP) { ++opt; continue; }
+    if ((opt + 1 >= end) || (opt[1] < 2) || (opt + opt[1] > end)) break;
+    if ((*opt == TCPOPT_MAXSEG) && (opt[1] == TCPOLEN_MAXSEG)) {
+      uint16_t old, neu = htons(mss);
+      memcpy(&old, opt + 2, sizeof(old));
+      if (ntohs(old) <= mss) break;
+      memcpy(opt + 2, &neu, sizeof(neu));
+      if ((opt + 2 - (uint8_t *)tcp) & 1) { // straddles two checksum words
+        old = (old >> 8) | (old << 8);
+        neu = (neu >> 8) | (neu << 8);
+      }
+      uint32_t delta = (~old & 0xFFFF) + neu;
+      update_in_cksum(tcp->check, (delta & 0xFFFF) + (delta >> 16));
+      break;
+    }
+    opt += opt[1];
+  }
+}
+
+/// the TCP option of that kind (at least len bytes of it), NULL if none
+static inline const uint8_t *
+tcp_option(const Buffer &b, const tcphdr *tcp, uint8_t kind, uint8_t len) {
+  const uint8_t *opt = (const uint8_t *)tcp + sizeof(tcphdr);
+  const uint8_t *end = (const uint8_t *)tcp + (tcp->doff << 2);
+  if (end > (const uint8_t *)b.data() + b.size()) return NULL; // truncated
+  while (opt < end) {
+    if (*opt == TCPOPT_EOL) break;
+    if (*opt == TCPOPT_NOP) { ++opt; continue; }
+    if ((opt + 1 >= end) || (opt[1] < 2) || (opt + opt[1] > end)) break;
+    if (*opt == kind) return (opt[1] >= len) ? opt : NULL;
+    opt += opt[1];
+  }
+  return NULL;
+}
+
+/**
+ * Receive window control of one TCP flow, to keep the downlink buffers of
+ * the carrier from filling up. The LAN host's advertised window is capped
+ * to twice the bandwidth-delay product of the flow, so the sender can only
+ * have that much in flight, but it can still grow into a faster link. The
+ * rate is the decaying max of what arrives per round trip. The round trip is
+ * the shortest recent time from a timestamp going out to its echo coming
+ * back. Flows without timestamps are left alone.
+ */
+class WindowCtl {
+  uint64_t  _ts_time;   // in us, when _ts_val went out, 0 if not waiting
+  uint32_t  _ts_val;
+  uint32_t  _ts_ecr;    // last echoed
+  uint32_t  _min_rtt;   // in us, 0 if unknown
+  uint64_t  _rtt_time;  // in us, when _min_rtt was taken
+  uint64_t  _start;     // in us, of the current rate sample
+  uint32_t  _bytes;     // arrived since _start
+  uint32_t  _rate;      // in bytes per second
+  uint32_t  _edge;      // of the last window sent, host order
+  uint8_t   _shift;     // window scale of the LAN host
+  bool      _scaled;    // the peer agreed to it
+  bool      _capped;    // _edge is valid
+public:
+  static const uint32_t MinWindow = 10 * 1460;
+  static const uint64_t RttExpiry = 10000000; // in us
+
+  WindowCtl() { memset(this, 0, sizeof(*this)); }
+
+  /// the cap in bytes, 0 if there's none yet
+  uint32_t cap() const {
+    if (!_min_rtt || !_rate) return 0;
+    uint64_t w = 2 * (uint64_t)_rate * _min_rtt / 1000000;
+    return (w < MinWindow) ? MinWindow : (w > 0x3FFFFFFF) ? 0x3FFFFFFF : w;
+  }
+  uint32_t rtt() const { return _min_rtt; }
+  uint32_t rate() const { return _rate; }
+
+  /// see a segment from the LAN host, and cap its window
+  void out(Buffer &b, uint64_t now) {
+    if (!has_transport_header(b)) return;
+    tcphdr *tcp = (tcphdr *)transport_header(b);
+    if (tcp->syn) {
+      if (!tcp->ack) *this = WindowCtl(); // a new connection
+      const uint8_t *ws = tcp_option(b, tcp, TCPOPT_WINDOW, TCPOLEN_WINDOW);
+      _shift = ws ? ((ws[2] > 14) ? 14 : ws[2]) : 0;
+      _capped = false;
+      return;
+    }
+    const uint8_t *ts = tcp_option(b, tcp, TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP);
+    if (!tcp->ack || !ts) return;
+    uint32_t val;
+    memcpy(&val, ts + 2, sizeof(val));
+    val = ntohl(val);
+    // a new value, so that its echo can't be for an earlier segment
+    if (!_ts_time && ((int32_t)(val - _ts_ecr) > 0)) {
+      _ts_val = val;
+      _ts_time = now;
+    }
+    uint32_t c = cap();
+    if (!c || !tcp->window) return;
+    unsigned shift = _scaled ? _shift : 0;
+    uint32_t ack = ntohl(tcp->ack_seq);
+    uint32_t win = (uint32_t)ntohs(tcp->window) << shift;
+    uint32_t round = 0; // down to the scale, unless that takes some back
+    if (_capped && ((int32_t)(_edge - ack) > (int32_t)c)) {
+      c = _edge - ack; // never take back what was offered
+      round = (1u << shift) - 1;
+    }
+    if (win > c) {
+      uint16_t old = tcp->window;
+      uint32_t neu = (c + round) >> shift;
+      tcp->window = htons(neu ? neu : 1);
+      uint32_t delta = (~old & 0xFFFF) + tcp->window;
+      update_in_cksum(tcp->check, (delta & 0xFFFF) + (delta >> 16));
+      win = (uint32_t)ntohs(tcp->window) << shift;
+    }
+    _edge = ack + win;
+    _capped = true;
+  }
+
+  /// see a segment from the peer, for the rate and round trip
+  void in(const Buffer &b, uint64_t now) {
+    if (!has_transport_header(b)) return;
+    const iphdr *ip = (const iphdr *)b.data();
+    const tcphdr *tcp = (const tcphdr *)transport_header(b);
+    if (tcp->syn) {
+      if (!tcp->ack) *this = WindowCtl(); // a new connection, from the peer
+      // NOTE: only the peer's SYN tells, the scale of the LAN host is in _shift
+      _scaled = tcp_option(b, tcp, TCPOPT_WINDOW, TCPOLEN_WINDOW) != NULL;
+      return;
+    }
+    const uint8_t *ts = tcp_option(b, tcp, TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP);
+    if (ts) {
+      memcpy(&_ts_ecr, ts + 6, sizeof(_ts_ecr));
+      _ts_ecr = ntohl(_ts_ecr);
+      if (_ts_time && ((int32_t)(_ts_ecr - _ts_val) >= 0)) {
+        uint32_t rtt = now - _ts_time;
+        if (!rtt) rtt = 1;
+        if (!_min_rtt || (rtt <= _min_rtt) || (now - _rtt_time > RttExpiry)) {
+          _min_rtt = rtt;
+          _rtt_time = now;
+        }
+        _ts_time = 0;
+      }
+    }
+    int len = ntohs(ip->tot_len) - (ip->ihl << 2) - (tcp->doff << 2);
+    if (len <= 0) return;
+    _bytes += len;
+    if (!_start) {
+      _start = now;
+    } else if (_min_rtt && (now - _start >= _min_rtt)) {
+      uint64_t sample = (uint64_t)_bytes * 1000000 / (now - _start);
+      _rate -= _rate >> 3; // forget a faster past, over a few round trips
+      if (sample > _rate) _rate = (sample > 0xFFFFFFFF) ? 0xFFFFFFFF : sample;
+      _start = now;
+      _bytes = 0;
+    }
+  }
+};
+
+/**
+ * The IP header quoted in an ICMP error (DEST_UNREACH, TIME_EXCEEDED, ...)
+ * or NULL if this is not an ICMP error or it is too short to be translated.
+ */
+static inline iphdr *
+icmp_error_header(Buffer &b) {
+  const iphdr *ip = (const iphdr *)b.data();
+  if ((ip->protocol != IPPROTO_ICMP) || !has_transport_header(b))
+    return 0;
+  unsigned hlen = ip->ihl << 2;
+  if (b.size() < hlen + sizeof(icmphdr) + sizeof(iphdr) + 8)
+    return 0;
+  const icmphdr *icmp = (const icmphdr *)transport_header(b);
+  switch (icmp->type) {
+  case ICMP_DEST_UNREACH:
+  case ICMP_SOURCE_QUENCH:
+  case ICMP_TIME_EXCEEDED:
+  case ICMP_PARAMETERPROB:
+    break;
+  default:
+    return 0;
+  }
+  iphdr *quoted = (iphdr *)(b.data() + hlen + sizeof(icmphdr));
+  if (b.size() < hlen + sizeof(icmphdr) + (quoted->ihl << 2) + 8)
+    return 0; // need at least the ports
+  return quoted;
 }
 
 static inline void
@@ -235,7 +619,7 @@ public:
     update_in_cksum(ip->check, _ip_csum_delta); // this is unnecessary for IPSocket
 
     // if not first fragment, there's no transport header
-    if ((ip->frag_off & htons(0x1FFF)) != 0)
+    if (!has_transport_header(b))
       return;
 
     // UDP/TCP header
@@ -263,6 +647,184 @@ public:
       assert(0); // should never happen
     }
   }
+
+  /**
+   * set flowid on the header quoted in an ICMP error, len is what's left of
+   * the packet from ip on. The ICMP checksum needs to be recomputed after.
+   */
+  void applyQuoted(iphdr *ip, unsigned len) {
+    ip->saddr = _mapto.saddr;
+    ip->daddr = _mapto.daddr;
+    update_in_cksum(ip->check, _ip_csum_delta);
+
+    char *th = (char *)ip + (ip->ihl << 2);
+    len -= (ip->ihl << 2); // at least 8 bytes of it
+    switch(_mapto.protocol) {
+    case IPPROTO_TCP: {
+      tcphdr *tcp = (tcphdr *)th;
+      tcp->source = _mapto.sport;
+      tcp->dest = _mapto.dport;
+      if (len >= offsetof(tcphdr, check) + sizeof(tcp->check)) // rarely quoted
+        update_in_cksum(tcp->check, _udp_csum_delta);
+      break;
+    } case IPPROTO_UDP: {
+      udphdr *udp = (udphdr *)th;
+      udp->source = _mapto.sport;
+      udp->dest = _mapto.dport;
+      if (udp->check)
+        update_in_cksum(udp->check, _udp_csum_delta);
+      break;
+    } default:
+      // ICMP echo id and GRE call_id are not rewritten
+      break;
+    }
+  }
+};
+
+/**
+ * Fragment tracking: only the first fragment of a datagram carries the ports,
+ * so we remember them keyed by (saddr, daddr, ip id, protocol) and hand them
+ * to the later fragments. Fragments that overtake their first fragment are
+ * held in a small pool until it shows up (or until the next cleanup).
+ * NOTE: this does not reassemble anything, every fragment is forwarded as is.
+ */
+class FragmentCache {
+public:
+  static const unsigned NumEntries = 64; // must be a power of 2
+  static const unsigned NumHeld = 16;
+protected:
+  struct Key {
+    in_addr_t saddr; // all in network order
+    in_addr_t daddr;
+    uint16_t  id;
+    uint8_t   protocol;
+
+    Key() {}
+    Key(const Buffer &b) {
+      const iphdr *ip = (const iphdr *)b.data();
+      saddr = ip->saddr;
+      daddr = ip->daddr;
+      id = ip->id;
+      protocol = ip->protocol;
+    }
+    hashcode_t hashcode() const {
+      hashcode_t sx = ::hashcode(saddr);
+      hashcode_t dx = ::hashcode(daddr);
+      return sx ^ ROT(dx, 16) ^ id ^ protocol;
+    }
+    bool operator==(const Key &o) const {
+      return (saddr == o.saddr) && (daddr == o.daddr) &&
+             (id == o.id) && (protocol == o.protocol);
+    }
+  };
+
+  struct Entry {
+    Key      key;
+    uint16_t sport;
+    uint16_t dport;
+    bool     live;
+    bool     used; // dirty flag, same as in mappings
+    Entry() : live(false), used(false) {}
+  };
+
+  struct Held {
+    Buffer b;
+    bool   out; // direction
+    bool   live;
+    Held() : live(false) {}
+  };
+
+  Entry  _entries[NumEntries]; // direct-mapped, newer evicts older
+  Held  *_held;
+  unsigned _numheld;
+  unsigned _nextheld; // next victim if the pool is full
+  bool   _release; // a first fragment arrived while something was held
+
+  Entry &entry(const Key &k) {
+    return _entries[k.hashcode() & (NumEntries - 1)];
+  }
+
+  void hold(const Buffer &b, bool out) {
+    unsigned i = _nextheld;
+    for (unsigned n = 0; n < NumHeld; ++n, i = (i + 1) % NumHeld)
+      if (!_held[i].live) break;
+    Held &h = _held[i]; // if none free, evict the one at _nextheld
+    _nextheld = (i + 1) % NumHeld;
+    if (!h.live) ++_numheld;
+    h.b.copy(b);
+    h.out = out;
+    h.live = true;
+  }
+
+public:
+  FragmentCache() : _held(new Held[NumHeld]), _numheld(0), _nextheld(0),
+                    _release(false) {}
+  ~FragmentCache() { if (_held) delete [] _held; _held = 0; }
+
+  /**
+   * Fill in the ports of a non-first fragment from its first fragment.
+   * Returns false if the fragment was held (the first one is still missing).
+   */
+  bool resolve(const Buffer &b, IPFlowId &id, bool out) {
+    const iphdr *ip = (const iphdr *)b.data();
+    if (!(ip->frag_off & htons(IP_MF | IP_OFFMASK)))
+      return true; // not fragmented
+
+    Key k(b);
+    Entry &e = entry(k);
+    if (has_transport_header(b)) { // first fragment
+      if (id.valid()) {
+        e.key = k;
+        e.sport = id.sport;
+        e.dport = id.dport;
+        e.live = e.used = true;
+        if (_numheld) _release = true;
+      }
+      return true;
+    }
+    if (e.live && (e.key == k)) {
+      id.sport = e.sport;
+      id.dport = e.dport;
+      e.used = true;
+      return true;
+    }
+    hold(b, out);
+    return false;
+  }
+
+  /// pop a held fragment whose first fragment has arrived since
+  bool release(Buffer &b, bool &out) {
+    if (!_release) return false;
+    for (unsigned i = 0; i < NumHeld; ++i) {
+      Held &h = _held[i];
+      if (!h.live) continue;
+      Key k(h.b);
+      Entry &e = entry(k);
+      if (e.live && (e.key == k)) {
+        b.copy(h.b);
+        out = h.out;
+        h.live = false;
+        --_numheld;
+        return true;
+      }
+    }
+    _release = false;
+    return false;
+  }
+
+  /// forget datagrams not seen since last cleanup, drop whatever is held
+  void cleanup() {
+    for (unsigned i = 0; i < NumEntries; ++i) {
+      Entry &e = _entries[i];
+      if (!e.used) e.live = false;
+      e.used = false;
+    }
+    for (unsigned i = 0; i < NumHeld; ++i)
+      _held[i].live = false;
+    _numheld = 0;
+    _release = false;
+  }
+  unsigned held() const { return _numheld; }
 };
 
 /**
@@ -271,10 +833,11 @@ public:
 class PortQueue {
   Queue<uint16_t> _q;
   PlugSocket *_plugs;
+  uint16_t _lo, _hi; // range of ports in the queue (in host order)
 public:
   /// first == first port to try in host order
   PortQueue(unsigned numports, uint16_t first, bool tcp)
-      : _q(numports) {
+      : _q(numports), _lo(first), _hi(first) {
     // fill up the queue with ports (in sequence with some holes)
     _plugs = new PlugSocket[numports];
     for (uint16_t i = 0; i < numports; ++i) {
@@ -283,6 +846,8 @@ public:
         ++first;
       _q.tail() = htons(first + i);
       _q.pushTail();
+      if (i == 0) _lo = first;
+      _hi = first + i;
     }
   }
   ~PortQueue() {
@@ -302,6 +867,8 @@ public:
     assert (!_q.full());
     _q.tail() = port; _q.pushTail();
   }
+  uint16_t lo() const { return _lo; }
+  uint16_t hi() const { return _hi; }
 };
 
 /**
@@ -377,6 +944,57 @@ public:
     if (!_map.free(port))
       _queue.free(port);
   }
+  /// range of the non-preserved ports (in host order)
+  uint16_t lo() const { return _queue.lo(); }
+  uint16_t hi() const { return _queue.hi(); }
+};
+
+/**
+ * Tiny direct-mapped cache of pointers in front of a HashMap, indexed by a
+ * few bits of the hashcode. For long runs of packets of the same flow this
+ * is one compare instead of a chain walk.
+ */
+template <typename K, typename V>
+class FlowCache {
+public:
+  static const unsigned Size = 64; // must be a power of 2
+  typedef HashMap<K, V*> map_t;
+protected:
+  struct Entry {
+    K  key;
+    V *value;
+    Entry() : value(0) {}
+  };
+  Entry _entries[Size];
+  unsigned _hits, _misses;
+
+  Entry &entry(const K &key) {
+    return _entries[hashcode(key) & (Size - 1)];
+  }
+public:
+  FlowCache() : _hits(0), _misses(0) {}
+
+  V *get(const map_t &map, const K &key) {
+    Entry &e = entry(key);
+    if (e.value && (e.key == key)) {
+      ++_hits;
+      return e.value;
+    }
+    ++_misses;
+    V *v = map.get(key);
+    if (v) {
+      e.key = key;
+      e.value = v;
+    }
+    return v;
+  }
+  /// must be called before v is deleted or key is remapped
+  void invalidate(const K &key) {
+    Entry &e = entry(key);
+    if (e.value && (e.key == key)) e.value = 0;
+  }
+  unsigned hits() const { return _hits; }
+  unsigned misses() const { return _misses; }
 };
 
 template <typename Mapping>
@@ -391,17 +1009,97 @@ public:
     unsigned  numports;
     uint16_t  firstport;
     bool      log;
+    unsigned  conn_rate;   // new mappings per second per client, 0 = no limit
+    unsigned  client_maps; // mappings per client, 0 = no cap
+    Config() : conn_rate(0), client_maps(0) {}
   };
 protected:
+  /// mapping quota of a LAN address
+  struct Client {
+    unsigned maps;
+    uint64_t tokens;  // new mappings x 10^6, up to a second's worth
+    uint64_t filled;  // in us
+    unsigned limited; // refused over conn_rate, since the last cleanup()
+    unsigned capped;  // refused over client_maps, since the last cleanup()
+  };
+  typedef HashMap<in_addr_t, Client> clients_t;
+
   Config _cfg;
   typedef HashMap<typename Mapping::IdOut, Mapping*> mapout_t;
   typedef HashMap<typename Mapping::IdIn,  Mapping*> mapin_t;
   mapout_t _out; // outgoing
   mapin_t _in; // incoming
+  FlowCache<typename Mapping::IdOut, Mapping> _outc; // in front of _out
+  FlowCache<typename Mapping::IdIn,  Mapping> _inc;  // in front of _in
 
   PortPool _uports; // available UDP ports
   PortPool _tports; // available TCP ports
 
+  FragmentCache _frags; // ports of fragmented datagrams
+
+  clients_t _clients; // if conn_rate or client_maps
+  unsigned  _limited, _capped; // stats
+
+  uint16_t _mss; // clamp TCP MSS to this (host order), 0 = don't
+  bool     _wnd; // cap TCP receive windows, see WindowCtl
+  uint64_t _now; // in us, for _wnd
+
+  bool     _shed_flows; // refuse new mappings
+  unsigned _shed;       // out of 256 packets of established flows to drop
+  unsigned _shed_acc;   // spreads the drops evenly
+  unsigned _shed_new, _shed_est; // stats
+
+  TcOffload *_tc;     // kernel fast path, if any
+  unsigned  _fast;    // entries in it
+
+  /// a flow to hand to _nf, see conntracked()
+  struct Pending {
+    IPFlowId orig;
+    uint32_t mark;
+    uint8_t  state; // TCP_CONNTRACK_XX
+  };
+  enum { CT_PENDING = 1, CT_REFUSED = 2 }; // in _kflows, besides marks
+  typedef HashMap<IPFlowId, uint32_t> kflows_t;
+
+  NfOffload *_nf;     // or the netfilter one
+  kflows_t  _kflows;  // what _nf has, by the flow as it leaves the LAN
+  Queue<Pending> _ctq; // for commitConntrack()
+  uint32_t  _ctgen;   // for the marks of new mappings
+
+  /**
+   * What the fast path asks of the slow path, see setSlowPath(). The fast
+   * path owns the tables, the caches and the translation state of the
+   * mappings in them; the slow path the ports, the client quotas, _made and
+   * the lifetime of the mappings.
+   */
+  struct Job {
+    enum Type { NEW, DEL, CLEANUP, DMZ } type;
+    IPFlowId  id;       // NEW
+    bool      held;     // NEW: b is the packet, to translate once mapped
+    Buffer    b;
+    Mapping   *m;       // DEL: removed from the tables
+    uint64_t  now;      // NEW, CLEANUP
+    bool      keep_tcp; // CLEANUP
+    in_addr_t addr;     // DMZ
+  };
+  /// and what it answers, in order
+  struct Result {
+    enum Type { MAP, RETRY, EXPIRE, KILL } type;
+    Mapping   *m;      // MAP: to add to the tables, EXPIRE and KILL: to remove
+    typename Mapping::IdOut key; // EXPIRE, KILL: m might be gone by then
+    bool      held;    // MAP, RETRY: b is a packet to translate
+    Buffer    b;
+  };
+
+  SlowPath     _slow;
+  Ring<Job>    *_jobs;    // to the slow path, NULL if there is none
+  Ring<Result> *_results; // from it
+  Queue<Mapping*> _dead;  // for DEL jobs, when _jobs is full
+  mapout_t     _made;     // all the mappings, as the slow path knows them
+  bool         _dmz_set;  // a DMZ job is waiting for room
+  in_addr_t    _dmz;
+  unsigned     _slow_drops; // stats
+
   void remove(Mapping *m) {
     typename mapout_t::iterator it = _out.find(m->out());
     remove(it);
@@ -409,10 +1107,29 @@ protected:
 
   void remove(typename mapout_t::iterator &it) { // it is in _out
     Mapping *m = it->value; assert(it.live());
+    if (_tc) unoffload(m);
+    if (_nf && m->ct().flows) _nf->remove(m->ct().mark);
+    _outc.invalidate(m->out());
+    _inc.invalidate(m->in());
     it = _out.erase(it);
     size_t ner = _in.erase(m->in());
     assert(ner == 1);
     assert(_out.size() == _in.size());
+    if (!_jobs) {
+      release(m);
+      delete m;
+    } else if (!_dead.full()) {
+      _dead.tail() = m;
+      _dead.pushTail();
+    } else DBG("Lost mapping %s\n", unparse(m->out())); // and its port, too
+  }
+
+  /// give back the port and quota of m (slow path)
+  void release(Mapping *m) {
+    if (_cfg.conn_rate || _cfg.client_maps) {
+      typename clients_t::iterator c = _clients.find(m->out().saddr);
+      if (c.live() && c->value.maps) --c->value.maps;
+    }
     uint16_t port = m->port();
     switch (m->protocol()) {
     case IPPROTO_UDP:
@@ -426,64 +1143,613 @@ protected:
       break;
     }
     if (_cfg.log) DBG("DEL %s ==> %d\n", unparse(m->out()), ntohs(port));
-    delete m;
   }
 
-  Mapping* map(const IPFlowId &out, uint16_t port) {
+  /// may the client create another mapping? cheap enough to run on a flood
+  bool admit(in_addr_t addr, uint64_t now) {
+    Client &c = _clients[addr];
+    if (_cfg.client_maps && (c.maps >= _cfg.client_maps)) {
+      ++c.capped;
+      ++_capped;
+      return false;
+    }
+    if (_cfg.conn_rate) {
+      uint64_t full = (uint64_t)_cfg.conn_rate * 1000000;
+      c.tokens+= (now - c.filled) * _cfg.conn_rate;
+      if (c.tokens > full) c.tokens = full;
+      c.filled = now;
+      if (c.tokens < 1000000) {
+        ++c.limited;
+        ++_limited;
+        return false;
+      }
+      c.tokens-= 1000000;
+    }
+    return true;
+  }
+
+  /// a mapping for out, with a port and within the quota, or NULL (slow path)
+  Mapping *create(const IPFlowId &out, uint64_t now) {
+    if ((_cfg.conn_rate || _cfg.client_maps) && !admit(out.saddr, now))
+      return 0;
+
+    uint16_t port = out.sport;
+    switch (out.protocol) {
+    case IPPROTO_UDP:
+      port = _uports.alloc(port);
+      if (port == 0) {
+        DBG("OUT OF UDP PORTS!\n");
+        return 0;
+      }
+      break;
+    case IPPROTO_TCP:
+      port = _tports.alloc(port);
+      if (port == 0) {
+        DBG("OUT OF TCP PORTS!\n");
+        return 0;
+      }
+      break;
+    default:
+      // else leave the echo.id untouched
+      break;
+    }
+    return make(out, port);
+  }
+
+  Mapping *make(const IPFlowId &out, uint16_t port) {
+    if (_cfg.conn_rate || _cfg.client_maps)
+      ++_clients[out.saddr].maps;
     Mapping *m = new Mapping(out, _cfg.out_addr, port);
+    if (_cfg.log) DBG("NEW %s ==> %d\n", unparse(out), ntohs(m->port()));
+    return m;
+  }
+
+  /// add m to the tables (fast path)
+  void publish(Mapping *m) {
+    _outc.invalidate(m->out());
+    _inc.invalidate(m->in());
     _in[m->in()] = m;
     _out[m->out()] = m;
     assert(_out.size() == _in.size());
-    if (_cfg.log) DBG("NEW %s ==> %d\n", unparse(out), ntohs(m->port()));
-    return m;
+    if (_tc) offload(m);
+    if (_nf) mark(m);
+  }
+
+  /// make and publish, on the slow path if there is one
+  bool map(const IPFlowId &out, uint16_t port) {
+    Mapping *m = make(out, port);
+    if (!_jobs) {
+      publish(m);
+    } else if (answer(Result::MAP, m, 0)) {
+      _made[m->out()] = m;
+    } else {
+      release(m);
+      delete m;
+      return false;
+    }
+    return true;
+  }
+
+  /// the entry of m on side, see TcOffload::Key
+  void offloadKey(const Mapping *m, int side, TcOffload::Key &k) const {
+    IPFlowId id = m->out();
+    if (side == TcOffload::WAN) id = m->in();
+    memset(&k, 0, sizeof(k));
+    k.protocol = id.protocol;
+    if ((side == TcOffload::LAN) || !Mapping::Cone) {
+      k.saddr = id.saddr;
+      k.sport = id.sport;
+    }
+    if ((side == TcOffload::WAN) || !Mapping::Cone) {
+      k.daddr = id.daddr;
+      k.dport = id.dport;
+    }
+  }
+
+  /// give m its entries in the kernel, if it can have them
+  void offload(Mapping *m) {
+    TcOffload::State &s = m->fast();
+    uint8_t proto = m->protocol();
+    if (((proto != IPPROTO_UDP) && (proto != IPPROTO_TCP)) ||
+        (_wnd && (proto == IPPROTO_TCP)) || // WindowCtl needs to see them all
+        s.refused) // not on every packet, wait for clearOffload()
+      return;
+    TcOffload::Key k;
+    if (!s.on[TcOffload::LAN]) {
+      offloadKey(m, TcOffload::LAN, k);
+      s.on[TcOffload::LAN] = _tc->add(TcOffload::LAN, k, _cfg.out_addr, m->port());
+      _fast+= s.on[TcOffload::LAN];
+    }
+    if (!s.on[TcOffload::WAN]) {
+      offloadKey(m, TcOffload::WAN, k);
+      s.on[TcOffload::WAN] = _tc->add(TcOffload::WAN, k, m->out().saddr, m->out().sport);
+      _fast+= s.on[TcOffload::WAN];
+    }
+    s.refused = !s.on[TcOffload::LAN] || !s.on[TcOffload::WAN];
+  }
+
+  void unoffload(Mapping *m) {
+    TcOffload::State &s = m->fast();
+    for (int side = 0; side < 2; ++side) {
+      if (!s.on[side]) continue;
+      TcOffload::Key k;
+      offloadKey(m, side, k);
+      _tc->remove(side, k);
+      s.on[side] = false;
+      --_fast;
+    }
+  }
+
+  /// packets forwarded by the entries of m
+  uint64_t forwarded(const Mapping *m) {
+    uint64_t n = 0;
+    for (int side = 0; side < 2; ++side) {
+      if (!m->fast().on[side]) continue;
+      TcOffload::Key k;
+      offloadKey(m, side, k);
+      n+= _tc->packets(side, k);
+    }
+    return n;
+  }
+
+  /// give m a mark for its conntrack entries, if it can have any
+  void mark(Mapping *m) {
+    uint8_t proto = m->protocol();
+    if ((proto == IPPROTO_UDP) || (proto == IPPROTO_TCP))
+      m->ct().mark = NfOffload::Tag | (++_ctgen & ~NfOffload::Tag);
+  }
+
+  static NfOffload::Tuple tuple(const IPFlowId &id) {
+    NfOffload::Tuple t = { id.saddr, id.daddr, id.sport, id.dport, id.protocol };
+    return t;
+  }
+
+  /**
+   * Does the kernel forward the flow orig of m? Then what we got of it is
+   * only a copy. If not and b is from the LAN, have the kernel take it over
+   * at the next commitConntrack(), or not at all if it refuses.
+   */
+  bool conntracked(Mapping *m, const IPFlowId &orig, const Buffer *b) {
+    uint32_t mark = m->ct().mark;
+    if (!mark || (_wnd && (orig.protocol == IPPROTO_TCP))) // WindowCtl needs them all
+      return false;
+    typename kflows_t::iterator k = _kflows.find(orig);
+    if (k.live() && (k->value == mark))
+      return true;
+    if (!b || (k.live() && !(k->value & NfOffload::Tag)) || _ctq.full())
+      return false; // NOTE: a mark of a removed mapping is stale, so go on
+    Pending &p = _ctq.tail();
+    p.orig = orig;
+    p.mark = mark;
+    p.state = TCP_CONNTRACK_ESTABLISHED;
+    if ((orig.protocol == IPPROTO_TCP) && has_transport_header(*b)) {
+      const tcphdr *tcp = (const tcphdr *)transport_header(*b);
+      if (tcp->syn && !tcp->ack) p.state = TCP_CONNTRACK_SYN_SENT;
+    }
+    _ctq.pushTail();
+    _kflows[orig] = CT_PENDING;
+    return false;
   }
 
   void freePort(uint16_t port) { // FIXME: this is highly inefficient
-    for (typename mapout_t::iterator it = _out.begin(); it.live(); ) {
+    mapout_t &all = _jobs ? _made : _out;
+    for (typename mapout_t::iterator it = all.begin(); it.live(); ) {
       Mapping *m = it->value;
       uint8_t proto = m->protocol();
-      if ((m->port() == port) &&
-          ((proto == IPPROTO_TCP) || (proto == IPPROTO_UDP)))
+      if ((m->port() != port) ||
+          ((proto != IPPROTO_TCP) && (proto != IPPROTO_UDP))) {
+        ++it;
+      } else if (!_jobs) {
         remove(it);
+      } else if (answer(Result::KILL, m, 0)) {
+        // the fast path will let go of it before it sees the next MAP
+        release(m);
+        it = _made.erase(it);
+      } else ++it;
+    }
+  }
+
+  /// queue a result for the fast path, false if there is no room (slow path)
+  bool answer(typename Result::Type type, Mapping *m, const Buffer *b) {
+    if (_results->full()) return false;
+    bool idle = _results->empty();
+    Result &r = _results->tail();
+    r.type = type;
+    r.m = m;
+    if (m) r.key = m->out();
+    r.held = (b != 0);
+    if (b) r.b.copy(*b);
+    _results->pushTail();
+    if (idle) _slow.wake();
+    return true;
+  }
+
+  /// queue a job for the slow path, false if there is no room (fast path)
+  Job *ask(typename Job::Type type) {
+    if (_jobs->full()) return 0;
+    Job &j = _jobs->tail();
+    j.type = type;
+    j.now = _now;
+    return &j;
+  }
+  void asked() {
+    bool idle = _jobs->empty();
+    _jobs->pushTail();
+    if (idle) _slow.kick();
+  }
+
+  static void *slowMain(void *self) {
+    ((RewriterStub *)self)->slowLoop();
+    return 0;
+  }
+
+  void slowLoop() {
+    while (!_slow.stopping()) {
+      if (_jobs->empty()) {
+        _slow.wait(1000);
+      } else if (_results->full()) {
+        _slow.wait(1); // for the fast path to catch up, it never waits for us
+      } else {
+        work(_jobs->head());
+        _jobs->popHead();
+      }
+    }
+  }
+
+  /// there is room for at least one result
+  void work(Job &j) {
+    switch (j.type) {
+    case Job::NEW:
+      if (_made.get(j.id)) {
+        // made for an earlier packet, or removed by the fast path since
+        answer(Result::RETRY, 0, j.held ? &j.b : 0);
+      } else if (Mapping *m = create(j.id, j.now)) {
+        _made[m->out()] = m;
+        answer(Result::MAP, m, j.held ? &j.b : 0);
+      } // else refused, and the packet is dropped
+      break;
+    case Job::DEL: {
+      typename mapout_t::iterator it = _made.find(j.m->out());
+      if (it.live() && (it->value == j.m)) { // else killed already
+        _made.erase(it);
+        release(j.m);
+      }
+      delete j.m;
+      break;
+    }
+    case Job::CLEANUP:
+      // only candidates, the fast path asks the kernel before it removes them
+      for (typename mapout_t::iterator it = _made.begin(); it.live(); ++it) {
+        if (!idle(it->value, j.keep_tcp)) continue;
+        if (!answer(Result::EXPIRE, it->value, 0)) break; // until next time
+      }
+      cleanupClients(j.now);
+      break;
+    case Job::DMZ:
+#ifdef NAT_OPEN
+      dmz(j.addr);
+#endif
+      break;
+    }
+  }
+
+  /// apply the next result, true if it left a packet in b (fast path)
+  bool apply(Buffer &b) {
+    Result &r = _results->head();
+    bool held = r.held;
+    switch (r.type) {
+    case Result::MAP:
+      publish(r.m);
+      break;
+    case Result::RETRY:
+      break;
+    case Result::EXPIRE:
+    case Result::KILL: {
+      // only look at m if it is still ours
+      typename mapout_t::iterator it = _out.find(r.key);
+      if (it.live() && (it->value == r.m) &&
+          ((r.type == Result::KILL) || (!r.m->used() && !inKernel(r.m))))
+        remove(it);
+      break;
+    }
+    }
+    if (held) b.copy(r.b);
+    _results->popHead();
+    return held;
+  }
+
+  /// hand over the mappings removed since, and a deferred DMZ (fast path)
+  void flushJobs() {
+    for (; !_dead.empty(); _dead.popHead()) {
+      Job *j = ask(Job::DEL);
+      if (!j) return;
+      j->m = _dead.head();
+      asked();
+    }
+    if (_dmz_set) {
+      Job *j = ask(Job::DMZ);
+      if (!j) return;
+      j->addr = _dmz;
+      asked();
+      _dmz_set = false;
+    }
+  }
+
+  /// not used by us since the last call, and may go unless the kernel uses it
+  bool idle(Mapping *m, bool keep_tcp) {
+    // NOTE: if we still have a TCP mapping, it's not done yet
+    return !m->reset() && !(keep_tcp && (m->protocol() == IPPROTO_TCP));
+  }
+
+  /// in use by the kernel since the last look (fast path)
+  bool inKernel(Mapping *m) {
+    bool fast = false;
+    if (_tc && (m->fast().on[TcOffload::LAN] || m->fast().on[TcOffload::WAN])) {
+      uint64_t n = forwarded(m);
+      fast = (n != m->fast().packets);
+      m->fast().packets = n;
+    }
+    return fast || (_nf && m->ct().flows);
+  }
+
+  void cleanupClients(uint64_t now) {
+    for (typename clients_t::iterator it = _clients.begin(); it.live(); ) {
+      Client &c = it->value;
+      if (c.limited || c.capped) {
+        in_addr_t a = it->key();
+        DBG("Client %s: %u maps, refused %u over rate, %u over cap\n",
+            inet_ntoa(*(in_addr *)&a), c.maps, c.limited, c.capped);
+        c.limited = c.capped = 0;
+      }
+      // its bucket is full again, or there is none
+      if (!c.maps && (!_cfg.conn_rate || (c.filled + 1000000 < now)))
+        it = _clients.erase(it);
       else
         ++it;
     }
   }
 
+  /**
+   * ICMP errors are translated by the mapping of the packet they quote
+   * (which went the opposite way). Rewrites the outer address on our side
+   * and the quoted header, so that PMTUD and unreachables reach the sender.
+   */
+  bool icmpError(Buffer &b, bool out) {
+    iphdr *quoted = icmp_error_header(b);
+    if (!quoted) return false;
+    IPFlowId id = IPFlowId(quoted).reverse(); // as if it was going our way
+    if (!id.valid()) return false;
+    Mapping *m = out ? _out.get(id) : _in.get(id);
+    if (!m) return false;
+    IPFlowId after = out ? m->mapOut(id) : m->mapIn(id);
+
+    iphdr *ip = (iphdr *)b.data();
+    if (out) {
+      update_in_cksum(ip->check, in_cksum_delta(ip->saddr, after.saddr));
+      ip->saddr = after.saddr;
+    } else {
+      update_in_cksum(ip->check, in_cksum_delta(ip->daddr, after.daddr));
+      ip->daddr = after.daddr;
+    }
+    unsigned len = b.size() - ((char *)quoted - b.data());
+    Translation(id.reverse(), after.reverse()).applyQuoted(quoted, len);
+
+    icmphdr *icmp = (icmphdr *)transport_header(b);
+    icmp->checksum = 0;
+    icmp->checksum = in_cksum(icmp, b.size() - (ip->ihl << 2));
+    if (_cfg.log) DBG("ICMP %d/%d for %s\n", icmp->type, icmp->code, unparse(id));
+    return true;
+  }
+
+  /// should b of an established flow be dropped to shed load? not pure ACKs
+  bool shed(const Buffer &b) {
+    if (pure_ack(b) || ((_shed_acc+= _shed) < 256))
+      return false;
+    _shed_acc-= 256;
+    ++_shed_est;
+    return true;
+  }
+
   bool filtered(const IPFlowId &id) { // ignore broadcast and LAN packets
     return ((id.daddr == (in_addr_t)-1)
         || ((id.daddr & _cfg.netmask) == _cfg.subnet));
   }
 
 public:
+  static const bool Cone = Mapping::Cone;
+  static const int MinMss = 536; // every host takes this much
+
   RewriterStub(const Config &c):
     _cfg(c),
     _uports(c.numpreserved, c.preserved, c.numports, c.firstport, false),
-    _tports(c.numpreserved, c.preserved, c.numports, c.firstport, true) {}
+    _tports(c.numpreserved, c.preserved, c.numports, c.firstport, true),
+    _limited(0), _capped(0), _mss(0), _wnd(false), _now(0), _shed_flows(false),
+    _shed(0), _shed_acc(0), _shed_new(0), _shed_est(0), _tc(0), _fast(0),
+    _nf(0), _ctq(256), _ctgen(0), _jobs(0), _results(0), _dead(4096),
+    _dmz_set(false), _slow_drops(0) {}
+  ~RewriterStub() { setSlowPath(false); }
 
   void configure(const Config &c) {
     _cfg = c;
+    _clients.clear(); // counts of mappings made without a quota are unknown
+    if (_cfg.conn_rate || _cfg.client_maps)
+      for (typename mapout_t::iterator it = _out.begin(); it.live(); ++it)
+        ++_clients[it->value->out().saddr].maps;
+  }
+
+  /// current uplink MTU, used to clamp TCP MSS in both directions
+  void setMtu(int mtu) {
+    if (mtu <= 0) return; // unknown, e.g. the link is down
+    int mss = mtu - (int)(sizeof(iphdr) + sizeof(tcphdr));
+    _mss = (mss < MinMss) ? MinMss : mss;
+  }
+
+  /// cap the receive windows of TCP flows near their BDP
+  void setWindowCtl(bool enabled) { _wnd = enabled; }
+  /// in us, once per burst if setWindowCtl()
+  void setTime(uint64_t now) { _now = now; }
+
+  /// under overload, refuse new flows, and drop share out of 256 of the rest
+  void setShedding(bool flows, unsigned share) {
+    _shed_flows = flows;
+    _shed = share;
+  }
+
+  /// forward established flows in the kernel, or stop to if tc is NULL
+  void setOffload(TcOffload *tc) {
+    _tc = tc;
+    _fast = 0;
+    // mappings in use get their entries as their packets show up
+    for (typename mapout_t::iterator it = _out.begin(); it.live(); ++it)
+      it->value->fast() = TcOffload::State();
+  }
+
+  /// forward flows through netfilter instead, or stop to if nf is NULL
+  void setConntrack(NfOffload *nf) {
+    _nf = nf;
+    _kflows.clear();
+    _ctq.clear();
+    // mappings in use get their entries as their packets show up
+    for (typename mapout_t::iterator it = _out.begin(); it.live(); ++it) {
+      it->value->ct() = NfOffload::State();
+      if (nf) mark(it->value);
+    }
+  }
+
+  /// drop all entries, e.g. when the MAC filter changes
+  void clearOffload() {
+    if (_tc) {
+      _tc->clear();
+      setOffload(_tc);
+    }
+    if (_nf) {
+      _nf->clear();
+      setConntrack(_nf);
+    }
+  }
+
+  /**
+   * Hand the flows seen since the last call to the kernel. Call this once
+   * the LAN capture is drained: what is still in there was dropped by the
+   * kernel, but would be taken for copies after.
+   */
+  void commitConntrack() {
+    for (; !_ctq.empty(); _ctq.popHead()) {
+      const Pending &p = _ctq.head();
+      typename kflows_t::iterator k = _kflows.find(p.orig);
+      if (!k.live() || (k->value != CT_PENDING)) continue;
+      Mapping *m = _out.get(p.orig);
+      if (!m || (m->ct().mark != p.mark)) { // removed since
+        _kflows.erase(k);
+        continue;
+      }
+      if (_nf->add(tuple(p.orig), _cfg.out_addr, m->port(), p.mark, p.state)) {
+        k->value = p.mark;
+        ++m->ct().flows;
+      } else { // e.g. it clashes with one of the stack's, carry on in userspace
+        k->value = CT_REFUSED;
+        if (_cfg.log) DBG("CT %s refused: %s\n", unparse(p.orig), strerror(errno));
+      }
+    }
+  }
+
+  /// catch up with the entries the kernel let go of
+  void conntrackEvents() {
+    NfOffload::Tuple t;
+    uint32_t mark;
+    while (_nf->destroyed(t, mark)) {
+      IPFlowId orig(t.saddr, t.daddr, t.sport, t.dport, t.protocol);
+      typename kflows_t::iterator k = _kflows.find(orig);
+      if (!k.live() || (k->value != mark)) continue; // e.g. of a removed mapping
+      _kflows.erase(k);
+      Mapping *m = _out.get(orig);
+      if (m && (m->ct().mark == mark) && m->ct().flows) --m->ct().flows;
+    }
+    if (_nf->lost()) { // no telling which are gone, start over
+      DBG("Lost conntrack events\n");
+      clearOffload();
+    }
+  }
+
+  /**
+   * Make and delete mappings (and everything else that is rare and slow) on
+   * a thread of their own, so that established flows don't wait for them.
+   * Until it publishes a mapping, the first packets of a flow are held in
+   * its queue, or dropped if it's busy: the fast path never waits. Keep
+   * calling nextPublished(), and slowWoken() when slowFd() is readable.
+   * Call configure() with it off.
+   */
+  bool setSlowPath(bool enabled) {
+    if (enabled == (_jobs != 0)) return true;
+    if (enabled) {
+      _jobs = new Ring<Job>(256);
+      _results = new Ring<Result>(256);
+      for (typename mapout_t::iterator it = _out.begin(); it.live(); ++it)
+        _made[it->key()] = it->value;
+      if (_slow.start(slowMain, this)) return true;
+      ERR("Could not start the slow path: %s\n", strerror(errno));
+      // and carry on without
+    } else {
+      _slow.stop();
+      Buffer b;
+      while (!_slow.done()) {
+        while (nextPublished(b)) {} // NOTE: held packets are lost
+        usleep(1000);
+      }
+      _slow.join();
+      // finish what it left behind on this thread
+      while (!_jobs->empty() || !_results->empty() || !_dead.empty() || _dmz_set) {
+        for (; !_jobs->empty() && !_results->full(); _jobs->popHead())
+          work(_jobs->head());
+        while (nextPublished(b)) {}
+      }
+    }
+    _made.clear();
+    delete _jobs;
+    delete _results;
+    _jobs = 0;
+    _results = 0;
+    return !enabled;
+  }
+  /// to select() on, or -1 if there is no slow path
+  int slowFd() const { return _jobs ? _slow.fd() : -1; }
+  void slowWoken() { _slow.woken(); }
+
+  /// translate the next held packet the slow path made a mapping for
+  bool nextPublished(Buffer &b) {
+    if (!_jobs) return false;
+    flushJobs();
+    while (!_results->empty()) {
+      if (apply(b) && packetOut(b))
+        return true;
+    }
+    return false;
   }
 
 #ifdef NAT_OPEN
   void setDmz(in_addr_t dmz) {
+    if (!_jobs) return this->dmz(dmz);
+    _dmz = dmz;
+    _dmz_set = true;
+    flushJobs();
+  }
+protected:
+  void dmz(in_addr_t dmz) {
     DBG("DMZ for %d ports\n", _cfg.numpreserved);
     int succeeded = 0;
     for (unsigned i = 0; i < _cfg.numpreserved; ++i) {
       uint16_t port = htons(_cfg.preserved[i]);
       freePort(port);
       uint16_t nport = _uports.alloc(port);
-      if (nport == port) {
-        map(IPFlowId(dmz, 0, port, port, IPPROTO_UDP), port);
+      if ((nport == port) && map(IPFlowId(dmz, 0, port, port, IPPROTO_UDP), port)) {
         ++succeeded;
-      } else {
+      } else if (nport != port) {
         _uports.free(nport);
       }
       nport = _tports.alloc(port);
-      if (nport == port) {
-        map(IPFlowId(dmz, 0, port, port, IPPROTO_TCP), port);
+      if ((nport == port) && map(IPFlowId(dmz, 0, port, port, IPPROTO_TCP), port)) {
         ++succeeded;
-      } else {
+      } else if (nport != port) {
         _tports.free(nport);
       }
     }
@@ -492,41 +1758,54 @@ public:
     map(IPFlowId(dmz, 0, port, port, IPPROTO_GRE), port);
     DBG("DMZ configured for %d ports\n", succeeded);
   }
+public:
 #endif
 
-  /// handle packet going in -> out
-  bool packetOut(Buffer &b) {
+  /**
+   * handle packet going in -> out
+   * With a slow path, the first packet of a flow is held until it's mapped,
+   * see nextPublished(), unless hold is false (e.g. b is only the header).
+   */
+  bool packetOut(Buffer &b, bool hold = true) {
     IPFlowId out(b);
-    if (!out.valid()) return false; // unrecognized protocol
+    if (!_frags.resolve(b, out, true)) return false; // held for now
+    if (!out.valid()) // unrecognized protocol
+      return !filtered(out) && icmpError(b, true);
 
-    Mapping *m = _out.get(out);
+    Mapping *m = _outc.get(_out, out);
     assert(_out.size() == _in.size());
     if (!m) {
       if (filtered(out)) return false;
-
-      uint16_t port = out.sport;
-      switch (out.protocol) {
-      case IPPROTO_UDP:
-        port = _uports.alloc(port);
-        if (port == 0) {
-          DBG("OUT OF UDP PORTS!\n");
-          return false;
-        }
-        break;
-      case IPPROTO_TCP:
-        port = _tports.alloc(port);
-        if (port == 0) {
-          DBG("OUT OF TCP PORTS!\n");
+      if (_shed_flows) {
+        ++_shed_new;
+        return false;
+      }
+      if (_jobs) {
+        Job *j = ask(Job::NEW);
+        if (!j) {
+          ++_slow_drops;
           return false;
         }
-        break;
-      default:
-        // else leave the echo.id untouched
-        break;
+        j->id = out;
+        j->held = hold;
+        if (hold) j->b.copy(b);
+        asked();
+        return false;
       }
-      m = map(out, port);
+      if (!(m = create(out, _now))) return false;
+      publish(m);
+    } else if (_shed && shed(b)) {
+      return false;
+    }
+    if (_tc && !m->fast().on[TcOffload::LAN]) offload(m); // e.g. after clearOffload()
+    if (_nf && conntracked(m, out, &b)) {
+      m->seen(b, true);
+      if (m->done()) remove(m);
+      return false;
     }
     m->applyOut(out, b);
+    if (_mss && (out.protocol == IPPROTO_TCP)) clamp_mss(b, _mss);
+    if (_wnd && (out.protocol == IPPROTO_TCP)) m->window().out(b, _now);
     if (m->done()) remove(m);
     return true;
   }
@@ -534,27 +1813,105 @@ public:
   /// handle packet going out -> in
   bool packetIn(Buffer &b) {
     IPFlowId in(b);
-    if (!in.valid()) return false;
-    Mapping *m = _in.get(in);
+    if (!_frags.resolve(b, in, false)) return false; // held for now
+    if (!in.valid()) return icmpError(b, false);
+    Mapping *m = _inc.get(_in, in);
     assert(_out.size() == _in.size());
     if (!m) return false; // unrelated flow, firewalled
+    if (_nf && conntracked(m, m->mapIn(in).reverse(), 0)) {
+      m->seen(b, false);
+      if (m->done()) remove(m);
+      return false;
+    }
+    if (_shed && shed(b)) return false;
     m->applyIn(in, b);
+    if (_mss && (in.protocol == IPPROTO_TCP)) clamp_mss(b, _mss);
+    if (_wnd && (in.protocol == IPPROTO_TCP)) m->window().in(b, _now);
     if (m->done()) remove(m);
     return true;
   }
 
+  /**
+   * Socket filter for the WAN capture, accepting only what could match a
+   * mapping: packets to out_addr on our (or preserved) ports, ICMP and GRE.
+   * Needs to be rebuilt whenever out_addr or the ports change.
+   */
+  bool wanFilter(BPFProgram &p) const {
+    uint16_t lo = _uports.lo() < _tports.lo() ? _uports.lo() : _tports.lo();
+    uint16_t hi = _uports.hi() > _tports.hi() ? _uports.hi() : _tports.hi();
+    p.clear();
+    p.stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(iphdr, daddr));
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(_cfg.out_addr), 0, BPFProgram::DROP);
+    p.stmt(BPF_LD | BPF_B | BPF_ABS, offsetof(iphdr, protocol));
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, BPFProgram::ACCEPT, 0);
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_GRE, BPFProgram::ACCEPT, 0);
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0);
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, BPFProgram::DROP);
+    // later fragments have no ports, FragmentCache will sort them out
+    p.stmt(BPF_LD | BPF_H | BPF_ABS, offsetof(iphdr, frag_off));
+    p.jump(BPF_JMP | BPF_JSET | BPF_K, IP_OFFMASK, BPFProgram::ACCEPT, 0);
+    p.stmt(BPF_LDX | BPF_B | BPF_MSH, 0); // X = ihl * 4
+    p.stmt(BPF_LD | BPF_H | BPF_IND, 2);  // dest port, same for TCP and UDP
+    p.jump(BPF_JMP | BPF_JGE | BPF_K, lo, 0, 1);
+    p.jump(BPF_JMP | BPF_JGT | BPF_K, hi, 0, BPFProgram::ACCEPT);
+    for (unsigned i = 0; i < _cfg.numpreserved; ++i) // also used by DMZ
+      p.jump(BPF_JMP | BPF_JEQ | BPF_K, _cfg.preserved[i], BPFProgram::ACCEPT, 0);
+    p.stmt(BPF_RET | BPF_K, 0);
+    return p.finish();
+  }
+
+  /// translate the next held fragment that can be translated now
+  bool nextFragment(Buffer &b) {
+    bool out;
+    while (_frags.release(b, out)) {
+      if (out ? packetOut(b) : packetIn(b))
+        return true;
+    }
+    return false;
+  }
+
   /// clean up long unused mappings
   void cleanup(bool keep_tcp) {
-    for (typename mapout_t::iterator it = _out.begin(); it.live(); ) {
-      Mapping *m = it->value;
-      if (m->used() || (keep_tcp && (m->protocol() == IPPROTO_TCP))) {
-        // NOTE: if we still have a TCP mapping, it's not done yet
-        m->reset();
+    _frags.cleanup();
+    if (_jobs) { // skipped if busy, there is always next time
+      if (Job *j = ask(Job::CLEANUP)) {
+        j->keep_tcp = keep_tcp;
+        asked();
+      }
+    } else {
+      for (typename mapout_t::iterator it = _out.begin(); it.live(); ) {
+        bool busy = inKernel(it->value); // takes its count either way
+        if (idle(it->value, keep_tcp) && !busy) remove(it);
+        else ++it;
+      }
+      cleanupClients(_now);
+    }
+    // retry what was refused, forget what is left of removed mappings
+    for (typename kflows_t::iterator it = _kflows.begin(); it.live(); ) {
+      Mapping *m = _out.get(it->key());
+      if (!(it->value & NfOffload::Tag) || !m || (m->ct().mark != it->value))
+        it = _kflows.erase(it);
+      else
         ++it;
-      } else remove(it);
     }
   }
   int size() const { return _in.size(); }
+
+  /// new mappings refused over conn_rate and over client_maps
+  unsigned limited() const { return _limited; }
+  unsigned capped() const { return _capped; }
+  /// mappings of the client, if counted; for the tests, the slow path owns them
+  unsigned clientMaps(in_addr_t addr) const { return _clients.get(addr).maps; }
+  /// packets dropped for overload, of new and of established flows
+  unsigned shedNew() const { return _shed_new; }
+  unsigned shedEstablished() const { return _shed_est; }
+  /// first packets of flows dropped for a busy slow path
+  unsigned slowDrops() const { return _slow_drops; }
+  /// entries in the kernel fast path, two per mapping with TC, or per flow
+  unsigned offloaded() const { return _tc ? _fast : _kflows.size(); }
+  /// flow cache stats, both directions
+  unsigned cacheHits() const { return _outc.hits() + _inc.hits(); }
+  unsigned cacheMisses() const { return _outc.misses() + _inc.misses(); }
 };
 
 
@@ -67,7 +67,11 @@ class MappingFullCone {
     F_CLEAR = 0, F_OUT_DONE = 1, F_IN_DONE = 2, F_DONE = 3
   };
   int _flags;
+  WindowCtl _window; // TCP only
+  TcOffload::State _fast;
+  NfOffload::State _ct;
 public:
+  static const bool Cone = true; // flows to anywhere share the mapping
 
   typedef IPFlowIdOut IdOut;
   typedef IPFlowIdIn IdIn;
@@ -75,7 +79,7 @@ public:
   // NOTE: only source address/port is stored
   MappingFullCone(const IPFlowId &before, in_addr_t newsrc, uint16_t newport)
     : _id(IPFlowId(before.saddr, newsrc, before.sport, newport, before.protocol)),
-      _flags(F_CLEAR) {}
+      _used(true), _flags(F_CLEAR) {}
 
   /// this is what we use for hash keys
   IdOut out() const { return _id; } // only src matters
@@ -84,7 +88,7 @@ public:
 
   /// look out for SYN, FIN and RST packets
   void updateFlags(const Buffer &b, bool out) {
-    if (protocol() != IPPROTO_TCP) return;
+    if ((protocol() != IPPROTO_TCP) || !has_transport_header(b)) return;
     const tcphdr *tcp = (const tcphdr *)transport_header(b);
     if (tcp->rst)      { _flags &= out ? ~F_OUT_DONE : ~F_IN_DONE; }
     else if (tcp->fin) { _flags |= out ? F_OUT_DONE : F_IN_DONE; }
@@ -92,24 +96,46 @@ public:
     else if (tcp->syn) { _flags = F_CLEAR; }
   }
 
+  /// what a flow becomes when translated
+  IPFlowId mapOut(const IPFlowId &before) const {
+    return IPFlowId(_id.daddr, before.daddr, _id.dport, before.dport, before.protocol);
+  }
+  IPFlowId mapIn(const IPFlowId &before) const {
+    return IPFlowId(before.saddr, _id.saddr, before.sport, _id.sport, before.protocol);
+  }
+
   void applyOut(const IPFlowId &before, Buffer &b) {
-    IPFlowId after(_id.daddr, before.daddr, _id.dport, before.dport, before.protocol);
-    Translation(before, after).apply(b); // FIXME: this unnecessarily considers dst addr/port
-    assert(IdIn(IPFlowId(b).reverse()) == in()); // TOO MANY TIMES THIS FAILS!
+    Translation(before, mapOut(before)).apply(b); // FIXME: this unnecessarily considers dst addr/port
+    assert(!has_transport_header(b) ||
+           IdIn(IPFlowId(b).reverse()) == in()); // TOO MANY TIMES THIS FAILS!
     updateFlags(b, true);
-    _used = true;
+    touch();
   }
 
   void applyIn(const IPFlowId &before, Buffer &b) {
-    IPFlowId after(before.saddr, _id.saddr, before.sport, _id.sport, before.protocol);
-    Translation(before, after).apply(b);
+    Translation(before, mapIn(before)).apply(b);
     updateFlags(b, false);
-    _used = true;
+    touch();
   }
 
+  /// b went by untranslated, e.g. the kernel forwarded it
+  void seen(const Buffer &b, bool out) {
+    updateFlags(b, out);
+    touch();
+  }
+
+  WindowCtl &window() { return _window; }
+  TcOffload::State &fast() { return _fast; }
+  const TcOffload::State &fast() const { return _fast; }
+  NfOffload::State &ct() { return _ct; }
+  const NfOffload::State &ct() const { return _ct; }
+
   bool done() const { return (_flags == F_DONE); }
-  bool used() const { return _used; }
-  void reset() { _used = false; }
+  /// the dirty flag is set here and cleared by the slow path, so always atomically
+  void touch() { __atomic_store_n(&_used, true, __ATOMIC_RELAXED); }
+  bool used() const { return __atomic_load_n(&_used, __ATOMIC_RELAXED); }
+  /// clear the dirty flag, and tell if it was set
+  bool reset() { return __atomic_exchange_n(&_used, false, __ATOMIC_RELAXED); }
   uint16_t port() const {
     return _id.dport;
   }
@@ -32,14 +32,18 @@ class MappingSymmetric {
     F_CLEAR = 0, F_OUT_DONE = 1, F_IN_DONE = 2, F_DONE = 3
   };
   int _flags;
+  WindowCtl _window; // TCP only
+  TcOffload::State _fast;
+  NfOffload::State _ct;
 public:
+  static const bool Cone = false; // a mapping is for one flow
 
   typedef IPFlowId IdOut;
   typedef IPFlowId IdIn;
 
   MappingSymmetric(const IPFlowId &before, in_addr_t newsrc, uint16_t newport)
     : _out(before, IPFlowId(newsrc, before.daddr, newport, before.dport, before.protocol)),
-      _in(_out.flowid().reverse(), before.reverse()), _flags(F_CLEAR) {}
+      _in(_out.flowid().reverse(), before.reverse()), _used(true), _flags(F_CLEAR) {}
 
   /// this is what we use for hash keys, used rarely
   IdOut out() const { return  _in.flowid().reverse(); }
@@ -48,7 +52,7 @@ public:
 
   /// look out for SYN, FIN and RST packets
   void updateFlags(const Buffer &b, bool out) {
-    if (protocol() != IPPROTO_TCP) return;
+    if ((protocol() != IPPROTO_TCP) || !has_transport_header(b)) return;
     const tcphdr *tcp = (const tcphdr *)transport_header(b);
     if (tcp->rst)      { _flags &= out ? ~F_OUT_DONE : ~F_IN_DONE; }
     else if (tcp->fin) { _flags |= out ? F_OUT_DONE : F_IN_DONE; }
@@ -56,21 +60,40 @@ public:
     else if (tcp->syn) { _flags = F_CLEAR; }
   }
 
+  /// what a flow becomes when translated
+  IPFlowId mapOut(const IPFlowId &) const { return _out.flowid(); }
+  IPFlowId mapIn(const IPFlowId &)  const { return _in.flowid(); }
+
   void applyOut(const IPFlowId &, Buffer &b) {
     _out.apply(b);
     updateFlags(b, true);
-    _used = true;
+    touch();
   }
 
   void applyIn(const IPFlowId &, Buffer &b) {
     _in.apply(b);
     updateFlags(b, false);
-    _used = true;
+    touch();
+  }
+
+  /// b went by untranslated, e.g. the kernel forwarded it
+  void seen(const Buffer &b, bool out) {
+    updateFlags(b, out);
+    touch();
   }
 
+  WindowCtl &window() { return _window; }
+  TcOffload::State &fast() { return _fast; }
+  const TcOffload::State &fast() const { return _fast; }
+  NfOffload::State &ct() { return _ct; }
+  const NfOffload::State &ct() const { return _ct; }
+
   bool done() const { return (_flags == F_DONE); }
-  bool used() const { return _used; }
-  void reset() { _used = false; }
+  /// the dirty flag is set here and cleared by the slow path, so always atomically
+  void touch() { __atomic_store_n(&_used, true, __ATOMIC_RELAXED); }
+  bool used() const { return __atomic_load_n(&_used, __ATOMIC_RELAXED); }
+  /// clear the dirty flag, and tell if it was set
+  bool reset() { return __atomic_exchange_n(&_used, false, __ATOMIC_RELAXED); }
   uint16_t port() const {
     return _out.flowid().sport;
   }
@@ -0,0 +1,54 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: neighbor cache */
+#ifndef INCLUDED_NEIGHBORS_HH
+#define INCLUDED_NEIGHBORS_HH
+
+#include <netinet/in.h> // for in_addr_t
+#include "hashmap.hh"
+#include "macaddress.hh"
+
+/**
+ * MAC addresses learned from received frames (or DHCP leases), so that we
+ * can send frames without ARP. Off-link addresses are reached through the
+ * router, which is whoever sends us frames from them.
+ */
+class Neighbors {
+  HashMap<in_addr_t, MACAddress> _map;
+  MACAddress _router;
+  bool _have_router;
+public:
+  Neighbors() : _have_router(false) {}
+  void clear() { _map.clear(); _have_router = false; }
+  void learn(in_addr_t addr, const uint8_t *mac) {
+    HashMap<in_addr_t, MACAddress>::const_iterator it = _map.find(addr);
+    if (!it.live() || !(it->value == MACAddress(mac)))
+      _map[addr] = MACAddress(mac); // the common case is a lookup only
+  }
+  void learnRouter(const uint8_t *mac) { _router = MACAddress(mac); _have_router = true; }
+  /// NULL if unknown
+  const uint8_t *find(in_addr_t addr, bool onlink) const {
+    if (!onlink)
+      return _have_router ? _router.addr : 0;
+    HashMap<in_addr_t, MACAddress>::const_iterator it = _map.find(addr);
+    return it.live() ? it->value.addr : 0;
+  }
+};
+
+#endif // INCLUDED_NEIGHBORS_HH
@@ -0,0 +1,512 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: netfilter fast path for established flows */
+#ifndef INCLUDED_NFOFFLOAD_HH
+#define INCLUDED_NFOFFLOAD_HH
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h> // for NF_XX
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_compat.h> // for NF_NETLINK_CONNTRACK_DESTROY
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+#include <linux/netfilter/nf_tables.h>
+
+/**
+ * Kernel fast path for when eBPF is not available: netfilter does the NAT
+ * and its flowtable the forwarding. For every flow the Rewriter lets out, a
+ * conntrack entry is made over ctnetlink with the very source NAT the
+ * Rewriter picked, and tagged with the mark of the mapping. Our table then
+ * forwards only what has such an entry, and puts it into the flowtable once
+ * it is established. Anything else (ICMP, flows without an entry) is dropped
+ * on the forward path, and left to the capture sockets and the Rewriter as
+ * before. Those still get a copy of what the kernel forwards until the
+ * flowtable takes over, so the Rewriter has to tell them apart.
+ *
+ * What we inject to the WAN carries SkbMark and is not tracked, so that it
+ * does not make entries that would clash with ours.
+ *
+ * The table is owned by our netlink socket (Linux 5.18), the kernel drops it
+ * when we are gone. ip_forward is turned on once the table is in place, and
+ * back to what it was on close(), so the kernel never forwards without it.
+ */
+class NfOffload {
+public:
+  static const uint32_t Tag = 0x80000000; // in the ct mark of all our entries
+  static const uint32_t SkbMark = 0x62726e63; // of our own packets
+  static const uint32_t Timeout = 30; // in s, until the entry sees a packet
+  static const char *table() { return "barnacle"; }
+
+  /// a direction of a flow, all in network order
+  struct Tuple {
+    in_addr_t saddr;
+    in_addr_t daddr;
+    uint16_t  sport;
+    uint16_t  dport;
+    uint8_t   protocol;
+  };
+  /// conntrack entries of a mapping
+  struct State {
+    uint32_t mark;  // Tag and a number, 0 if it can have none
+    unsigned flows; // in the kernel, as far as we know
+    State() : mark(0), flows(0) {}
+  };
+
+protected:
+  /// netlink message builder
+  class Msg {
+    char     _buf[2048];
+    unsigned _len;
+    unsigned _hdr; // of the current message
+  public:
+    Msg() : _len(0), _hdr(0) {}
+    void clear() { _len = 0; }
+    const char *data() const { return _buf; }
+    unsigned size() const { return _len; }
+
+    void begin(uint16_t type, uint16_t flags, uint32_t seq, uint8_t family, uint16_t res) {
+      _hdr = _len;
+      nlmsghdr *h = (nlmsghdr *)(_buf + _len);
+      h->nlmsg_type = type;
+      h->nlmsg_flags = NLM_F_REQUEST | flags;
+      h->nlmsg_seq = seq;
+      h->nlmsg_pid = 0;
+      _len+= NLMSG_HDRLEN;
+      nfgenmsg *g = (nfgenmsg *)(_buf + _len);
+      g->nfgen_family = family;
+      g->version = NFNETLINK_V0;
+      g->res_id = htons(res);
+      _len+= NLMSG_ALIGN(sizeof(nfgenmsg));
+    }
+    void end() { ((nlmsghdr *)(_buf + _hdr))->nlmsg_len = _len - _hdr; }
+
+    void put(uint16_t type, const void *data, unsigned len) {
+      nlattr *a = (nlattr *)(_buf + _len);
+      a->nla_type = type;
+      a->nla_len = NLA_HDRLEN + len;
+      memcpy(_buf + _len + NLA_HDRLEN, data, len);
+      memset(_buf + _len + NLA_HDRLEN + len, 0, NLA_ALIGN(len) - len);
+      _len+= NLA_HDRLEN + NLA_ALIGN(len);
+    }
+    void put8(uint16_t type, uint8_t v) { put(type, &v, sizeof(v)); }
+    void put32(uint16_t type, uint32_t v) { v = htonl(v); put(type, &v, sizeof(v)); }
+    void str(uint16_t type, const char *s) { put(type, s, strlen(s) + 1); }
+
+    unsigned nest(uint16_t type) {
+      unsigned off = _len;
+      put(type | NLA_F_NESTED, 0, 0);
+      return off;
+    }
+    void close(unsigned off) { ((nlattr *)(_buf + off))->nla_len = _len - off; }
+  };
+
+  int      _nl;  // requests, owns the table
+  int      _ev;  // destroy events
+  uint32_t _seq;
+  bool     _lost; // events did not fit in _ev
+  bool     _ft;   // we have the flowtable
+  int      _forward; // ip_forward before open(), -1 if we did not set it
+  Msg      _msg;
+  char     _rbuf[8192];
+  int      _rlen; // left of the events in _rbuf
+  const nlmsghdr *_rh;
+
+  /// set ip_forward to on, return what it was or -1 on failure
+  static int forwarding(int on) {
+    int fd = ::open("/proc/sys/net/ipv4/ip_forward", O_RDWR | O_CLOEXEC);
+    char c = '0' + on, was = 0;
+    bool ok = (fd >= 0) && (::read(fd, &was, 1) == 1) &&
+              (::pwrite(fd, &c, 1, 0) == 1);
+    if (fd >= 0) ::close(fd);
+    return ok ? (was != '0') : -1;
+  }
+
+  /// send _msg and wait for the answer to message last, first to last asked
+  bool talk(uint32_t first, uint32_t last) {
+    if (::send(_nl, _msg.data(), _msg.size(), 0) < 0)
+      return false;
+    int err = 0;
+    for (;;) {
+      int n = ::recv(_nl, _rbuf, sizeof(_rbuf), 0);
+      if (n < 0) return false; // incl. the timeout
+      for (const nlmsghdr *h = (const nlmsghdr *)_rbuf; NLMSG_OK(h, (unsigned)n);
+           h = NLMSG_NEXT(h, n)) {
+        if ((h->nlmsg_type != NLMSG_ERROR) || ((int32_t)(h->nlmsg_seq - first) < 0))
+          continue; // left over from before
+        int e = ((const nlmsgerr *)NLMSG_DATA(h))->error;
+        if (e && !err) err = e;
+        if (h->nlmsg_seq == last) {
+          errno = -err;
+          return !err;
+        }
+      }
+    }
+  }
+
+  // nftables, see setup()
+  void nft(uint16_t type, uint16_t flags) {
+    _msg.begin((NFNL_SUBSYS_NFTABLES << 8) | type, NLM_F_CREATE | NLM_F_ACK | flags,
+               ++_seq, NFPROTO_IPV4, 0);
+  }
+  void chain(const char *name, const char *type, uint32_t hook, int32_t prio, bool drop) {
+    nft(NFT_MSG_NEWCHAIN, 0);
+    _msg.str(NFTA_CHAIN_TABLE, table());
+    _msg.str(NFTA_CHAIN_NAME, name);
+    unsigned h = _msg.nest(NFTA_CHAIN_HOOK);
+    _msg.put32(NFTA_HOOK_HOOKNUM, hook);
+    _msg.put32(NFTA_HOOK_PRIORITY, prio);
+    _msg.close(h);
+    _msg.str(NFTA_CHAIN_TYPE, type);
+    if (drop) _msg.put32(NFTA_CHAIN_POLICY, NF_DROP);
+    _msg.end();
+  }
+  unsigned expr(const char *name) {
+    unsigned e = _msg.nest(NFTA_LIST_ELEM);
+    _msg.str(NFTA_EXPR_NAME, name);
+    return e;
+  }
+  /// reg1 op value, of len bytes as the kernel has them
+  void cmp(uint32_t op, const void *value, unsigned len) {
+    unsigned e = expr("cmp");
+    unsigned d = _msg.nest(NFTA_EXPR_DATA);
+    _msg.put32(NFTA_CMP_SREG, NFT_REG_1);
+    _msg.put32(NFTA_CMP_OP, op);
+    unsigned v = _msg.nest(NFTA_CMP_DATA);
+    _msg.put(NFTA_DATA_VALUE, value, len);
+    _msg.close(v);
+    _msg.close(d);
+    _msg.close(e);
+  }
+  /// reg1 = key, of the meta or ct expression
+  void load(const char *name, uint16_t keyattr, uint32_t key, uint16_t regattr) {
+    unsigned e = expr(name);
+    unsigned d = _msg.nest(NFTA_EXPR_DATA);
+    _msg.put32(keyattr, key);
+    _msg.put32(regattr, NFT_REG_1);
+    _msg.close(d);
+    _msg.close(e);
+  }
+
+  /**
+   * table barnacle {
+   *   flowtable ft { hook ingress priority 0; devices = { lan, wan } }
+   *   chain forward { type filter hook forward priority 0; policy drop;
+   *     ct mark & Tag != 0 meta l4proto != icmp flow add @ft accept }
+   *   chain output { type filter hook output priority raw;
+   *     meta mark SkbMark notrack }
+   *   chain pre { type nat hook prerouting priority dstnat; }
+   *   chain post { type nat hook postrouting priority srcnat; }
+   * }
+   * The nat chains are empty, they are there for the NAT of our entries.
+   * Without ft, there's no flowtable and no flow add.
+   */
+  bool setup(const char *lanif, const char *wanif, bool ft) {
+    _msg.clear();
+    _msg.begin(NFNL_MSG_BATCH_BEGIN, 0, ++_seq, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+    _msg.end();
+    uint32_t first = _seq + 1;
+
+    nft(NFT_MSG_NEWTABLE, 0);
+    _msg.str(NFTA_TABLE_NAME, table());
+    _msg.put32(NFTA_TABLE_FLAGS, NFT_TABLE_F_OWNER);
+    _msg.end();
+
+    unsigned d, h;
+    if (ft) {
+      nft(NFT_MSG_NEWFLOWTABLE, 0);
+      _msg.str(NFTA_FLOWTABLE_TABLE, table());
+      _msg.str(NFTA_FLOWTABLE_NAME, "ft");
+      h = _msg.nest(NFTA_FLOWTABLE_HOOK);
+      _msg.put32(NFTA_FLOWTABLE_HOOK_NUM, NF_NETDEV_INGRESS);
+      _msg.put32(NFTA_FLOWTABLE_HOOK_PRIORITY, 0);
+      d = _msg.nest(NFTA_FLOWTABLE_HOOK_DEVS);
+      _msg.str(NFTA_DEVICE_NAME, lanif);
+      if (strcmp(lanif, wanif)) _msg.str(NFTA_DEVICE_NAME, wanif);
+      _msg.close(d);
+      _msg.close(h);
+      _msg.end();
+    }
+
+    chain("forward", "filter", NF_INET_FORWARD, 0, true);
+    chain("output", "filter", NF_INET_LOCAL_OUT, -300, false);
+    chain("pre", "nat", NF_INET_PRE_ROUTING, -100, false);
+    chain("post", "nat", NF_INET_POST_ROUTING, 100, false);
+
+    nft(NFT_MSG_NEWRULE, NLM_F_APPEND);
+    _msg.str(NFTA_RULE_TABLE, table());
+    _msg.str(NFTA_RULE_CHAIN, "forward");
+    unsigned l = _msg.nest(NFTA_RULE_EXPRESSIONS);
+    load("ct", NFTA_CT_KEY, NFT_CT_MARK, NFTA_CT_DREG);
+    unsigned e = expr("bitwise");
+    d = _msg.nest(NFTA_EXPR_DATA);
+    _msg.put32(NFTA_BITWISE_SREG, NFT_REG_1);
+    _msg.put32(NFTA_BITWISE_DREG, NFT_REG_1);
+    _msg.put32(NFTA_BITWISE_LEN, sizeof(uint32_t));
+    uint32_t tag = Tag, zero = 0;
+    unsigned v = _msg.nest(NFTA_BITWISE_MASK);
+    _msg.put(NFTA_DATA_VALUE, &tag, sizeof(tag));
+    _msg.close(v);
+    v = _msg.nest(NFTA_BITWISE_XOR);
+    _msg.put(NFTA_DATA_VALUE, &zero, sizeof(zero));
+    _msg.close(v);
+    _msg.close(d);
+    _msg.close(e);
+    cmp(NFT_CMP_NEQ, &zero, sizeof(zero));
+    load("meta", NFTA_META_KEY, NFT_META_L4PROTO, NFTA_META_DREG);
+    uint8_t icmp = IPPROTO_ICMP;
+    cmp(NFT_CMP_NEQ, &icmp, sizeof(icmp));
+    if (ft) {
+      e = expr("flow_offload");
+      d = _msg.nest(NFTA_EXPR_DATA);
+      _msg.str(NFTA_FLOW_TABLE_NAME, "ft");
+      _msg.close(d);
+      _msg.close(e);
+    }
+    e = expr("immediate");
+    d = _msg.nest(NFTA_EXPR_DATA);
+    _msg.put32(NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+    v = _msg.nest(NFTA_IMMEDIATE_DATA);
+    unsigned vd = _msg.nest(NFTA_DATA_VERDICT);
+    _msg.put32(NFTA_VERDICT_CODE, NF_ACCEPT);
+    _msg.close(vd);
+    _msg.close(v);
+    _msg.close(d);
+    _msg.close(e);
+    _msg.close(l);
+    _msg.end();
+
+    nft(NFT_MSG_NEWRULE, NLM_F_APPEND);
+    _msg.str(NFTA_RULE_TABLE, table());
+    _msg.str(NFTA_RULE_CHAIN, "output");
+    l = _msg.nest(NFTA_RULE_EXPRESSIONS);
+    load("meta", NFTA_META_KEY, NFT_META_MARK, NFTA_META_DREG);
+    uint32_t mark = SkbMark;
+    cmp(NFT_CMP_EQ, &mark, sizeof(mark));
+    e = expr("notrack");
+    _msg.close(e);
+    _msg.close(l);
+    _msg.end();
+
+    uint32_t last = _seq; // the end of the batch is not answered
+    _msg.begin(NFNL_MSG_BATCH_END, 0, ++_seq, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+    _msg.end();
+    return talk(first, last);
+  }
+
+  void tuple(uint16_t type, const Tuple &t) {
+    unsigned n = _msg.nest(type);
+    unsigned ip = _msg.nest(CTA_TUPLE_IP);
+    _msg.put(CTA_IP_V4_SRC, &t.saddr, sizeof(t.saddr));
+    _msg.put(CTA_IP_V4_DST, &t.daddr, sizeof(t.daddr));
+    _msg.close(ip);
+    unsigned p = _msg.nest(CTA_TUPLE_PROTO);
+    _msg.put8(CTA_PROTO_NUM, t.protocol);
+    _msg.put(CTA_PROTO_SRC_PORT, &t.sport, sizeof(t.sport));
+    _msg.put(CTA_PROTO_DST_PORT, &t.dport, sizeof(t.dport));
+    _msg.close(p);
+    _msg.close(n);
+  }
+
+  void ct(uint8_t type, uint16_t flags) {
+    _msg.clear();
+    _msg.begin((NFNL_SUBSYS_CTNETLINK << 8) | type, NLM_F_ACK | flags, ++_seq, AF_INET, 0);
+  }
+
+  /// fill in t from the attributes nested in a, of CTA_TUPLE_ORIG at depth 0
+  static void parseTuple(const nlattr *a, Tuple &t, int depth = 0) {
+    int len = a->nla_len - NLA_HDRLEN;
+    for (a = (const nlattr *)((const char *)a + NLA_HDRLEN);
+         (len >= NLA_HDRLEN) && (a->nla_len >= NLA_HDRLEN) && (a->nla_len <= len);
+         len-= NLA_ALIGN(a->nla_len), a = (const nlattr *)((const char *)a + NLA_ALIGN(a->nla_len))) {
+      const char *p = (const char *)a + NLA_HDRLEN;
+      int type = a->nla_type & NLA_TYPE_MASK;
+      if (!depth) {
+        if ((type == CTA_TUPLE_IP) || (type == CTA_TUPLE_PROTO))
+          parseTuple(a, t, type);
+      } else if (depth == CTA_TUPLE_IP) {
+        if (type == CTA_IP_V4_SRC) memcpy(&t.saddr, p, sizeof(t.saddr));
+        if (type == CTA_IP_V4_DST) memcpy(&t.daddr, p, sizeof(t.daddr));
+      } else {
+        if (type == CTA_PROTO_NUM) t.protocol = *(const uint8_t *)p;
+        if (type == CTA_PROTO_SRC_PORT) memcpy(&t.sport, p, sizeof(t.sport));
+        if (type == CTA_PROTO_DST_PORT) memcpy(&t.dport, p, sizeof(t.dport));
+      }
+    }
+  }
+
+public:
+  NfOffload() : _nl(-1), _ev(-1), _seq(0), _lost(false), _ft(false), _forward(-1), _rlen(0), _rh(0) {}
+  ~NfOffload() { close(); }
+
+  void close() {
+    if (_forward >= 0) forwarding(_forward); // before the table is gone
+    _forward = -1;
+    if (_nl >= 0) ::close(_nl); // and the table is gone
+    if (_ev >= 0) ::close(_ev);
+    _nl = _ev = -1;
+    _rlen = 0;
+    _lost = false;
+  }
+  bool ok() const { return _nl >= 0; }
+  /// established flows skip the forward path, see open()
+  bool flowtable() const { return _ft; }
+  /// of the destroy events, to select on
+  int fd() const { return _ev; }
+
+  /// set up our table for the interfaces, return false on fail
+  bool open(const char *lanif, const char *wanif) {
+    close();
+    _nl = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    _ev = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_NETFILTER);
+    sockaddr_nl sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    timeval tv = { 1, 0 }; // the kernel answers right away, if at all
+    int size = 1 << 20;
+    if ((_nl < 0) || (_ev < 0) ||
+        (::bind(_nl, (sockaddr *)&sa, sizeof(sa)) < 0) ||
+        (::setsockopt(_nl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0))
+      goto fail;
+    sa.nl_groups = NF_NETLINK_CONNTRACK_DESTROY;
+    // a burst of expiring entries should not overflow
+    if ((::setsockopt(_ev, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) &&
+        (::setsockopt(_ev, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0))
+      goto fail;
+    if (::bind(_ev, (sockaddr *)&sa, sizeof(sa)) < 0)
+      goto fail;
+    // without NF_FLOW_TABLE, the flows take the whole forward path
+    _ft = setup(lanif, wanif, true);
+    if (!_ft && !setup(lanif, wanif, false))
+      goto fail;
+    // only now, as the table drops what is not ours
+    if ((_forward = forwarding(1)) < 0)
+      goto fail;
+    return true;
+  fail:
+    int e = errno;
+    close();
+    errno = e;
+    return false;
+  }
+
+  /**
+   * Make the entry of a flow, orig as it comes from the LAN, with its source
+   * translated to addr and port. TCP starts in state (TCP_CONNTRACK_XX) and
+   * with window tracking off, as the kernel has not seen the handshake.
+   */
+  bool add(const Tuple &orig, in_addr_t addr, uint16_t port, uint32_t mark, uint8_t state) {
+    // the reply before NAT, the kernel works out the rest from CTA_NAT_SRC
+    Tuple reply = { orig.daddr, orig.saddr, orig.dport, orig.sport, orig.protocol };
+    ct(IPCTNL_MSG_CT_NEW, NLM_F_CREATE | NLM_F_EXCL);
+    tuple(CTA_TUPLE_ORIG, orig);
+    tuple(CTA_TUPLE_REPLY, reply);
+    unsigned n = _msg.nest(CTA_NAT_SRC);
+    _msg.put(CTA_NAT_V4_MINIP, &addr, sizeof(addr));
+    _msg.put(CTA_NAT_V4_MAXIP, &addr, sizeof(addr));
+    unsigned p = _msg.nest(CTA_NAT_PROTO);
+    _msg.put(CTA_PROTONAT_PORT_MIN, &port, sizeof(port));
+    _msg.put(CTA_PROTONAT_PORT_MAX, &port, sizeof(port));
+    _msg.close(p);
+    _msg.close(n);
+    _msg.put32(CTA_TIMEOUT, Timeout);
+    _msg.put32(CTA_MARK, mark);
+    if (orig.protocol == IPPROTO_TCP) {
+      nf_ct_tcp_flags f = { IP_CT_TCP_FLAG_BE_LIBERAL, IP_CT_TCP_FLAG_BE_LIBERAL };
+      n = _msg.nest(CTA_PROTOINFO);
+      p = _msg.nest(CTA_PROTOINFO_TCP);
+      _msg.put8(CTA_PROTOINFO_TCP_STATE, state);
+      _msg.put(CTA_PROTOINFO_TCP_FLAGS_ORIGINAL, &f, sizeof(f));
+      _msg.put(CTA_PROTOINFO_TCP_FLAGS_REPLY, &f, sizeof(f));
+      _msg.close(p);
+      _msg.close(n);
+    }
+    _msg.end();
+    return talk(_seq, _seq);
+  }
+
+  /// drop all entries with (mark & mask) == mark, as one pass over the table
+  bool remove(uint32_t mark, uint32_t mask = 0xFFFFFFFF) {
+    ct(IPCTNL_MSG_CT_DELETE, 0);
+    _msg.put32(CTA_MARK, mark);
+    _msg.put32(CTA_MARK_MASK, mask);
+    _msg.end();
+    return talk(_seq, _seq);
+  }
+  /// drop all our entries
+  bool clear() { return remove(Tag, Tag); }
+
+  /**
+   * Next of our entries gone from the kernel, false when there are no more
+   * for now. See lost() after.
+   */
+  bool destroyed(Tuple &orig, uint32_t &mark) {
+    for (;;) {
+      if (!_rh || !NLMSG_OK(_rh, (unsigned)_rlen)) {
+        _rlen = ::recv(_ev, _rbuf, sizeof(_rbuf), MSG_DONTWAIT);
+        if (_rlen < 0) {
+          _rlen = 0;
+          _rh = 0;
+          if (errno != ENOBUFS) return false;
+          _lost = true;
+          continue;
+        }
+        _rh = (const nlmsghdr *)_rbuf;
+        continue;
+      }
+      const nlmsghdr *h = _rh;
+      _rh = NLMSG_NEXT(_rh, _rlen);
+      if (h->nlmsg_type != ((NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE))
+        continue;
+      bool found = false;
+      mark = 0;
+      int len = h->nlmsg_len - NLMSG_SPACE(sizeof(nfgenmsg));
+      for (const nlattr *a = (const nlattr *)((const char *)NLMSG_DATA(h) + NLMSG_ALIGN(sizeof(nfgenmsg)));
+           len >= NLA_HDRLEN;
+           len-= NLA_ALIGN(a->nla_len), a = (const nlattr *)((const char *)a + NLA_ALIGN(a->nla_len))) {
+        if (a->nla_len < NLA_HDRLEN) break;
+        if ((a->nla_type & NLA_TYPE_MASK) == CTA_TUPLE_ORIG) {
+          memset(&orig, 0, sizeof(orig));
+          parseTuple(a, orig);
+          found = true;
+        }
+        else if ((a->nla_type & NLA_TYPE_MASK) == CTA_MARK) {
+          memcpy(&mark, (const char *)a + NLA_HDRLEN, sizeof(mark));
+          mark = ntohl(mark);
+        }
+      }
+      if (found && (mark & Tag))
+        return true;
+    }
+  }
+  /// some events were lost since the last call, what we know is stale
+  bool lost() {
+    bool l = _lost;
+    _lost = false;
+    return l;
+  }
+};
+
+#endif // INCLUDED_NFOFFLOAD_HH
@@ -0,0 +1,91 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: overload control */
+#ifndef INCLUDED_OVERLOAD_HH
+#define INCLUDED_OVERLOAD_HH
+
+#include <stdint.h>
+#include "log.hh"
+
+/**
+ * Decides what to give up when the loop cannot keep up, so that it is not
+ * left to whichever socket buffer overflows first. The signs are the loop
+ * lag (how long a pass over a burst took) and an injection queue that is
+ * full, so that we would stop reading. Then we first refuse new flows, and
+ * only if that did not help for a whole interval, drop a growing share of
+ * the packets of established flows, up to a half. Each interval without
+ * the signs (lag under half the limit and the queue at most half full)
+ * takes back one step.
+ */
+class Overload {
+public:
+  static const unsigned Scale = 256;    // of shed()
+  static const unsigned Step = Scale / 16;
+  static const unsigned MaxLevel = 9;   // 1 for new flows, then a Step each
+protected:
+  unsigned _limit;    // in us of lag, 0 = never overloaded
+  unsigned _interval; // in us
+  unsigned _level;
+  int      _state;    // 1 over, -1 under, 0 in between
+  uint64_t _since;    // of _state or the last change of _level
+  unsigned _episodes; // times we started shedding
+public:
+  Overload() : _limit(0), _interval(100000), _level(0), _state(0), _since(0),
+               _episodes(0) {}
+
+  void configure(unsigned limit, unsigned interval) {
+    _limit = limit;
+    _interval = interval ? interval : 1;
+    _level = 0;
+  }
+  bool enabled() const { return _limit; }
+
+  /// once per loop, in us: now, lag of the last pass, and the queue state
+  void update(uint64_t now, unsigned lag, unsigned size, unsigned maxsize, bool full) {
+    if (!_limit) return;
+    int state = ((lag >= _limit) || full) ? 1
+              : ((2 * lag < _limit) && (2 * size <= maxsize)) ? -1 : 0;
+    if (state != _state) {
+      _state = state;
+      _since = now;
+    }
+    if ((state > 0) && !_level) {
+      _level = 1;
+      _since = now;
+      ++_episodes;
+      DBG("Overload: lag %u us, queue %u/%u\n", lag, size, maxsize);
+    } else if (state && _level && (now - _since >= _interval)) {
+      _since = now;
+      if (state > 0) {
+        if (_level < MaxLevel) ++_level;
+      } else if (!--_level) {
+        DBG("Overload over\n");
+      }
+    }
+  }
+
+  /// should new flows be refused?
+  bool shedFlows() const { return _level > 0; }
+  /// share of the packets of established flows to drop, out of Scale
+  unsigned shed() const { return _level > 1 ? (_level - 1) * Step : 0; }
+  unsigned level() const { return _level; }
+  unsigned episodes() const { return _episodes; }
+};
+
+#endif // INCLUDED_OVERLOAD_HH
@@ -0,0 +1,151 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: a helper thread for the rare, slow work */
+#ifndef INCLUDED_SLOWPATH_HH
+#define INCLUDED_SLOWPATH_HH
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/**
+ * Like Queue, but for one thread to push and another to pop, without locks.
+ * Each index is only written by its side, and published after the entry.
+ */
+template <typename T>
+class Ring {
+protected:
+  unsigned Num;
+  T *_buf;
+  volatile unsigned _head; // written by the consumer
+  volatile unsigned _tail; // written by the producer
+public:
+  Ring(unsigned size) : Num(size+1), _buf(new T[Num]), _head(0), _tail(0) {}
+  ~Ring() { delete [] _buf; }
+  // consumer side
+  T &head() { assert(!empty()); __sync_synchronize(); return _buf[_head]; }
+  bool empty() const { return _tail == _head; }
+  void popHead() { __sync_synchronize(); _head = (_head + 1) % Num; }
+  // producer side
+  T &tail() { assert(!full()); return _buf[_tail]; }
+  bool full() const { return (_tail + 1) % Num == _head; }
+  void pushTail() { __sync_synchronize(); _tail = (_tail + 1) % Num; }
+};
+
+/**
+ * An eventfd to wake up the other thread, from select() or wait().
+ */
+class Signal {
+  int _fd;
+public:
+  Signal() : _fd(-1) {}
+  ~Signal() { close(); }
+  bool open() {
+    close();
+    _fd = eventfd(0, EFD_NONBLOCK);
+    return _fd >= 0;
+  }
+  void close() {
+    if (_fd >= 0) ::close(_fd);
+    _fd = -1;
+  }
+  int fd() const { return _fd; }
+  void raise() {
+    uint64_t one = 1;
+    if (write(_fd, &one, sizeof(one)) < 0) {} // only fails if already raised
+  }
+  /// to be called once woken up
+  void clear() {
+    uint64_t n;
+    if (read(_fd, &n, sizeof(n)) < 0) {}
+  }
+  /// until raised or timeout ms have passed
+  void wait(int timeout) {
+    pollfd p = { _fd, POLLIN, 0 };
+    if (poll(&p, 1, timeout) > 0) clear();
+  }
+};
+
+/**
+ * A thread that runs a function until asked to stop. The function should
+ * check stopping() whenever it wakes up from wait().
+ */
+class SlowPath {
+  pthread_t _tid;
+  bool      _running;
+  volatile bool _stop; // set by the owner
+  volatile bool _done; // set by the thread
+  Signal    _kick;     // wakes up the thread
+  Signal    _back;     // wakes up the owner
+  void      *(*_fn)(void *);
+  void      *_arg;
+
+  static void *main(void *self) {
+    SlowPath *s = (SlowPath *)self;
+    s->_fn(s->_arg);
+    __sync_synchronize();
+    s->_done = true;
+    s->_back.raise();
+    return 0;
+  }
+public:
+  SlowPath() : _running(false), _stop(false), _done(false) {}
+  ~SlowPath() { stop(); join(); }
+
+  bool start(void *(*fn)(void *), void *arg) {
+    if (_running) return true;
+    if (!_kick.open() || !_back.open()) return false;
+    _fn = fn;
+    _arg = arg;
+    _stop = _done = false;
+    if ((errno = pthread_create(&_tid, 0, main, this))) return false;
+    _running = true;
+    return true;
+  }
+  /// ask it to stop, see done() and join()
+  void stop() {
+    if (!_running) return;
+    _stop = true;
+    _kick.raise();
+  }
+  void join() {
+    if (!_running) return;
+    pthread_join(_tid, 0);
+    _running = false;
+    _kick.close();
+    _back.close();
+  }
+  bool running() const { return _running; }
+  bool stopping() const { return _stop; }
+  bool done() const { return _done; }
+
+  /// the owner wakes up the thread, which waits for it
+  void kick() { _kick.raise(); }
+  void wait(int timeout) { _kick.wait(timeout); }
+  /// the thread wakes up the owner, which selects on fd()
+  void wake() { _back.raise(); }
+  int fd() const { return _back.fd(); }
+  void woken() { _back.clear(); }
+};
+
+#endif // INCLUDED_SLOWPATH_HH
@@ -32,6 +32,7 @@
 #include <netinet/if_ether.h> // for ETHERTYPE_
 #include <netinet/in.h> // for htons
 #include <netpacket/packet.h> // for sockaddr_ll
+#include <sys/uio.h> // for iovec
 
 #include <linux/filter.h> // for BPF_XX and sock_fprog
 
@@ -61,6 +62,21 @@
  * </RANT>
  */
 
+// NOTE: <linux/if_packet.h> clashes with <netpacket/packet.h>
+struct auxdata {
+  uint32_t tp_status;
+  uint32_t tp_len;      // before truncation
+  uint32_t tp_snaplen;
+  uint16_t tp_mac;
+  uint16_t tp_net;
+  uint16_t tp_vlan_tci;
+  uint16_t tp_vlan_tpid;
+};
+
+#ifndef TP_STATUS_CSUMNOTREADY
+#define TP_STATUS_CSUMNOTREADY (1 << 3)
+#endif
+
 class BaseSocket {
 protected:
   int _fd;
@@ -68,14 +84,88 @@ public:
   int  fd() const { return _fd; }
   bool ok() const { return _fd >= 0; }
   void close() { if (ok()) ::close(_fd); _fd = -1; }
+  /// cap the bytes the kernel holds for us on the way out
+  bool setSndBuf(int bytes) {
+    return ::setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) == 0;
+  }
+  /// tag what we send with mark (needs CAP_NET_ADMIN)
+  bool setMark(int mark) {
+    return ::setsockopt(_fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == 0;
+  }
+  /// let the kernel spin on the device queue for up to us in recv and select
+  bool setBusyPoll(int us) {
+#ifdef SO_BUSY_POLL
+    return ::setsockopt(_fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == 0;
+#else
+    (void)us;
+    errno = ENOPROTOOPT;
+    return false;
+#endif
+  }
 };
 
 /**
  * (AF_PACKET, SOCK_DGRAM) socket for capturing all IP packets.
+ *
+ * If the NIC does GRO (or the packet comes from a local veth with offloads)
+ * we get TCP packets bigger than the MTU, possibly with the checksum not
+ * filled in yet. With setAuxData() we learn about the checksum, and whatever
+ * doesn't fit in the Buffer spills over into a GSOBuffer.
  */
 class PacketSocket : public BaseSocket {
+protected:
+  GSOBuffer *_big;    // not owned, set by setAuxData()
+  bool      _spilled; // last packet is in _big
+  uint32_t  _status;  // TP_STATUS_XX of the last packet
+  sockaddr_ll _from;  // of the last packet
+  int       _ifindex;
+
+  /// return length, 0 on try again, -1 on fail
+  int receive(Buffer &b, sockaddr_ll &sll) {
+    b.clear();
+    _spilled = false;
+    _status = 0;
+    unsigned room = b.room() - 1;
+    iovec iov[2] = { { b.data(), room }, { 0, 0 } };
+    if (_big) { // NOTE: the caller must be done with it
+      _big->reset();
+      iov[1].iov_base = _big->data() + room;
+      iov[1].iov_len = _big->room() - 1 - room;
+    }
+    char control[CMSG_SPACE(sizeof(auxdata))];
+    msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sll;
+    msg.msg_namelen = sizeof(sll);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = _big ? 2 : 1;
+    if (_big) {
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+    }
+    int len = ::recvmsg(_fd, &msg, MSG_TRUNC);
+    if (len < 0)
+      return (errno == EAGAIN) ? 0 : -1;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if ((c->cmsg_level == SOL_PACKET) && (c->cmsg_type == PACKET_AUXDATA))
+        _status = ((const auxdata *)CMSG_DATA(c))->tp_status;
+    }
+    if ((unsigned)len <= room) {
+      b.put(len);
+    } else if (_big && (len < (int)_big->room())) {
+      ::memcpy(_big->data(), b.data(), room);
+      _big->put(len);
+      _spilled = true;
+    } else {
+      DBG("Dropped truncated packet of %d bytes\n", len);
+      return 0;
+    }
+    return len;
+  }
+
 public:
-  PacketSocket() {
+  PacketSocket() : _big(0), _spilled(false), _status(0), _ifindex(0) {
+    ::memset(&_from, 0, sizeof(_from));
     // FIXME: change to SOCK_RAW if we need the Ethernet header
     _fd = ::socket(AF_PACKET, SOCK_DGRAM | O_NONBLOCK, htons(ETHERTYPE_IP));
   }
@@ -94,6 +184,7 @@ public:
 
     if(::bind(_fd, (sockaddr *)&sa, sizeof(sa)))
       return false;
+    _ifindex = ifr.ifr_ifindex;
     if(promisc) { // is this even necessary?
       if (ioctl(_fd, SIOCGIFFLAGS, &ifr) != 0) return false;
       ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC;
@@ -102,32 +193,58 @@ public:
     return true;
   }
 
+  /// ask for PACKET_AUXDATA with every packet, big takes the packets that
+  /// don't fit in a Buffer
+  bool setAuxData(GSOBuffer *big) {
+    int val = 1;
+    if (::setsockopt(_fd, SOL_PACKET, PACKET_AUXDATA, &val, sizeof(val)) != 0)
+      return false;
+    _big = big;
+    return true;
+  }
+
+  bool auxData() const { return _big != 0; }
+  /// the checksum of the last packet was left to the NIC
+  bool csumNotReady() const { return (_status & TP_STATUS_CSUMNOTREADY) != 0; }
+  /// the last packet did not fit, it is in the GSOBuffer
+  bool spilled() const { return _spilled; }
+  /// the MAC address the last packet came from
+  const uint8_t *source() const { return _from.sll_addr; }
+
   /// return 0 on try again, -1 on fail
   int recv(Buffer &b) {
-    b.clear();
-    sockaddr_ll sll;
-    socklen_t slen = sizeof(sll);
-    int len = ::recvfrom(_fd, b.data(), b.room(), MSG_TRUNC, (sockaddr *)&sll, &slen);
-    if (len > 0) {
-      if(sll.sll_pkttype != PACKET_OUTGOING) {
-        b.put(len);
-        return len;
-      }
+    int len = receive(b, _from);
+    if ((len > 0) && (_from.sll_pkttype == PACKET_OUTGOING))
       return 0;
-    }
-    return ((len < 0) && (errno == EAGAIN)) ? 0 : -1;
+    return len;
   }
 
-#if 0
-  int send(const Buffer &b, uint8_t *ethaddr) {
-    sockaddr_ll sa;
+  /// where to send to reach ethaddr on the bound interface
+  void address(sockaddr_ll &sa, const uint8_t *ethaddr) const {
+    ::memset(&sa, 0, sizeof(sa));
     sa.sll_family = AF_PACKET;
     sa.sll_protocol = htons(ETHERTYPE_IP);
+    sa.sll_ifindex = _ifindex;
     sa.sll_halen = ETHER_ADDR_LEN;
     ::memcpy(sa.sll_addr, ethaddr, ETHER_ADDR_LEN);
-    return ::sendto(_fd, b.data(), b.size(), 0, (sockaddr *)&sa, sizeof(sa));
   }
-#endif
+
+  /// send b as an Ethernet frame to ethaddr on the bound interface,
+  /// return 0 on try again, -1 on fail
+  int send(const Buffer &b, const uint8_t *ethaddr) {
+    const iphdr *ip = (const iphdr *)b.data();
+    unsigned tot_len = ntohs(ip->tot_len);
+    if (tot_len > b.size())
+      return 1; // packet ignored, same as IPSocket
+    sockaddr_ll sa;
+    address(sa, ethaddr);
+    int len = ::sendto(_fd, b.data(), tot_len, 0, (sockaddr *)&sa, sizeof(sa));
+    if (len > 0)
+      return len;
+    if ((len < 0) && (errno == ENOBUFS))
+      return tot_len; // dropped by the qdisc, as if lost on the air
+    return ((len < 0) && (errno == EAGAIN)) ? 0 : -1;
+  }
 };
 
 /**
@@ -314,7 +431,9 @@ public:
   }
   bool canRead(int fd) const  { return FD_ISSET(fd, &_fds_read); }
   bool canWrite(int fd) const { return FD_ISSET(fd, &_fds_write); }
-  int select() { return ::select(_nfds, &_fds_read, &_fds_write, NULL, NULL); }
+  int select(timeval *timeout = NULL) {
+    return ::select(_nfds, &_fds_read, &_fds_write, NULL, timeout);
+  }
 };
 
 #endif // INCLUDED_SOCKET_HH
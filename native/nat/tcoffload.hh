@@ -0,0 +1,431 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: TC fast path for established flows */
+#ifndef INCLUDED_TCOFFLOAD_HH
+#define INCLUDED_TCOFFLOAD_HH
+
+#include <stddef.h> // for offsetof
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <net/if_arp.h> // for ARPHRD_XX
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h> // for TC_ACT_XX
+
+#include "ifctl.hh"
+#include "bpf.hh"
+
+/**
+ * Kernel fast path for established flows. A TC program on the ingress of
+ * each interface looks the packet up in a hash map of the mappings, rewrites
+ * the address and port (and the checksums) in place and hands it straight
+ * to the other interface. Whatever has no entry or is not plain enough (SYN,
+ * FIN and RST, fragments, ICMP, IP options, too big for the way out) goes on
+ * to the capture sockets and the Rewriter as before. Entries count what
+ * they forwarded, so that the Rewriter can tell which mappings are in use.
+ *
+ * The LAN side rewrites the source, the WAN side the destination. For a full
+ * cone the other end of the flow is left out of the key (zero).
+ *
+ * Our capture sockets are for ETH_P_IP only, so they are never handed what
+ * was redirected. Packets that went to them before an entry was added are
+ * simply translated a bit later than the ones after it.
+ *
+ * NOTE: the programs are attached with tcx, Linux 6.6 or later.
+ */
+class TcOffload {
+public:
+  enum { LAN = 0, WAN = 1 };
+  static const unsigned MaxEntries = 16384; // per side
+  static const unsigned MinLen = 34; // IP header and TCP flags
+  static const int TcxIngress = 46; // BPF_TCX_INGRESS, not in older headers
+
+  /// flow as it arrives, all in network order
+  struct Key {
+    in_addr_t saddr;
+    in_addr_t daddr;
+    uint16_t  sport;
+    uint16_t  dport;
+    uint8_t   protocol;
+    uint8_t   pad[3];
+  };
+  /// what the address and port of the Key become, and what was forwarded
+  struct Value {
+    in_addr_t addr;
+    uint16_t  port;
+    uint16_t  pad;
+    uint64_t  packets;
+    uint64_t  bytes;
+  };
+  /// fast path of a mapping
+  struct State {
+    bool     on[2];   // has an entry, per side
+    bool     refused; // an add failed, e.g. the map is full, until cleared
+    uint64_t packets; // forwarded by both, at the last look
+    State() : refused(false), packets(0) { on[0] = on[1] = false; }
+  };
+
+protected:
+  /// eBPF assembler for the program of one side
+  class Program {
+    enum { CTX = 6, DATA = 7, OLDADDR = 8, OLDPORT = 9 };
+    static const unsigned MaxLen = 128;
+    bpf_insn _insns[MaxLen];
+    int      _target[MaxLen]; // label of a jump to be resolved, 0 if none
+    unsigned _len;
+    bool     _ok;
+  public:
+    enum { PASS = 1, SHOT, KEY, TCP, LOOKUP, NUM }; // labels
+
+  private:
+    unsigned _label[NUM];
+
+    void add(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+      if (_len >= MaxLen) { _ok = false; return; }
+      _target[_len] = 0;
+      bpf_insn &i = _insns[_len++];
+      i.code = code; i.dst_reg = dst; i.src_reg = src; i.off = off; i.imm = imm;
+    }
+    void jump(uint8_t code, uint8_t dst, int32_t imm, int label) {
+      add(code, dst, 0, 0, imm);
+      if (_ok) _target[_len - 1] = label;
+    }
+    void label(int l) { _label[l] = _len; }
+    void mov(uint8_t dst, int32_t imm) { add(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm); }
+    void ldx(uint8_t size, uint8_t dst, uint8_t src, int16_t off) {
+      add(BPF_LDX | size | BPF_MEM, dst, src, off, 0);
+    }
+    void stx(uint8_t size, uint8_t dst, int16_t off, uint8_t src) {
+      add(BPF_STX | size | BPF_MEM, dst, src, off, 0);
+    }
+    void call(int helper) { add(BPF_JMP | BPF_CALL, 0, 0, 0, helper); }
+    /// skb_store_bytes() at off len bytes of the Value at valoff
+    void store(int off, int16_t valoff, int len) {
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 1, CTX, 0, 0);
+      mov(2, off);
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 3, DATA, 0, 0);
+      add(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, valoff);
+      mov(4, len);
+      mov(5, 0);
+      call(BPF_FUNC_skb_store_bytes);
+      jump(BPF_JMP | BPF_JSLT | BPF_K, 0, 0, SHOT);
+    }
+
+  public:
+    Program() : _len(0), _ok(true) {}
+
+    /**
+     * l2 is the length of the link header on the way in, maxlen the longest
+     * packet to take (the MTU on the way out, if it's the smaller one).
+     * LAN packets to subnet/netmask or broadcast are left alone.
+     */
+    bool compile(int side, bool cone, int map, unsigned l2, unsigned maxlen,
+                 int out_ifindex, in_addr_t subnet, in_addr_t netmask) {
+      _len = 0;
+      _ok = true;
+      const int ip = l2;
+      const int addr = ip + ((side == LAN) ? offsetof(iphdr, saddr) : offsetof(iphdr, daddr));
+      const int port = ip + sizeof(iphdr) + ((side == LAN) ? 0 : 2);
+      add(BPF_ALU64 | BPF_MOV | BPF_X, CTX, 1, 0, 0);
+      ldx(BPF_W, 2, CTX, offsetof(__sk_buff, protocol));
+      jump(BPF_JMP32 | BPF_JNE | BPF_K, 2, htons(ETH_P_IP), PASS);
+      // the headers we look at must be linear, so try to make them so
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 1, CTX, 0, 0);
+      mov(2, ip + MinLen);
+      call(BPF_FUNC_skb_pull_data);
+      ldx(BPF_W, DATA, CTX, offsetof(__sk_buff, data));
+      ldx(BPF_W, 3, CTX, offsetof(__sk_buff, data_end));
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 2, DATA, 0, 0);
+      add(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, ip + MinLen);
+      add(BPF_JMP | BPF_JGT | BPF_X, 2, 3, 0, 0);
+      _target[_len - 1] = PASS;
+      // plain IPv4, no options, not a fragment, not too big
+      ldx(BPF_B, 2, DATA, ip);
+      jump(BPF_JMP32 | BPF_JNE | BPF_K, 2, 0x45, PASS);
+      ldx(BPF_H, 2, DATA, ip + offsetof(iphdr, frag_off));
+      jump(BPF_JMP32 | BPF_JSET | BPF_K, 2, htons(IP_MF | IP_OFFMASK), PASS);
+      ldx(BPF_H, 2, DATA, ip + offsetof(iphdr, tot_len));
+      add(BPF_ALU | BPF_END | BPF_TO_BE, 2, 0, 0, 16);
+      jump(BPF_JMP32 | BPF_JLT | BPF_K, 2, MinLen, PASS);
+      jump(BPF_JMP32 | BPF_JGT | BPF_K, 2, maxlen, PASS);
+      if (side == LAN) { // like Rewriter::filtered()
+        ldx(BPF_W, 2, DATA, ip + offsetof(iphdr, daddr));
+        jump(BPF_JMP32 | BPF_JEQ | BPF_K, 2, -1, PASS);
+        add(BPF_ALU | BPF_AND | BPF_K, 2, 0, 0, netmask);
+        jump(BPF_JMP32 | BPF_JEQ | BPF_K, 2, subnet, PASS);
+      }
+      // where the checksum of the ports is, and how to update it
+      ldx(BPF_B, 2, DATA, ip + offsetof(iphdr, protocol));
+      jump(BPF_JMP32 | BPF_JEQ | BPF_K, 2, IPPROTO_TCP, TCP);
+      jump(BPF_JMP32 | BPF_JNE | BPF_K, 2, IPPROTO_UDP, PASS);
+      mov(3, ip + sizeof(iphdr) + 6);
+      mov(4, BPF_F_MARK_MANGLED_0); // 0 is no checksum
+      jump(BPF_JMP | BPF_JA, 0, 0, KEY);
+      label(TCP);
+      ldx(BPF_B, 3, DATA, ip + sizeof(iphdr) + 13);
+      jump(BPF_JMP32 | BPF_JSET | BPF_K, 3, TH_FIN | TH_SYN | TH_RST, PASS);
+      mov(3, ip + sizeof(iphdr) + 16);
+      mov(4, 0);
+      label(KEY);
+      stx(BPF_DW, 10, -24, 3);
+      stx(BPF_DW, 10, -32, 4);
+      // the key at r10 - 16, see Key
+      add(BPF_ST | BPF_DW | BPF_MEM, 10, 0, -16, 0);
+      add(BPF_ST | BPF_DW | BPF_MEM, 10, 0, -8, 0);
+      ldx(BPF_W, OLDADDR, DATA, addr);
+      ldx(BPF_H, OLDPORT, DATA, port);
+      if ((side == LAN) || !cone) {
+        ldx(BPF_W, 3, DATA, ip + offsetof(iphdr, saddr));
+        stx(BPF_W, 10, (int)offsetof(Key, saddr) - 16, 3);
+        ldx(BPF_H, 3, DATA, ip + sizeof(iphdr));
+        stx(BPF_H, 10, (int)offsetof(Key, sport) - 16, 3);
+      }
+      if ((side == WAN) || !cone) {
+        ldx(BPF_W, 3, DATA, ip + offsetof(iphdr, daddr));
+        stx(BPF_W, 10, (int)offsetof(Key, daddr) - 16, 3);
+        ldx(BPF_H, 3, DATA, ip + sizeof(iphdr) + 2);
+        stx(BPF_H, 10, (int)offsetof(Key, dport) - 16, 3);
+      }
+      stx(BPF_B, 10, (int)offsetof(Key, protocol) - 16, 2);
+      add(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map);
+      add(0, 0, 0, 0, 0); // second half of the 64-bit immediate
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0);
+      add(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -16);
+      call(BPF_FUNC_map_lookup_elem);
+      jump(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, PASS);
+      // from here on DATA is the Value, the packet is only touched by helpers
+      add(BPF_ALU64 | BPF_MOV | BPF_X, DATA, 0, 0, 0);
+      mov(1, 1);
+      add(BPF_STX | BPF_DW | BPF_ATOMIC, DATA, 1, offsetof(Value, packets), BPF_ADD);
+      ldx(BPF_W, 1, CTX, offsetof(__sk_buff, len));
+      add(BPF_STX | BPF_DW | BPF_ATOMIC, DATA, 1, offsetof(Value, bytes), BPF_ADD);
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 1, CTX, 0, 0);
+      mov(2, ip + offsetof(iphdr, check));
+      add(BPF_ALU64 | BPF_MOV | BPF_X, 3, OLDADDR, 0, 0);
+      ldx(BPF_W, 4, DATA, offsetof(Value, addr));
+      mov(5, 4);
+      call(BPF_FUNC_l3_csum_replace);
+      jump(BPF_JMP | BPF_JSLT | BPF_K, 0, 0, SHOT);
+      // l4 checksum offset and flags were saved on the stack
+      for (int i = 0; i < 2; ++i) {
+        bool isaddr = (i == 0);
+        add(BPF_ALU64 | BPF_MOV | BPF_X, 1, CTX, 0, 0);
+        ldx(BPF_DW, 2, 10, -24);
+        add(BPF_ALU64 | BPF_MOV | BPF_X, 3, isaddr ? OLDADDR : OLDPORT, 0, 0);
+        ldx(isaddr ? BPF_W : BPF_H, 4, DATA, isaddr ? offsetof(Value, addr) : offsetof(Value, port));
+        ldx(BPF_DW, 5, 10, -32);
+        add(BPF_ALU64 | BPF_OR | BPF_K, 5, 0, 0, isaddr ? (BPF_F_PSEUDO_HDR | 4) : 2);
+        call(BPF_FUNC_l4_csum_replace);
+        jump(BPF_JMP | BPF_JSLT | BPF_K, 0, 0, SHOT);
+      }
+      store(addr, offsetof(Value, addr), 4);
+      store(port, offsetof(Value, port), 2);
+      if (!l2) { // the neighbour needs room for the link header it fills in
+        add(BPF_ALU64 | BPF_MOV | BPF_X, 1, CTX, 0, 0);
+        mov(2, ETH_HLEN);
+        mov(3, 0);
+        call(BPF_FUNC_skb_change_head);
+        jump(BPF_JMP | BPF_JNE | BPF_K, 0, 0, SHOT);
+      }
+      mov(1, out_ifindex);
+      mov(2, 0);
+      mov(3, 0);
+      mov(4, 0);
+      call(BPF_FUNC_redirect_neigh);
+      add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+      label(PASS);
+      mov(0, TC_ACT_UNSPEC); // on to the stack, and our capture sockets
+      add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+      label(SHOT);
+      mov(0, TC_ACT_SHOT);
+      add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+      if (!_ok) return false;
+
+      for (unsigned i = 0; i < _len; ++i) {
+        if (!_target[i]) continue;
+        unsigned to = _label[_target[i]];
+        if ((to <= i) || (to - i - 1 > 0x7FFF)) return _ok = false;
+        _insns[i].off = to - i - 1;
+      }
+      return true;
+    }
+
+    /// return program fd or -1
+    int load() const {
+      if (!_ok) return -1;
+      bpf_attr attr;
+      ::memset(&attr, 0, sizeof(attr));
+      attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+      attr.insn_cnt = _len;
+      attr.insns = (uintptr_t)_insns;
+      attr.license = (uintptr_t)"GPL";
+      int fd = sys_bpf(BPF_PROG_LOAD, attr);
+      if (fd < 0) { // once more for the verifier log
+        int err = errno;
+        static char log[0x10000];
+        attr.log_buf = (uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        log[0] = '\0';
+        sys_bpf(BPF_PROG_LOAD, attr);
+        DBG("TC program rejected: %s\n%s\n", strerror(err), log);
+        errno = err;
+      }
+      return fd;
+    }
+  };
+
+  int      _map[2];
+  int      _link[2]; // keep the programs attached
+  // what the programs are compiled for, see open()
+  int       _index[2];
+  unsigned  _l2[2];
+  bool      _cone;
+  in_addr_t _subnet, _netmask;
+
+  static unsigned maxlen(int mtu, int other) { return (mtu > other) ? other : 0xFFFF; }
+
+  /// compile the program of side for packets up to maxlen, and attach it,
+  /// or put it in place of the one attached; return false on failure
+  bool attach(int side, unsigned maxlen) {
+    Program p;
+    int prog = p.compile(side, _cone, _map[side], _l2[side], maxlen, _index[!side],
+                         _subnet, _netmask) ? p.load() : -1;
+    if (prog < 0)
+      return false;
+    bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    bool ok;
+    if (_link[side] < 0) {
+      attr.link_create.prog_fd = prog;
+      attr.link_create.target_ifindex = _index[side];
+      attr.link_create.attach_type = TcxIngress;
+      ok = ((_link[side] = sys_bpf(BPF_LINK_CREATE, attr)) >= 0);
+    } else {
+      attr.link_update.link_fd = _link[side];
+      attr.link_update.new_prog_fd = prog;
+      ok = (sys_bpf(BPF_LINK_UPDATE, attr) == 0);
+    }
+    int err = errno;
+    ::close(prog); // the link holds on to it
+    errno = err;
+    return ok;
+  }
+
+  bool elem(int cmd, int side, const Key &k, Value *v, uint64_t flags) {
+    bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _map[side];
+    attr.key = (uintptr_t)&k;
+    attr.value = (uintptr_t)v;
+    attr.flags = flags;
+    return sys_bpf(cmd, attr) == 0;
+  }
+
+public:
+  TcOffload() { _map[0] = _map[1] = _link[0] = _link[1] = -1; }
+  ~TcOffload() { close(); }
+
+  void close() {
+    for (int i = 0; i < 2; ++i) {
+      if (_link[i] >= 0) ::close(_link[i]); // detaches the program
+      if (_map[i] >= 0) ::close(_map[i]);
+      _link[i] = _map[i] = -1;
+    }
+  }
+
+  bool ok() const { return _link[LAN] >= 0 && _link[WAN] >= 0; }
+
+  /// attach the programs to lanif and wanif, return false if not supported
+  bool open(const char *lanif, const char *wanif, in_addr_t subnet,
+            in_addr_t netmask, bool cone) {
+    close();
+    const char *ifname[2] = { lanif, wanif };
+    int mtu[2];
+    for (int i = 0; i < 2; ++i) {
+      IfCtl ic(ifname[i]);
+      _index[i] = ic.getIndex();
+      mtu[i] = ic.getMTU();
+      int type = ic.getHwType();
+      if ((_index[i] <= 0) || (mtu[i] <= 0) || (type < 0))
+        return false;
+      _l2[i] = (type == ARPHRD_ETHER) ? ETH_HLEN : 0;
+    }
+    _cone = cone;
+    _subnet = subnet;
+    _netmask = netmask;
+    for (int i = 0; i < 2; ++i) {
+      bpf_attr attr;
+      ::memset(&attr, 0, sizeof(attr));
+      attr.map_type = BPF_MAP_TYPE_HASH;
+      attr.key_size = sizeof(Key);
+      attr.value_size = sizeof(Value);
+      attr.max_entries = MaxEntries;
+      if (((_map[i] = sys_bpf(BPF_MAP_CREATE, attr)) < 0) ||
+          !attach(i, maxlen(mtu[i], mtu[1 - i])))
+        break;
+    }
+    if (!ok()) {
+      int err = errno;
+      close();
+      errno = err;
+      return false;
+    }
+    return true;
+  }
+
+  /// the MTUs changed, so that only what fits goes out; false on failure
+  bool setMtu(int lan_mtu, int wan_mtu) {
+    if (!ok() || (lan_mtu <= 0) || (wan_mtu <= 0))
+      return false;
+    return attach(LAN, maxlen(lan_mtu, wan_mtu)) && attach(WAN, maxlen(wan_mtu, lan_mtu));
+  }
+
+  /// false if the map is full
+  bool add(int side, const Key &k, in_addr_t addr, uint16_t port) {
+    Value v;
+    ::memset(&v, 0, sizeof(v));
+    v.addr = addr;
+    v.port = port;
+    return elem(BPF_MAP_UPDATE_ELEM, side, k, &v, BPF_ANY);
+  }
+  void remove(int side, const Key &k) {
+    elem(BPF_MAP_DELETE_ELEM, side, k, 0, 0);
+  }
+  /// packets forwarded by the entry, 0 if there is none
+  uint64_t packets(int side, const Key &k) {
+    Value v;
+    return elem(BPF_MAP_LOOKUP_ELEM, side, k, &v, 0) ? v.packets : 0;
+  }
+
+  /// remove all entries
+  void clear() {
+    for (int i = 0; i < 2; ++i) {
+      Key k;
+      bpf_attr attr;
+      ::memset(&attr, 0, sizeof(attr));
+      attr.map_fd = _map[i];
+      attr.key = 0; // first
+      attr.next_key = (uintptr_t)&k;
+      while ((_map[i] >= 0) && (sys_bpf(BPF_MAP_GET_NEXT_KEY, attr) == 0))
+        remove(i, k);
+    }
+  }
+};
+
+#endif // INCLUDED_TCOFFLOAD_HH
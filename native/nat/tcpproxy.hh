@@ -0,0 +1,326 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: transparent TCP proxy */
+#ifndef INCLUDED_TCPPROXY_HH
+#define INCLUDED_TCPPROXY_HH
+
+#include <net/if_arp.h> // for arpreq
+#include <netinet/tcp.h> // for TCP_CONGESTION
+
+#include "socket.hh"
+#include "filtersocket.hh"
+
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80 // from <linux/netfilter_ipv4.h>
+#endif
+#ifndef TCP_CONGESTION
+#define TCP_CONGESTION 13
+#endif
+
+/**
+ * Terminates the TCP connections of LAN clients and opens new ones to where
+ * they were going. The client gets its ACKs at LAN latency, and losses on the
+ * WAN are recovered from here, by a congestion control of our choice with
+ * buffers sized for the WAN, rather than by the client across the whole path.
+ *
+ * The connections are diverted to us by the kernel, either by an iptables
+ * REDIRECT (we ask conntrack where they were going) or by a TPROXY (they
+ * were going to the address they arrived on). In each direction the data
+ * moves through a pipe with splice(), so it never comes up to user space.
+ *
+ * The upstream connection is opened only after the client's is accepted, so
+ * if it fails, the client sees a reset rather than a refused connection.
+ *
+ * NOTE: what we relay leaves from our own sockets, so it is not queued,
+ * capped, counted against the mapping quotas or shed like what the Rewriter
+ * forwards.
+ */
+class TcpProxy : public BaseSocket {
+public:
+  static const unsigned MaxConns = 128; // 6 fds each, select() takes 1024
+  static const unsigned Chunk = 65536;  // per splice()
+  enum { LAN = 0, WAN = 1 };
+protected:
+  struct Half { // from fd[d] to fd[!d] through the pipe
+    int      pipe[2];
+    unsigned len;  // in the pipe
+    bool     full; // the pipe took no more, wait until it drains
+    bool     eof;  // nothing more from fd[d]
+    bool     shut; // passed the eof on to fd[!d]
+  };
+  struct Conn {
+    int  fd[2];
+    Half half[2];
+    bool connecting; // to the WAN
+  };
+
+  const FilterSocket &_ins; // for the subnet and the MAC filter
+  in_addr_t _addr;     // where we listen
+  char      _ifname[IFNAMSIZ]; // LAN, for the ARP lookup
+  char      _cc[16];   // congestion control upstream, empty for default
+  int       _buf;      // SO_SNDBUF and SO_RCVBUF upstream, 0 for default
+  int       _idle;     // in seconds, before we check the peers are still there
+  Conn      _conns[MaxConns];
+  unsigned  _num;
+  unsigned  _accepted, _refused;
+
+  /// close with a RST rather than a FIN
+  static void abort(int fd) {
+    linger l = { 1, 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    ::close(fd);
+  }
+
+  /// so that the connections of vanished peers do not pile up
+  void keepalive(int fd) const {
+    int one = 1, intvl = 10, cnt = 3;
+    ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &_idle, sizeof(_idle));
+    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+  }
+
+  /// is the client on our LAN, and let through by the MAC filter?
+  bool allowed(in_addr_t addr) const {
+    static const uint8_t none[6] = { 0 };
+    if (!_ins.local(addr))
+      return false;
+    arpreq r;
+    memset(&r, 0, sizeof(r));
+    sockaddr_in *sin = (sockaddr_in *)&r.arp_pa;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = addr;
+    memcpy(r.arp_dev, _ifname, sizeof(r.arp_dev)); // both IFNAMSIZ
+    bool known = (::ioctl(_fd, SIOCGARP, &r) == 0) && (r.arp_flags & ATF_COM);
+    return _ins.allowed(known ? (const uint8_t *)r.arp_ha.sa_data : none);
+  }
+
+  /// open the upstream end of c, return false on failure
+  bool connect(Conn &c, const sockaddr_in &dst) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+      return false;
+    c.fd[WAN] = fd;
+    if (_cc[0] && ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, _cc, strlen(_cc)))
+      DBG("TCP_CONGESTION %s: %s\n", _cc, strerror(errno));
+    if (_buf) {
+      ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &_buf, sizeof(_buf));
+      ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &_buf, sizeof(_buf));
+    }
+    keepalive(fd);
+    if ((fd >= FD_SETSIZE) ||
+        ((::connect(fd, (const sockaddr *)&dst, sizeof(dst)) < 0) && (errno != EINPROGRESS)))
+      return false;
+    c.connecting = true;
+    for (int d = 0; d < 2; ++d) {
+      Half &h = c.half[d];
+      h.len = 0;
+      h.full = h.eof = h.shut = false;
+      if (::pipe2(h.pipe, O_NONBLOCK) < 0)
+        return false;
+    }
+    return true;
+  }
+
+  /// close all of c, if reset then with a RST
+  void drop(Selector &sel, Conn &c, bool reset) {
+    for (int d = 0; d < 2; ++d) {
+      if (c.fd[d] >= 0) {
+        sel.wantRead(c.fd[d], false);
+        sel.wantWrite(c.fd[d], false);
+        if (reset) abort(c.fd[d]); else ::close(c.fd[d]);
+      }
+      for (int i = 0; i < 2; ++i)
+        if (c.half[d].pipe[i] >= 0) ::close(c.half[d].pipe[i]);
+    }
+    c = _conns[--_num];
+  }
+
+  /// where the connection on fd was going before it was diverted to us
+  virtual bool destination(int fd, sockaddr_in &dst) const {
+    socklen_t len = sizeof(dst);
+    if (::getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &dst, &len) == 0)
+      return true;
+    len = sizeof(dst);
+    return ::getsockname(fd, (sockaddr *)&dst, &len) == 0; // TPROXY
+  }
+
+  void accept(Selector &sel) {
+    sockaddr_in peer, dst;
+    socklen_t len = sizeof(peer);
+    int fd = ::accept4(_fd, (sockaddr *)&peer, &len, SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+    if (!destination(fd, dst) || (_num == MaxConns) || (fd >= FD_SETSIZE) ||
+        (dst.sin_addr.s_addr == _addr) || !allowed(peer.sin_addr.s_addr)) {
+      ++_refused;
+      abort(fd);
+      return;
+    }
+    keepalive(fd);
+    Conn &c = _conns[_num++];
+    c.fd[LAN] = fd;
+    c.fd[WAN] = -1;
+    c.half[LAN].pipe[0] = c.half[LAN].pipe[1] = -1;
+    c.half[WAN].pipe[0] = c.half[WAN].pipe[1] = -1;
+    if (!connect(c, dst)) {
+      ERR("Proxy connect: %s\n", strerror(errno));
+      ++_refused;
+      drop(sel, c, true);
+      return;
+    }
+    ++_accepted;
+    sel.newFd(c.fd[LAN]);
+    sel.newFd(c.fd[WAN]);
+  }
+
+  /// move what we can from fd[d] to fd[!d], return false on failure
+  bool relay(const Selector &sel, Conn &c, int d) {
+    Half &h = c.half[d];
+    int src = c.fd[d], dst = c.fd[!d];
+    if (!h.eof && !h.full && sel.canRead(src)) {
+      ssize_t n = ::splice(src, NULL, h.pipe[1], NULL, Chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        h.len+= n;
+      } else if (n == 0) {
+        h.eof = true;
+      } else if (errno == EAGAIN) {
+        h.full = (h.len > 0); // the socket was readable, so the pipe is
+      } else {
+        return false;
+      }
+    }
+    if (h.len) {
+      ssize_t n = ::splice(h.pipe[0], NULL, dst, NULL, h.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        h.len-= n;
+        h.full = false;
+      } else if ((n < 0) && (errno != EAGAIN)) {
+        return false;
+      }
+    }
+    if (h.eof && !h.len && !h.shut) {
+      ::shutdown(dst, SHUT_WR);
+      h.shut = true;
+    }
+    return true;
+  }
+
+  /// return false if c is finished or failed, and closed
+  bool handle(Selector &sel, Conn &c) {
+    if (c.connecting) {
+      if (!sel.canWrite(c.fd[WAN]))
+        return true;
+      int err = 0;
+      socklen_t len = sizeof(err);
+      ::getsockopt(c.fd[WAN], SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err) {
+        DBG("Proxy connect: %s\n", strerror(err));
+        drop(sel, c, true);
+        return false;
+      }
+      c.connecting = false;
+    }
+    if (!relay(sel, c, LAN) || !relay(sel, c, WAN)) {
+      drop(sel, c, true);
+      return false;
+    }
+    if (c.half[LAN].shut && c.half[WAN].shut) {
+      drop(sel, c, false);
+      return false;
+    }
+    return true;
+  }
+
+public:
+  TcpProxy(const FilterSocket &ins) : _ins(ins), _num(0), _accepted(0), _refused(0) {
+    _fd = -1;
+  }
+  virtual ~TcpProxy() { close(); }
+
+  /**
+   * Listen on addr:port of LAN ifname. The upstream connections get cc and
+   * buf, and connections idle for idle seconds are probed.
+   */
+  bool open(Selector &sel, in_addr_t addr, unsigned port, const char *ifname,
+            const char *cc, unsigned buf, unsigned idle) {
+    close();
+    _idle = idle ? idle : 1;
+    _addr = addr;
+    strncpy(_ifname, ifname, IFNAMSIZ - 1);
+    _ifname[IFNAMSIZ - 1] = '\0';
+    strncpy(_cc, cc, sizeof(_cc) - 1);
+    _cc[sizeof(_cc) - 1] = '\0';
+    _buf = buf;
+    _fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (_fd < 0)
+      return false;
+    int one = 1;
+    ::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef IP_TRANSPARENT
+    ::setsockopt(_fd, SOL_IP, IP_TRANSPARENT, &one, sizeof(one)); // for TPROXY
+#endif
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = addr;
+    sa.sin_port = htons(port);
+    if ((::bind(_fd, (sockaddr *)&sa, sizeof(sa)) < 0) || (::listen(_fd, 64) < 0)) {
+      close();
+      return false;
+    }
+    sel.newFd(_fd);
+    return true;
+  }
+
+  void close() {
+    Selector sel; // the caller's is cleared anyway
+    while (_num)
+      drop(sel, _conns[0], true);
+    BaseSocket::close();
+  }
+
+  void want(Selector &sel) const {
+    if (!ok()) return;
+    sel.wantRead(_fd, _num < MaxConns);
+    for (unsigned i = 0; i < _num; ++i) {
+      const Conn &c = _conns[i];
+      for (int d = 0; d < 2; ++d) {
+        const Half &h = c.half[d];
+        sel.wantRead(c.fd[d], !c.connecting && !h.eof && !h.full);
+        sel.wantWrite(c.fd[!d], c.connecting ? (d == LAN) : (h.len > 0));
+      }
+    }
+  }
+
+  void handle(Selector &sel) {
+    if (!ok()) return;
+    for (unsigned i = 0; i < _num; )
+      if (handle(sel, _conns[i]))
+        ++i; // otherwise the last one took its place
+    if (sel.canRead(_fd))
+      accept(sel);
+  }
+
+  unsigned size() const { return _num; }
+  unsigned accepted() const { return _accepted; }
+  unsigned refused() const { return _refused; }
+};
+
+#endif // INCLUDED_TCPPROXY_HH
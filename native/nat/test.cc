@@ -3,9 +3,18 @@
 */
 
 #include <stdio.h>
+#include <sched.h> // for unshare
+#include <sys/wait.h>
 
 #include "natopen.hh"
 #include "socket.hh"
+#include "xdpsocket.hh"
+#include "uring.hh"
+#include "fqcodel.hh"
+#include "tcpproxy.hh"
+#include "overload.hh"
+#include "tcoffload.hh"
+#include "nfoffload.hh"
 //#include "wlan.hh"
 
 #undef NDEBUG
@@ -198,6 +207,1002 @@ void test_ipflow() {
   }
 }
 
+static void make_udp(Buffer &b, const char *src, const char *dst,
+                     uint16_t sport, uint16_t dport, unsigned len) {
+  b.clear();
+  b.put(sizeof(iphdr) + sizeof(udphdr) + len);
+  iphdr *ip = (iphdr *)b.data();
+  ip->version = IPVERSION;
+  ip->ihl = 5;
+  ip->tot_len = htons(b.size());
+  ip->protocol = IPPROTO_UDP;
+  ip->saddr = inet_addr(src);
+  ip->daddr = inet_addr(dst);
+  udphdr *udp = (udphdr *)transport_header(b);
+  udp->source = htons(sport);
+  udp->dest = htons(dport);
+}
+
+/// a pure ACK, with a SACK block if sack
+static void make_ack(Buffer &b, const char *src, const char *dst,
+                     uint16_t sport, uint16_t dport, uint32_t ack, bool sack) {
+  unsigned olen = sack ? 12 : 0;
+  b.clear();
+  b.put(sizeof(iphdr) + sizeof(tcphdr) + olen);
+  memset(b.data(), 0, b.size());
+  iphdr *ip = (iphdr *)b.data();
+  ip->version = IPVERSION;
+  ip->ihl = 5;
+  ip->tot_len = htons(b.size());
+  ip->protocol = IPPROTO_TCP;
+  ip->saddr = inet_addr(src);
+  ip->daddr = inet_addr(dst);
+  tcphdr *th = (tcphdr *)transport_header(b);
+  th->source = htons(sport);
+  th->dest = htons(dport);
+  th->ack_seq = htonl(ack);
+  th->doff = (sizeof(tcphdr) + olen) >> 2;
+  th->ack = 1;
+  if (sack) {
+    uint8_t *opt = (uint8_t *)(th + 1);
+    opt[0] = opt[1] = TCPOPT_NOP;
+    opt[2] = TCPOPT_SACK;
+    opt[3] = 10;
+  }
+}
+
+void test_fragments() {
+  {
+    Rewriter::Config c;
+    c.out_addr = inet_addr("10.0.0.1");
+    c.netmask = inet_addr("255.255.255.0");
+    c.subnet = inet_addr("192.168.5.0");
+    c.numpreserved = 0;
+    c.preserved = 0;
+    c.numports = 10;
+    c.firstport = 33000;
+    c.log = false;
+
+    Rewriter rw(c);
+    Buffer first, second, b;
+    make_udp(first, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+    ((iphdr *)first.data())->id = htons(77);
+    ((iphdr *)first.data())->frag_off = htons(IP_MF);
+    // second fragment at offset 24, no ports in there
+    make_udp(second, "192.168.5.2", "8.8.8.8", 0xdead, 0xbeef, 16);
+    ((iphdr *)second.data())->id = htons(77);
+    ((iphdr *)second.data())->frag_off = htons(3);
+
+    // overtakes the first fragment, so it is held
+    assert(!rw.packetOut(second));
+    assert(!rw.nextFragment(b));
+    assert(rw.packetOut(first));
+    assert(((iphdr *)first.data())->saddr == c.out_addr);
+    uint16_t port = ((udphdr *)transport_header(first))->source;
+    assert(rw.nextFragment(b));
+    assert(((iphdr *)b.data())->saddr == c.out_addr);
+    assert(!rw.nextFragment(b));
+    // in-order fragments go through directly
+    assert(rw.packetOut(second));
+
+    // and now the reply
+    make_udp(first, "8.8.8.8", "10.0.0.1", 53, ntohs(port), 16);
+    ((iphdr *)first.data())->id = htons(99);
+    ((iphdr *)first.data())->frag_off = htons(IP_MF);
+    make_udp(second, "8.8.8.8", "10.0.0.1", 0xdead, 0xbeef, 16);
+    ((iphdr *)second.data())->id = htons(99);
+    ((iphdr *)second.data())->frag_off = htons(3);
+    assert(rw.packetIn(first));
+    assert(rw.packetIn(second));
+    assert(((iphdr *)second.data())->daddr == inet_addr("192.168.5.2"));
+  }
+}
+
+void test_icmp_error() {
+  {
+    Rewriter::Config c;
+    c.out_addr = inet_addr("10.0.0.1");
+    c.netmask = inet_addr("255.255.255.0");
+    c.subnet = inet_addr("192.168.5.0");
+    c.numpreserved = 0;
+    c.preserved = 0;
+    c.numports = 10;
+    c.firstport = 33000;
+    c.log = false;
+
+    Rewriter rw(c);
+    Buffer b;
+    make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+    assert(rw.packetOut(b));
+    // port unreachable from the far end quoting what it got
+    icmphdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = ICMP_DEST_UNREACH;
+    hdr.code = ICMP_PORT_UNREACH;
+    make_icmp(b, inet_addr("8.8.8.8"), &hdr);
+    ((iphdr *)b.data())->daddr = c.out_addr;
+    assert(!IPFlowId(b).valid());
+    assert(rw.packetIn(b));
+
+    const iphdr *ip = (const iphdr *)b.data();
+    assert(ip->daddr == inet_addr("192.168.5.2"));
+    assert(in_cksum(ip, sizeof(iphdr)) == 0); // might go out as a frame
+    assert(in_cksum(transport_header(b), b.size() - sizeof(iphdr)) == 0);
+    const iphdr *quoted = (const iphdr *)((const char *)transport_header(b) + sizeof(icmphdr));
+    IPFlowId id(quoted);
+    assert(id == IPFlowId(inet_addr("192.168.5.2"), inet_addr("8.8.8.8"),
+                          htons(4000), htons(53), IPPROTO_UDP));
+
+    // and the other way: an unreachable from the client for the reply
+    make_udp(b, "8.8.8.8", "10.0.0.1", 53, 33000, 16);
+    assert(rw.packetIn(b));
+    make_icmp(b, inet_addr("192.168.5.2"), &hdr);
+    assert(rw.packetOut(b));
+    assert(ip->saddr == c.out_addr);
+    assert(in_cksum(transport_header(b), b.size() - sizeof(iphdr)) == 0);
+    assert(IPFlowId(quoted).daddr == c.out_addr);
+  }
+}
+
+/// a SYN from the LAN with MSS 1460
+static tcphdr *make_syn(Buffer &b) {
+  b.clear();
+  b.put(sizeof(iphdr) + sizeof(tcphdr) + 8);
+  memset(b.data(), 0, b.size());
+  iphdr *ip = (iphdr *)b.data();
+  ip->version = IPVERSION;
+  ip->ihl = 5;
+  ip->tot_len = htons(b.size());
+  ip->protocol = IPPROTO_TCP;
+  ip->saddr = inet_addr("192.168.5.2");
+  ip->daddr = inet_addr("8.8.8.8");
+  tcphdr *tcp = (tcphdr *)transport_header(b);
+  tcp->source = htons(4000);
+  tcp->dest = htons(80);
+  tcp->syn = 1;
+  tcp->doff = (sizeof(tcphdr) + 8) >> 2;
+  // NOP, MSS 1460 at an odd offset, NOP, NOP, EOL
+  uint8_t opts[] = { TCPOPT_NOP, TCPOPT_MAXSEG, TCPOLEN_MAXSEG, 0x05, 0xb4,
+                     TCPOPT_NOP, TCPOPT_NOP, TCPOPT_EOL };
+  memcpy(tcp + 1, opts, sizeof(opts));
+  tcp->check = in_cksum(tcp, sizeof(tcphdr) + 8);
+  return tcp;
+}
+
+void test_mss() {
+  {
+    Buffer b;
+    tcphdr *tcp = make_syn(b);
+    clamp_mss(b, 1360);
+    const uint8_t *mss = (const uint8_t *)(tcp + 1) + 3;
+    assert(((mss[0] << 8) | mss[1]) == 1360);
+    assert(in_cksum(tcp, sizeof(tcphdr) + 8) == 0);
+    clamp_mss(b, 1400); // never raised
+    assert(((mss[0] << 8) | mss[1]) == 1360);
+  }
+  { // the MTU of a link that is gone or too small
+    Rewriter::Config c;
+    c.out_addr = inet_addr("1.0.0.1");
+    c.netmask = inet_addr("255.255.255.0");
+    c.subnet = inet_addr("192.168.5.0");
+    c.numpreserved = 0;
+    c.preserved = 0;
+    c.numports = 100;
+    c.firstport = 32000;
+    c.log = false;
+    Rewriter rw(c);
+    Buffer b;
+    rw.setMtu(1400);
+    rw.setMtu(-1);
+    const uint8_t *mss = (const uint8_t *)(make_syn(b) + 1) + 3;
+    assert(rw.packetOut(b) && (((mss[0] << 8) | mss[1]) == 1360));
+    rw.setMtu(40);
+    mss = (const uint8_t *)(make_syn(b) + 1) + 3;
+    assert(rw.packetOut(b) && (((mss[0] << 8) | mss[1]) == Rewriter::MinMss));
+  }
+}
+
+/// a TCP segment with the timestamp option, or the window scale on a SYN,
+/// len bytes of payload only in tot_len
+static tcphdr *make_tcp(Buffer &b, bool syn, uint32_t ack, uint16_t window,
+                        uint32_t tsval, uint32_t tsecr, unsigned len) {
+  b.clear();
+  b.put(sizeof(iphdr) + sizeof(tcphdr) + 12);
+  memset(b.data(), 0, b.size());
+  iphdr *ip = (iphdr *)b.data();
+  ip->ihl = 5;
+  ip->protocol = IPPROTO_TCP;
+  ip->tot_len = htons(b.size() + len);
+  tcphdr *tcp = (tcphdr *)transport_header(b);
+  tcp->syn = syn;
+  tcp->ack = 1;
+  tcp->ack_seq = htonl(ack);
+  tcp->window = htons(window);
+  tcp->doff = (sizeof(tcphdr) + 12) >> 2;
+  uint8_t *opt = (uint8_t *)(tcp + 1);
+  opt[0] = opt[1] = TCPOPT_NOP;
+  if (syn) {
+    opt[2] = TCPOPT_NOP;
+    opt[3] = TCPOPT_WINDOW; opt[4] = TCPOLEN_WINDOW; opt[5] = 7;
+  } else {
+    opt[2] = TCPOPT_TIMESTAMP; opt[3] = TCPOLEN_TIMESTAMP;
+    tsval = htonl(tsval); tsecr = htonl(tsecr);
+    memcpy(opt + 4, &tsval, 4);
+    memcpy(opt + 8, &tsecr, 4);
+  }
+  tcp->check = in_cksum(tcp, b.size() - sizeof(iphdr));
+  return tcp;
+}
+
+void test_window() {
+  {
+    WindowCtl w;
+    Buffer b;
+    make_tcp(b, true, 0, 65535, 0, 0, 0)->ack = 0;
+    w.out(b, 1000000);
+    make_tcp(b, true, 1, 65535, 0, 0, 0); // SYN-ACK, agreed to the scale
+    w.in(b, 1000000);
+    // no cap until there's a round trip and a rate
+    tcphdr *tcp = make_tcp(b, false, 1, 65535, 100, 0, 0);
+    w.out(b, 1000000);
+    assert(!w.cap() && (ntohs(tcp->window) == 65535));
+    make_tcp(b, false, 1, 1000, 200, 100, 1000);
+    w.in(b, 1050000);
+    assert(w.rtt() == 50000);
+    make_tcp(b, false, 1, 1000, 201, 100, 49000);
+    w.in(b, 1100000);
+    assert(w.rate() == 1000000);
+    assert(w.cap() == 100000); // twice the BDP
+    tcp = make_tcp(b, false, 50001, 65535, 101, 201, 0);
+    w.out(b, 1100000);
+    assert(ntohs(tcp->window) == (100000 >> 7));
+    assert(in_cksum(tcp, b.size() - sizeof(iphdr)) == 0);
+    // a window is never taken back, even if the cap goes down
+    make_tcp(b, false, 1, 1000, 202, 101, 0); // a shorter round trip
+    w.in(b, 1110000);
+    assert((w.rtt() == 10000) && (w.cap() == 20000));
+    tcp = make_tcp(b, false, 50002, 65535, 102, 202, 0);
+    w.out(b, 1110000);
+    assert(ntohs(tcp->window) > (20000 >> 7));
+    assert((50002 + (ntohs(tcp->window) << 7)) >= 50001 + (100000 >> 7 << 7));
+    // smaller windows are left as they are
+    tcp = make_tcp(b, false, 60000, 100, 103, 202, 0);
+    w.out(b, 1110000);
+    assert(ntohs(tcp->window) == 100);
+  }
+  {
+    // the peer opens, and the scale it agreed to holds for the LAN host
+    WindowCtl w;
+    Buffer b;
+    make_tcp(b, true, 0, 65535, 0, 0, 0)->ack = 0;
+    w.in(b, 1000000);
+    make_tcp(b, true, 1, 65535, 0, 0, 0);
+    w.out(b, 1000000);
+    make_tcp(b, false, 1, 65535, 100, 0, 0);
+    w.out(b, 1000000);
+    make_tcp(b, false, 1, 1000, 200, 100, 1000);
+    w.in(b, 1050000);
+    make_tcp(b, false, 1, 1000, 201, 100, 49000);
+    w.in(b, 1100000);
+    assert(w.cap() == 100000);
+    tcphdr *tcp = make_tcp(b, false, 50001, 65535, 101, 201, 0);
+    w.out(b, 1100000);
+    assert(ntohs(tcp->window) == (100000 >> 7));
+    // a new connection starts over
+    make_tcp(b, true, 0, 65535, 0, 0, 0)->ack = 0;
+    w.in(b, 2000000);
+    assert(!w.cap() && !w.rtt() && !w.rate());
+  }
+}
+
+void test_ip_fragment() {
+  {
+    Buffer b, frag;
+    make_udp(b, "8.8.8.8", "192.168.5.2", 53, 4000, 1200 - 28);
+    ((iphdr *)b.data())->id = htons(5);
+    unsigned total = 0, n = 0;
+    while (b.size() > 576) {
+      unsigned len = ip_fragment(b, frag, 576);
+      const iphdr *fip = (const iphdr *)frag.data();
+      assert(frag.size() <= 576);
+      assert(ntohs(fip->tot_len) == frag.size());
+      assert(ntohs(fip->frag_off) == (IP_MF | (total >> 3)));
+      assert(in_cksum(fip, sizeof(iphdr)) == 0);
+      total += len; ++n;
+      ip_fragment_shift(b, len);
+    }
+    const iphdr *ip = (const iphdr *)b.data();
+    assert(ntohs(ip->frag_off) == (total >> 3));
+    assert(total + b.size() - sizeof(iphdr) == 1200 - sizeof(iphdr));
+    assert(n == 2);
+  }
+}
+
+void test_gso_segment() {
+  {
+    GSOBuffer *p = new GSOBuffer();
+    const unsigned hlen = sizeof(iphdr) + sizeof(tcphdr);
+    const unsigned total = 5000;
+    p->clear();
+    p->put(hlen + total);
+    iphdr *ip = (iphdr *)p->data();
+    ip->version = IPVERSION;
+    ip->ihl = sizeof(iphdr) >> 2;
+    ip->ttl = IPDEFTTL;
+    ip->protocol = IPPROTO_TCP;
+    ip->tot_len = htons(hlen + total);
+    ip->id = htons(7);
+    ip->frag_off = htons(IP_DF);
+    ip->saddr = inet_addr("8.8.8.8");
+    ip->daddr = inet_addr("192.168.5.2");
+    tcphdr *th = (tcphdr *)(p->data() + sizeof(iphdr));
+    th->source = htons(80);
+    th->dest = htons(4000);
+    th->seq = htonl(1000);
+    th->doff = sizeof(tcphdr) >> 2;
+    th->ack = th->psh = th->fin = 1;
+    ((uint8_t *)th)[13] |= 0x80; // CWR
+    for (unsigned i = 0; i < total; ++i)
+      p->data()[hlen + i] = i * 7;
+
+    Buffer seg;
+    unsigned off = 0, n = 0, len;
+    while ((len = gso_segment(*p, off, 1448, seg))) {
+      const iphdr *sip = (const iphdr *)seg.data();
+      const tcphdr *sth = (const tcphdr *)(seg.data() + sizeof(iphdr));
+      assert(seg.size() == hlen + len);
+      assert(ntohs(sip->tot_len) == seg.size());
+      assert(ntohs(sip->id) == 7 + n);
+      assert(in_cksum(sip, sizeof(iphdr)) == 0);
+      assert(ntohl(sth->seq) == 1000 + off);
+      bool last = (off + len == total);
+      assert(sth->fin == last && sth->psh == last);
+      assert(((((const uint8_t *)sth)[13] & 0x80) != 0) == (off == 0));
+      // the checksum over the pseudo-header and the segment adds up to 0
+      uint32_t sum = pseudo_cksum(sip->saddr, sip->daddr, IPPROTO_TCP, len + sizeof(tcphdr)) +
+                     (0xFFFF ^ in_cksum(sth, len + sizeof(tcphdr)));
+      sum = (sum & 0xFFFF) + (sum >> 16);
+      assert((sum & 0xFFFF) == 0xFFFF);
+      assert(!memcmp(seg.data() + hlen, p->data() + hlen + off, len));
+      off += len; ++n;
+    }
+    assert(off == total);
+    assert(n == 4);
+    // in on a 1500 LAN, out to a 1400 WAN: the segments must fit the WAN
+    unsigned mss = gso_mss(1500, 1400, hlen);
+    assert((mss == 1400 - hlen) && (gso_mss(1400, 1500, hlen) == mss));
+    for (off = 0; (len = gso_segment(*p, off, mss, seg)); off+= len)
+      assert(seg.size() <= 1400);
+    assert(off == total);
+    assert(gso_mss(1500, 1400, 1400) == 0);
+    delete p;
+  }
+}
+
+void test_xdp_program() {
+  {
+    BPFProgram p;
+    p.stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(iphdr, daddr));
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFFFFFF, BPFProgram::DROP, 0);
+    p.stmt(BPF_LDX | BPF_B | BPF_MSH, 0);
+    p.stmt(BPF_LD | BPF_H | BPF_IND, 2);
+    p.jump(BPF_JMP | BPF_JGE | BPF_K, 32000, BPFProgram::ACCEPT, 0);
+    p.stmt(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + 6);
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, 0x01020304, BPFProgram::ACCEPT, BPFProgram::DROP);
+    assert(p.finish());
+    XdpProgram xp;
+    assert(xp.compile(p, 3));
+    assert(xp.size() > p.size());
+
+    p.clear();
+    p.stmt(BPF_ST, 0); // scratch memory is not supported
+    assert(p.finish());
+    assert(!xp.compile(p, 3));
+  }
+  {
+    XdpSocket x; // no Ethernet header on lo
+    assert(!x.open("lo") && (errno == EPROTONOSUPPORT) && !x.ok());
+  }
+}
+
+void test_uring() {
+  Uring r;
+  if (!r.open())
+    return; // no io_uring here
+  int sv[2];
+  assert(!socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv));
+  assert(r.recvmsg(sv[0], 1));
+  assert(r.submit() == 1);
+  for (unsigned i = 0; i < 3; ++i)
+    assert(write(sv[1], "hello!!", 5 + i) == (int)(5 + i));
+  assert(r.submit(3) >= 0);
+  for (unsigned i = 0; i < 3; ++i) {
+    const io_uring_cqe *c = r.peek();
+    assert(c && (Uring::tag(c) == 1) && (c->flags & IORING_CQE_F_MORE));
+    assert(c->flags & IORING_CQE_F_BUFFER);
+    unsigned bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+    r.advance();
+    Uring::Packet p;
+    r.packet(bid, p);
+    assert((p.size == 5 + i) && !p.truncated && !memcmp(p.data, "hello", 5));
+    r.recycle(bid);
+  }
+  assert(!r.peek());
+  r.close();
+  close(sv[0]);
+  close(sv[1]);
+}
+
+void test_loopio() {
+  LoopIO io(4);
+  Buffer b, r;
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(io.push(Backend::LAN, b));
+  assert(io.recv(Backend::WAN, r) == 0);
+  assert(io.recv(Backend::LAN, r) == (int)b.size());
+  assert(io.recv(Backend::LAN, r) == 0);
+  io.setReplay(true);
+  assert(io.push(Backend::LAN, b));
+  for (unsigned i = 0; i < 3; ++i)
+    assert(io.recv(Backend::LAN, r) == (int)b.size());
+  assert(io.send(r) == (int)r.size());
+  assert((io.sent().size() == 1) && (io.stats().tx == 1) && (io.stats().rx[Backend::LAN] == 4));
+}
+
+void test_overload() {
+  {
+    Overload o;
+    o.configure(1000, 100);
+    o.update(0, 100, 0, 10, false);
+    assert(!o.shedFlows() && !o.shed());
+    o.update(10, 2000, 0, 10, false); // lagging, new flows first
+    assert(o.shedFlows() && !o.shed() && (o.episodes() == 1));
+    o.update(50, 2000, 0, 10, false);
+    assert(o.level() == 1);
+    o.update(110, 0, 10, 10, true); // still full after an interval
+    assert(o.shed() == Overload::Step);
+    o.update(120, 800, 6, 10, false); // in between, hold
+    o.update(300, 800, 6, 10, false);
+    assert(o.level() == 2);
+    o.update(310, 100, 5, 10, false);
+    o.update(400, 100, 5, 10, false);
+    assert(o.level() == 2);
+    o.update(410, 100, 5, 10, false);
+    assert(o.level() == 1);
+    o.update(510, 100, 5, 10, false);
+    assert(!o.shedFlows() && (o.episodes() == 1));
+  }
+  {
+    Rewriter::Config c;
+    c.out_addr = inet_addr("1.0.0.1");
+    c.netmask = inet_addr("255.255.255.0");
+    c.subnet = inet_addr("192.168.5.0");
+    c.numpreserved = 0;
+    c.preserved = 0;
+    c.numports = 100;
+    c.firstport = 32000;
+    c.log = false;
+    Rewriter rw(c);
+    Buffer b;
+    rw.setShedding(true, 0);
+    make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+    assert(!rw.packetOut(b) && (rw.shedNew() == 1) && (rw.size() == 0));
+    rw.setShedding(false, 0);
+    make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+    assert(rw.packetOut(b));
+    make_ack(b, "192.168.5.2", "8.8.4.4", 4000, 80, 1000, false);
+    assert(rw.packetOut(b));
+    rw.setShedding(true, 128); // half of the established
+    unsigned n = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+      make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+      n+= rw.packetOut(b);
+      make_ack(b, "192.168.5.2", "8.8.4.4", 4000, 80, 1000 + i, false);
+      assert(rw.packetOut(b)); // ACKs are cheap and keep flows going
+    }
+    assert((n == 4) && (rw.shedEstablished() == 4) && (rw.shedNew() == 1));
+  }
+}
+
+void test_quota() {
+  Rewriter::Config c;
+  c.out_addr = inet_addr("1.0.0.1");
+  c.netmask = inet_addr("255.255.255.0");
+  c.subnet = inet_addr("192.168.5.0");
+  c.numpreserved = 0;
+  c.preserved = 0;
+  c.numports = 100;
+  c.firstport = 32000;
+  c.log = false;
+  c.conn_rate = 2;
+  c.client_maps = 3;
+  Rewriter rw(c);
+  Buffer b;
+  uint64_t now = 10000000;
+  rw.setTime(now);
+  for (unsigned i = 0; i < 4; ++i) { // a second's worth, then the rate
+    make_udp(b, "192.168.5.2", "8.8.8.8", 4000 + i, 53, 16);
+    assert(rw.packetOut(b) == (i < 2));
+  }
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16); // established
+  assert(rw.packetOut(b));
+  make_udp(b, "192.168.5.3", "8.8.8.8", 4000, 53, 16); // somebody else
+  assert(rw.packetOut(b));
+  assert((rw.limited() == 2) && (rw.clientMaps(inet_addr("192.168.5.2")) == 2));
+  rw.setTime(now+= 1000000);
+  for (unsigned i = 4; i < 6; ++i) {
+    make_udp(b, "192.168.5.2", "8.8.8.8", 4000 + i, 53, 16);
+    assert(rw.packetOut(b) == (i < 5)); // capped
+  }
+  assert((rw.capped() == 1) && (rw.clientMaps(inet_addr("192.168.5.2")) == 3));
+  rw.setTime(now+= 100000000);
+  rw.cleanup(false); // marks them unused
+  rw.cleanup(false);
+  assert((rw.size() == 0) && (rw.clientMaps(inet_addr("192.168.5.2")) == 0));
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b));
+}
+
+void test_proxy() {
+  FilterSocket ins;
+  ins.setSubnet(inet_addr("127.0.0.0"), inet_addr("255.0.0.0"));
+  TcpProxy p(ins);
+  Selector sel;
+  in_addr_t lo = inet_addr("127.0.0.1");
+  if (!p.open(sel, lo, 0, "lo", "", 0, 10))
+    return; // no network here?
+  sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  assert(getsockname(p.fd(), (sockaddr *)&sa, &len) == 0);
+  // not diverted, so it was going to the proxy itself
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(connect(fd, (sockaddr *)&sa, sizeof(sa)) == 0);
+  p.want(sel);
+  assert(sel.select() == 1);
+  p.handle(sel);
+  assert((p.size() == 0) && (p.accepted() == 0) && (p.refused() == 1));
+  char c;
+  assert((recv(fd, &c, 1, 0) < 0) && (errno == ECONNRESET));
+  close(fd);
+  p.close();
+  assert(!p.ok());
+}
+
+/// a TcpProxy whose connections were all going to _to
+class DivertedProxy : public TcpProxy {
+  sockaddr_in _to;
+  bool destination(int, sockaddr_in &dst) const { dst = _to; return true; }
+public:
+  DivertedProxy(const FilterSocket &ins, const sockaddr_in &to) : TcpProxy(ins), _to(to) {}
+};
+
+/// one round of p, waiting at most 10ms
+static void pump(TcpProxy &p, Selector &sel) {
+  timeval tv = { 0, 10000 };
+  p.want(sel);
+  if (sel.select(&tv) > 0)
+    p.handle(sel);
+}
+
+/// run p until something can be read from fd, return what recv() got
+static ssize_t relayed(TcpProxy &p, Selector &sel, int fd, char *buf, size_t len) {
+  for (int i = 0; i < 100; ++i) {
+    ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+    if ((n >= 0) || (errno != EAGAIN))
+      return n;
+    pump(p, sel);
+  }
+  return -1;
+}
+
+void test_proxy_relay() {
+  FilterSocket ins;
+  ins.setSubnet(inet_addr("127.0.0.0"), inet_addr("255.0.0.0"));
+  int srv = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+  socklen_t len = sizeof(sa);
+  if ((bind(srv, (sockaddr *)&sa, sizeof(sa)) < 0) || (listen(srv, 1) < 0)) {
+    close(srv);
+    return; // no network here?
+  }
+  assert(getsockname(srv, (sockaddr *)&sa, &len) == 0);
+  DivertedProxy p(ins, sa);
+  Selector sel;
+  assert(p.open(sel, inet_addr("127.0.0.2"), 0, "lo", "", 0, 10));
+  assert(getsockname(p.fd(), (sockaddr *)&sa, &len) == 0);
+  int cli = socket(AF_INET, SOCK_STREAM, 0);
+  assert(connect(cli, (sockaddr *)&sa, sizeof(sa)) == 0);
+  char buf[8];
+  for (int i = 0; (i < 100) && !p.accepted(); ++i)
+    pump(p, sel);
+  assert((p.size() == 1) && (p.accepted() == 1) && (p.refused() == 0));
+  int up = accept(srv, NULL, NULL);
+  assert(up >= 0);
+  // each way through the pipes, then the FIN
+  assert(send(cli, "ping", 4, 0) == 4);
+  assert(shutdown(cli, SHUT_WR) == 0);
+  assert((relayed(p, sel, up, buf, sizeof(buf)) == 4) && !memcmp(buf, "ping", 4));
+  assert(relayed(p, sel, up, buf, sizeof(buf)) == 0);
+  assert(p.size() == 1); // half closed
+  assert(send(up, "pong", 4, 0) == 4);
+  assert(shutdown(up, SHUT_WR) == 0);
+  assert((relayed(p, sel, cli, buf, sizeof(buf)) == 4) && !memcmp(buf, "pong", 4));
+  assert(relayed(p, sel, cli, buf, sizeof(buf)) == 0);
+  assert(p.size() == 0);
+  close(up);
+  close(cli);
+  close(srv);
+}
+
+void test_offload() {
+  TcOffload t;
+  assert(!t.open("nonexistent0", "lo", 0, 0, true) && !t.ok());
+  if (!t.open("lo", "lo", inet_addr("127.0.0.0"), inet_addr("255.0.0.0"), true))
+    return; // no tcx here?
+  assert(t.setMtu(1500, 1400) && !t.setMtu(-1, 1400) && t.ok());
+  TcOffload::Key k;
+  memset(&k, 0, sizeof(k));
+  k.saddr = inet_addr("192.168.5.2");
+  k.sport = htons(5000);
+  k.protocol = IPPROTO_UDP;
+  assert(t.add(TcOffload::LAN, k, inet_addr("10.0.0.1"), htons(32000)));
+  assert(t.packets(TcOffload::LAN, k) == 0);
+  t.remove(TcOffload::LAN, k);
+  assert(t.add(TcOffload::LAN, k, inet_addr("10.0.0.1"), htons(32000)));
+  assert(t.add(TcOffload::WAN, k, 0, 0));
+  t.clear();
+  // a mapping the map refused waits for clearOffload() to try again
+  Rewriter::Config c;
+  c.out_addr = inet_addr("1.0.0.1");
+  c.netmask = inet_addr("255.255.255.0");
+  c.subnet = inet_addr("192.168.5.0");
+  c.numpreserved = 0;
+  c.preserved = 0;
+  c.numports = 100;
+  c.firstport = 32000;
+  c.log = false;
+  Rewriter rw(c);
+  rw.setOffload(&t);
+  t.close(); // so every add fails
+  Buffer b;
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b) && (rw.offloaded() == 0));
+  assert(t.open("lo", "lo", inet_addr("127.0.0.0"), inet_addr("255.0.0.0"), true));
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b) && (rw.offloaded() == 0));
+  rw.clearOffload();
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b) && (rw.offloaded() == 2));
+  rw.setOffload(NULL);
+  t.clear();
+  t.close();
+  assert(!t.ok());
+}
+
+// let the slow path catch up, up to a second
+static bool next_published(Rewriter &rw, Buffer &b) {
+  for (unsigned i = 0; i < 1000; ++i) {
+    if (rw.nextPublished(b)) return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+static char ip_forward() {
+  char c = 0;
+  int fd = open("/proc/sys/net/ipv4/ip_forward", O_RDONLY);
+  assert((fd >= 0) && (read(fd, &c, 1) == 1));
+  close(fd);
+  return c;
+}
+
+/// run test in a network namespace of its own, as it changes ip_forward,
+/// skip it if we cannot have one
+static void in_netns(void (*test)()) {
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (!pid) {
+    if (unshare(CLONE_NEWNET) == 0)
+      test();
+    _exit(0);
+  }
+  int status;
+  assert((waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+void test_conntrack() {
+  char was = ip_forward();
+  NfOffload nf;
+  if (!nf.open("lo", "lo")) {
+    assert(ip_forward() == was);
+    return; // no nf_tables here?
+  }
+  assert(ip_forward() == '1'); // with the table in place
+  Rewriter::Config c;
+  c.out_addr = inet_addr("1.0.0.1");
+  c.netmask = inet_addr("255.255.255.0");
+  c.subnet = inet_addr("192.168.5.0");
+  c.numpreserved = 0;
+  c.preserved = 0;
+  c.numports = 100;
+  c.firstport = 32000;
+  c.log = false;
+  Rewriter rw(c);
+  rw.setConntrack(&nf);
+  Buffer b;
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b)); // the kernel dropped this one
+  uint16_t port = ntohs(((udphdr *)transport_header(b))->source);
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b)); // and this one, not committed yet
+  rw.commitConntrack();
+  assert(rw.offloaded() == 1);
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(!rw.packetOut(b)); // a copy of what the kernel forwarded
+  make_udp(b, "8.8.8.8", "1.0.0.1", 53, port, 16);
+  assert(!rw.packetIn(b));
+  rw.cleanup(false);
+  rw.cleanup(false);
+  assert(rw.size() == 1); // the kernel still has it
+  assert(rw.setSlowPath(true));
+  rw.cleanup(false);
+  rw.cleanup(false);
+  assert(!next_published(rw, b) && (rw.size() == 1)); // the same on the slow path
+  assert(rw.setSlowPath(false));
+  rw.clearOffload();
+  rw.conntrackEvents();
+  assert(rw.offloaded() == 0);
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b)); // back to us
+  rw.setConntrack(0);
+  nf.close();
+  assert(ip_forward() == was);
+}
+
+void test_slowpath() {
+  Rewriter::Config c;
+  c.out_addr = inet_addr("1.0.0.1");
+  c.netmask = inet_addr("255.255.255.0");
+  c.subnet = inet_addr("192.168.5.0");
+  c.numpreserved = 0;
+  c.preserved = 0;
+  c.numports = 100;
+  c.firstport = 32000;
+  c.log = false;
+  Rewriter rw(c);
+  Buffer b;
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b)); // made inline
+  assert(rw.setSlowPath(true) && (rw.slowFd() >= 0));
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4000, 53, 16);
+  assert(rw.packetOut(b)); // established, as before
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4001, 53, 16);
+  assert(!rw.packetOut(b)); // held
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4001, 53, 16);
+  assert(!rw.packetOut(b)); // held, too
+  for (unsigned i = 0; i < 2; ++i) {
+    b.clear();
+    assert(next_published(rw, b));
+    const iphdr *ip = (const iphdr *)b.data();
+    assert(ip->saddr == c.out_addr);
+  }
+  assert(rw.size() == 2);
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4001, 53, 16);
+  assert(rw.packetOut(b));
+  rw.cleanup(false); // marks them unused
+  assert(!next_published(rw, b) && (rw.size() == 2));
+  rw.cleanup(false);
+  assert(!next_published(rw, b) && (rw.size() == 0));
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4002, 53, 16);
+  assert(!rw.packetOut(b));
+  assert(rw.setSlowPath(false) && (rw.slowFd() < 0)); // lets go of the packet
+  assert(rw.size() == 1);
+  make_udp(b, "192.168.5.2", "8.8.8.8", 4002, 53, 16);
+  assert(rw.packetOut(b));
+}
+
+void test_flowqueue() {
+  FlowQueue::Config c;
+  memset(&c, 0, sizeof(c));
+  {
+    FlowQueue q(4, c); // FIFO
+    for (unsigned i = 0; i < 4; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000 + i, 53, 16);
+      q.pushTail();
+    }
+    assert(q.full());
+    for (unsigned i = 0; i < 4; ++i) {
+      assert(!q.empty());
+      assert(IPFlowId(q.head()).sport == htons(4000 + i));
+      assert(!q.empty()); // still the same one
+      q.popHead();
+    }
+    assert(q.empty());
+  }
+  c.fq = true;
+  {
+    // a sparse flow goes ahead of a bulk one
+    FlowQueue q(8, c);
+    for (unsigned i = 0; i < 5; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000, 5001, 1400);
+      q.pushTail();
+    }
+    make_udp(q.tail(), "192.168.5.3", "8.8.8.8", 4001, 53, 16);
+    q.pushTail();
+    uint16_t order[6];
+    for (unsigned i = 0; i < 6; ++i) {
+      assert(!q.empty());
+      order[i] = ntohs(IPFlowId(q.head()).sport);
+      q.popHead();
+    }
+    assert(q.empty());
+    assert((order[0] == 4000) && (order[1] == 4000) && (order[2] == 4001));
+    // with no room, the longest flow pays
+    for (unsigned i = 0; i < 8; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000, 5001, 1400);
+      q.pushTail();
+    }
+    assert(!q.full());
+    q.tail(); // e.g. for a recv() that got nothing
+    assert((q.size() == 8) && (q.drops() == 0));
+    make_udp(q.tail(), "192.168.5.3", "8.8.8.8", 4001, 53, 16);
+    q.pushTail();
+    assert((q.size() == 8) && (q.drops() == 1));
+    for (unsigned i = 0; i < 8; ++i) { // the spare went round with the rest
+      assert(!q.empty());
+      q.popHead();
+    }
+    assert(q.empty());
+  }
+  c.codel_target = 5000;
+  c.codel_interval = 100000;
+  c.ecn = true;
+  {
+    // a standing queue gets dropped, or marked if ECN-capable
+    FlowQueue q(64, c);
+    q.setTime(1000000);
+    for (unsigned i = 0; i < 64; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000, 5001, 1400);
+      iphdr *ip = (iphdr *)q.tail().data();
+      if (i % 2)
+        ip->tos = IPTOS_ECN_ECT0;
+      ip->check = 0;
+      ip->check = in_cksum(ip, sizeof(iphdr));
+      q.pushTail();
+    }
+    for (uint64_t now = 1000000 + 50000; ; now += 10000) {
+      q.setTime(now);
+      if (q.empty()) break;
+      const iphdr *ip = (const iphdr *)q.head().data();
+      assert(in_cksum(ip, sizeof(iphdr)) == 0);
+      q.popHead();
+    }
+    assert(q.drops() > 0);
+    assert(q.marks() > 0);
+  }
+  c.codel_target = 0;
+  {
+    // clients share by weight, whatever their number of packets or flows
+    FlowQueue q(64, c);
+    q.setLan(inet_addr("192.168.5.0"), inet_addr("255.255.255.0"));
+    assert(q.setClient(inet_addr("192.168.5.2"), 3, 0, 0));
+    assert(!q.setClient(inet_addr("8.8.8.8"), 3, 0, 0));
+    for (unsigned i = 0; i < 32; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000 + i, 5001, 1400);
+      q.pushTail();
+    }
+    for (unsigned i = 0; i < 16; ++i) {
+      make_udp(q.tail(), "1.0.0.1", "8.8.8.8", 4000, 5001, 1400); // translated
+      q.pushTail(inet_addr("192.168.5.3"));
+    }
+    unsigned n = 0;
+    for (unsigned i = 0; i < 16; ++i) {
+      assert(!q.empty());
+      n += (IPFlowId(q.head()).saddr == inet_addr("192.168.5.2"));
+      q.popHead();
+    }
+    assert(n == 12);
+    q.clear();
+    // a capped client waits for its tokens, the others don't
+    q.setLan(inet_addr("192.168.5.0"), inet_addr("255.255.255.0"));
+    q.setTime(1000000);
+    assert(q.setClient(inet_addr("192.168.5.2"), 1, 100000, 0));
+    for (unsigned i = 0; i < 16; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000, 5001, 1400);
+      q.pushTail();
+    }
+    make_udp(q.tail(), "8.8.8.8", "192.168.5.2", 5001, 4000, 1400); // down is not capped
+    q.pushTail();
+    for (n = 0; !q.empty(); ++n)
+      q.popHead();
+    assert((n == 6) && (q.size() == 11) && q.throttled());
+    uint64_t next = q.nextTime();
+    assert((next > 1000000) && (next < 1000000 + 20000));
+    q.setTime(next);
+    assert(!q.empty() && !q.throttled());
+    for (n = 0; !q.empty(); ++n)
+      q.popHead();
+    assert(q.throttled());
+    assert(q.setClient(inet_addr("192.168.5.2"), 1, 0, 0)); // lifted while throttled
+    assert(!q.throttled() && (q.nextTime() == ~(uint64_t)0));
+    for (; !q.empty(); ++n)
+      q.popHead();
+    assert(q.size() == 0);
+  }
+  c.ack_prio = c.ack_thin = true;
+  {
+    // pure ACKs go first, and the later ones replace the earlier
+    FlowQueue q(16, c);
+    for (unsigned i = 0; i < 4; ++i) {
+      make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000, 5001, 1400);
+      q.pushTail();
+    }
+    for (uint32_t ack = 1000; ack <= 4000; ack += 1000) {
+      make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 4001, 80, ack, false);
+      q.pushTail();
+    }
+    make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 4002, 80, 500, false); // other flow
+    q.pushTail();
+    make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 4001, 80, 4000, true); // not redundant
+    q.pushTail();
+    make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 4001, 80, 3000, false); // reordered
+    q.pushTail();
+    assert((q.size() == 8) && (q.thinned() == 3));
+    const uint32_t acks[] = { 4000, 500, 4000, 3000 };
+    for (unsigned i = 0; i < 4; ++i) {
+      assert(!q.empty() && pure_ack(q.head()));
+      assert(ntohl(pure_ack(q.head())->ack_seq) == acks[i]);
+      q.popHead();
+    }
+    assert(!q.empty() && !pure_ack(q.head()));
+  }
+  {
+    // duplicate ACKs are the cue to retransmit, only a window update replaces
+    FlowQueue q(16, c);
+    make_udp(q.tail(), "192.168.5.2", "8.8.8.8", 4000, 5001, 1400);
+    q.pushTail();
+    for (unsigned i = 0; i < 3; ++i) {
+      make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 4001, 80, 1000, false);
+      q.pushTail();
+    }
+    assert((q.size() == 4) && (q.thinned() == 0));
+    make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 4001, 80, 1000, false);
+    ((tcphdr *)transport_header(q.tail()))->window = htons(100);
+    q.pushTail();
+    assert((q.size() == 4) && (q.thinned() == 1));
+    // the lane holds a quarter of the queue, the rest waits its turn
+    for (unsigned i = 0; i < 3; ++i) {
+      make_ack(q.tail(), "192.168.5.2", "8.8.8.8", 5000 + i, 80, 1000, false);
+      q.pushTail();
+    }
+    for (unsigned i = 0; i < 4; ++i) {
+      assert(!q.empty() && pure_ack(q.head()));
+      q.popHead();
+    }
+    assert(!q.empty() && !pure_ack(q.head()));
+  }
+}
+
+void test_neighbors() {
+  Neighbors n;
+  const uint8_t a[6] = { 0, 1, 2, 3, 4, 5 }, r[6] = { 0, 1, 2, 3, 4, 6 };
+  in_addr_t host = inet_addr("192.168.5.2");
+  assert(!n.find(host, true) && !n.find(inet_addr("8.8.8.8"), false));
+  n.learn(host, a);
+  n.learn(host, a);
+  assert(!memcmp(n.find(host, true), a, 6));
+  assert(!n.find(inet_addr("192.168.5.3"), true));
+  n.learn(host, r); // moved
+  assert(!memcmp(n.find(host, true), r, 6));
+  n.learnRouter(a);
+  assert(!memcmp(n.find(inet_addr("8.8.8.8"), false), a, 6));
+  n.clear();
+  assert(!n.find(host, true) && !n.find(inet_addr("8.8.8.8"), false));
+}
+
 void test_nat() {
   { // without cleanup()
     // use two back-to-back rewriters
@@ -251,6 +1256,24 @@ int main(/*int argc, const char * argv[]*/) {
   //test_socket();
   //test_ipsocket();
   test_ipflow();
+  test_fragments();
+  test_icmp_error();
+  test_mss();
+  test_window();
+  test_ip_fragment();
+  test_gso_segment();
+  test_xdp_program();
+  test_uring();
+  test_loopio();
+  test_neighbors();
+  test_flowqueue();
+  test_overload();
+  test_quota();
+  test_proxy();
+  test_proxy_relay();
+  test_offload();
+  in_netns(test_conntrack);
+  test_slowpath();
   assert(0); // testing if assert works
   return 0;
 }
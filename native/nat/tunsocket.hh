@@ -0,0 +1,122 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: TUN device with offloads */
+#ifndef INCLUDED_TUNSOCKET_HH
+#define INCLUDED_TUNSOCKET_HH
+
+#include <sys/uio.h> // for readv/writev
+#include <linux/if_tun.h>
+
+#include "socket.hh"
+
+// NOTE: <linux/virtio_net.h> can't be included in C++ (it has a "class")
+struct vnethdr {
+  uint8_t  flags;
+  uint8_t  gso_type;
+  uint16_t hdr_len;     // all in host order
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+
+const int VNET_F_NEEDS_CSUM = 1; // csum_start/csum_offset are valid
+const int VNET_F_DATA_VALID = 2;
+
+/**
+ * TUN device with IFF_VNET_HDR, an alternative to the capture/injection
+ * sockets. Packets are routed into the device, translated, and written back
+ * for the kernel to forward. With the offloads enabled, the kernel hands us
+ * TCP super-packets of up to 64KB (GSO) with the checksum left to be
+ * completed (VNET_F_NEEDS_CSUM), and segments them after we're done.
+ *
+ * The device does not capture anything by itself, policy routing has to
+ * steer both directions into it. Create it beforehand, so that the routes
+ * survive restarts, e.g. with tun0, table 100 and NAT ports 32000-32099 on
+ * wan0 with address $WAN:
+ *   ip tuntap add dev tun0 mode tun vnet_hdr
+ *   ip route add default dev tun0 table 100
+ *   ip rule add pref 9 iif lan0 to $LAN lookup local
+ *   ip rule add pref 10 iif lan0 lookup 100
+ *   ip rule add pref 11 iif wan0 to $WAN ipproto tcp dport 32000-32099 lookup 100
+ *   ip rule add pref 12 iif wan0 to $WAN ipproto udp lookup 100
+ *   ip rule add pref 13 iif wan0 to $WAN ipproto icmp lookup 100
+ *   ip rule del pref 0 lookup local; ip rule add pref 100 lookup local
+ *   sysctl net.ipv4.ip_forward=1 net.ipv4.conf.tun0.accept_local=1
+ *   sysctl net.ipv4.conf.tun0.rp_filter=0
+ * Rule 9 keeps ARP and traffic to the gateway itself local. UDP is not
+ * matched by port since later fragments carry no ports; the rewriter drops
+ * whatever is not mapped, so local UDP services on the WAN are not reachable.
+ * To try it out locally, put a client and a server in two network
+ * namespaces connected with veth pairs to the one running the NAT.
+ *
+ * NOTE: MAC filtering is not available here, the packets are already routed.
+ */
+class TunSocket : public BaseSocket {
+public:
+  typedef vnethdr Header;
+
+  TunSocket() { _fd = -1; }
+
+  bool open(const char *iface) {
+    close();
+    _fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (_fd < 0)
+      _fd = ::open("/dev/tun", O_RDWR | O_NONBLOCK); // older Android
+    if (_fd < 0)
+      return false;
+    ifreq ifr;
+    ::memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_VNET_HDR;
+    ::strncpy(ifr.ifr_name, iface, sizeof(ifr.ifr_name));
+    int hdrsz = sizeof(Header);
+    unsigned offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN;
+    if (::ioctl(_fd, TUNSETIFF, &ifr) ||
+        ::ioctl(_fd, TUNSETVNETHDRSZ, &hdrsz) ||
+        ::ioctl(_fd, TUNSETOFFLOAD, offload)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  /// return 0 on try again, -1 on fail
+  template <unsigned N>
+  int recv(Header &h, BufferT<N> &b) {
+    b.reset();
+    iovec iov[2] = { { &h, sizeof(h) }, { b.data(), b.room() - 1 } };
+    int len = ::readv(_fd, iov, 2);
+    if (len > (int)sizeof(h)) {
+      b.put(len - sizeof(h));
+      return len;
+    }
+    if (len >= 0) return 0; // runt
+    return (errno == EAGAIN) ? 0 : -1;
+  }
+
+  /// return 0 on try again, -1 on fail
+  int send(const Header &h, const char *data, unsigned size) {
+    iovec iov[2] = { { const_cast<Header *>(&h), sizeof(h) },
+                     { const_cast<char *>(data), size } };
+    int len = ::writev(_fd, iov, 2);
+    if (len > 0) return len;
+    return ((len < 0) && (errno == EAGAIN)) ? 0 : -1;
+  }
+};
+
+#endif // INCLUDED_TUNSOCKET_HH
@@ -0,0 +1,154 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: AF_PACKET TX ring */
+#ifndef INCLUDED_TXRING_HH
+#define INCLUDED_TXRING_HH
+
+#include <sys/mman.h>
+
+#include "socket.hh"
+
+// NOTE: <linux/if_packet.h> clashes with <netpacket/packet.h>, as for auxdata
+struct tpacket2 { // tpacket2_hdr
+  uint32_t tp_status;
+  uint32_t tp_len;
+  uint32_t tp_snaplen;
+  uint16_t tp_mac;
+  uint16_t tp_net;
+  uint32_t tp_sec;
+  uint32_t tp_nsec;
+  uint16_t tp_vlan_tci;
+  uint16_t tp_vlan_tpid;
+  uint8_t  tp_padding[4];
+};
+
+struct tpacket_request { // tpacket_req
+  unsigned tp_block_size;
+  unsigned tp_block_nr;
+  unsigned tp_frame_size;
+  unsigned tp_frame_nr;
+};
+
+#ifndef PACKET_TX_RING
+#define PACKET_VERSION  10
+#define PACKET_TX_RING  13
+#define PACKET_LOSS     14
+#endif
+#define TPACKET2_VERSION        1 // TPACKET_V2
+#define TX_STATUS_AVAILABLE     0
+#define TX_STATUS_SEND_REQUEST  1
+
+/**
+ * A PACKET_TX_RING on a bound (SOCK_DGRAM) PacketSocket. put() copies the
+ * IP packet straight into the next mmap'd frame, flush() hands all of them
+ * to the device with one send(), without routing or netfilter. Frames the
+ * device rejects (e.g. over the MTU) are dropped (PACKET_LOSS) instead of
+ * stalling the ring.
+ */
+class TxRing {
+public:
+  static const unsigned FrameSize = 2048;
+  static const unsigned NumFrames = 256;
+  static const unsigned BlockSize = FrameSize * 16;
+  /// of the packet in a frame, for SOCK_DGRAM without PACKET_TX_HAS_OFF
+  static const unsigned Offset = (sizeof(tpacket2) + 15) & ~15; // TPACKET_ALIGN
+
+protected:
+  int _fd;      // not owned
+  char *_map;
+  unsigned _head;     // next frame to put()
+  unsigned _pending;  // put() since the last flush()
+
+  tpacket2 *frame(unsigned i) { return (tpacket2 *)(_map + i * FrameSize); }
+
+public:
+  TxRing() : _fd(-1), _map(0), _head(0), _pending(0) {}
+
+  bool ok() const { return _map != 0; }
+
+  /// set up the ring on fd, before any other ring, return false on fail
+  bool open(int fd) {
+    close();
+    int val = TPACKET2_VERSION;
+    if (::setsockopt(fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)))
+      return false;
+    val = 1;
+    if (::setsockopt(fd, SOL_PACKET, PACKET_LOSS, &val, sizeof(val)))
+      return false;
+    tpacket_request req;
+    req.tp_block_size = BlockSize;
+    req.tp_block_nr = NumFrames * FrameSize / BlockSize;
+    req.tp_frame_size = FrameSize;
+    req.tp_frame_nr = NumFrames;
+    if (::setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)))
+      return false;
+    void *map = ::mmap(0, NumFrames * FrameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      return false;
+    _fd = fd;
+    _map = (char *)map;
+    _head = _pending = 0;
+    return true;
+  }
+
+  /// NOTE: the ring itself goes away with the socket
+  void close() {
+    if (_map)
+      ::munmap(_map, NumFrames * FrameSize);
+    _map = 0;
+    _fd = -1;
+  }
+
+  /// a packet of that many bytes fits in a frame
+  static bool fits(unsigned len) { return len <= FrameSize - Offset; }
+
+  /// return length, 0 if the ring is full
+  int put(const Buffer &b) {
+    const iphdr *ip = (const iphdr *)b.data();
+    unsigned tot_len = ntohs(ip->tot_len);
+    if (tot_len > b.size()) {
+      DBG("IP HDR FAILS LEN CHECK %d %d\n", tot_len, b.size());
+      return 1; // packet ignored!
+    }
+    tpacket2 *h = frame(_head);
+    if (h->tp_status != TX_STATUS_AVAILABLE)
+      return 0; // still sending
+    ::memcpy((char *)h + Offset, b.data(), tot_len);
+    h->tp_len = tot_len;
+    __sync_synchronize();
+    h->tp_status = TX_STATUS_SEND_REQUEST;
+    _head = (_head + 1) % NumFrames;
+    ++_pending;
+    return tot_len;
+  }
+
+  /// send all that was put(), to the link-layer address if given,
+  /// return false on fail
+  bool flush(const sockaddr_ll *to = 0) {
+    if (!_pending)
+      return true;
+    int r = ::sendto(_fd, 0, 0, MSG_DONTWAIT, (const sockaddr *)to, to ? sizeof(*to) : 0);
+    if (r < 0)
+      return (errno == EAGAIN) || (errno == ENOBUFS); // the rest goes next time
+    _pending = 0;
+    return true;
+  }
+};
+
+#endif // INCLUDED_TXRING_HH
@@ -0,0 +1,496 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: io_uring */
+#ifndef INCLUDED_URING_HH
+#define INCLUDED_URING_HH
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "socket.hh"
+#include "backend.hh"
+
+/**
+ * Minimal io_uring, without liburing. The ring fd becomes readable when
+ * there are completions, so it goes into the Selector like any socket.
+ *
+ * Receive buffers are provided to the kernel in a buffer ring (group 0),
+ * so that multishot receives can stay posted: the kernel picks a buffer for
+ * each packet, and we recycle() it once the packet is copied out.
+ * Sends are copied into one of NumSlots slots, since the Buffer in the queue
+ * is reused long before the completion arrives.
+ *
+ * Needs Linux 6.0 for multishot recvmsg, open() fails before 5.19.
+ */
+class Uring : public BaseSocket {
+public:
+  static const unsigned Entries = 256;  // submission queue
+  static const unsigned NumBufs = 256;  // provided buffers
+  static const unsigned BufSize = 2048 + 256; // packet + recvmsg_out, name, cmsg
+  static const unsigned NumSlots = 64;  // sends in flight
+  static const unsigned Send = 0xff;    // tag() of send completions
+
+  /// a packet received by a recvmsg()
+  struct Packet {
+    const sockaddr_ll *sll;
+    char     *data;
+    unsigned size;
+    uint32_t status;    // TP_STATUS_XX
+    bool     truncated; // did not fit in BufSize
+  };
+protected:
+  struct Slot {
+    Buffer      b;
+    union {
+      sockaddr_in in;
+      sockaddr_ll ll;
+    } sa;
+    iovec       iov;
+    msghdr      msg;
+  };
+
+  struct {
+    unsigned *head, *tail, *mask, *array;
+  } _sq;
+  struct {
+    unsigned *head, *tail, *mask;
+    io_uring_cqe *cqes;
+  } _cq;
+  io_uring_sqe *_sqes;
+  void   *_sqmap, *_cqmap;
+  size_t _sqlen, _cqlen;
+  unsigned _sqtail;   // ours, published by submit()
+  unsigned _tosubmit;
+
+  // NOTE: in C++ the flexible bufs[] of io_uring_buf_ring is off by 8 bytes
+  // (the empty struct in __DECLARE_FLEX_ARRAY takes one), use _bufs instead
+  io_uring_buf_ring *_br; // also holds the buffers
+  io_uring_buf *_bufs;
+  size_t _brlen;
+  unsigned short _brtail;
+  msghdr _rxmsg; // only the name and control lengths matter
+
+  Slot *_tx;
+  unsigned _txfree[NumSlots];
+  unsigned _ntxfree;
+
+  int enter(unsigned submit, unsigned wait, unsigned flags) {
+    return ::syscall(__NR_io_uring_enter, _fd, submit, wait, flags, 0, 0);
+  }
+
+public:
+  Uring() : _sqes(0), _sqmap(0), _cqmap(0), _br(0), _tx(0) { _fd = -1; }
+
+  void close() {
+    if (_tx) delete [] _tx;
+    _tx = 0;
+    if (_br) ::munmap(_br, _brlen);
+    if (_sqes) ::munmap(_sqes, Entries * sizeof(io_uring_sqe));
+    if (_cqmap && (_cqmap != _sqmap)) ::munmap(_cqmap, _cqlen);
+    if (_sqmap) ::munmap(_sqmap, _sqlen);
+    _br = 0; _sqes = 0; _sqmap = _cqmap = 0;
+    BaseSocket::close();
+  }
+
+  bool open() {
+    close();
+    io_uring_params p;
+    ::memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * Entries; // multishot receives complete a lot
+    _fd = ::syscall(__NR_io_uring_setup, Entries, &p);
+    if (_fd < 0)
+      return false;
+    _sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqlen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (_cqlen > _sqlen) _sqlen = _cqlen;
+      _cqlen = _sqlen;
+    }
+    _sqmap = ::mmap(0, _sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    _fd, IORING_OFF_SQ_RING);
+    if (_sqmap == MAP_FAILED) { _sqmap = 0; close(); return false; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      _cqmap = _sqmap;
+    } else {
+      _cqmap = ::mmap(0, _cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      _fd, IORING_OFF_CQ_RING);
+      if (_cqmap == MAP_FAILED) { _cqmap = 0; close(); return false; }
+    }
+    void *sqes = ::mmap(0, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) { close(); return false; }
+    _sqes = (io_uring_sqe *)sqes;
+
+    char *sq = (char *)_sqmap, *cq = (char *)_cqmap;
+    _sq.head  = (unsigned *)(sq + p.sq_off.head);
+    _sq.tail  = (unsigned *)(sq + p.sq_off.tail);
+    _sq.mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    _sq.array = (unsigned *)(sq + p.sq_off.array);
+    _cq.head  = (unsigned *)(cq + p.cq_off.head);
+    _cq.tail  = (unsigned *)(cq + p.cq_off.tail);
+    _cq.mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    _cq.cqes  = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    _sqtail = *_sq.tail;
+    _tosubmit = 0;
+
+    // the buffer ring, followed by the buffers themselves
+    _brlen = NumBufs * (sizeof(io_uring_buf) + BufSize);
+    void *br = ::mmap(0, _brlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) { close(); return false; }
+    _br = (io_uring_buf_ring *)br;
+    _bufs = (io_uring_buf *)br;
+    io_uring_buf_reg reg;
+    ::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)_br;
+    reg.ring_entries = NumBufs;
+    reg.bgid = 0;
+    if (::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+      close();
+      return false;
+    }
+    _brtail = 0;
+    for (unsigned i = 0; i < NumBufs; ++i)
+      recycle(i);
+
+    ::memset(&_rxmsg, 0, sizeof(_rxmsg));
+    _rxmsg.msg_namelen = sizeof(sockaddr_ll);
+    _rxmsg.msg_controllen = CMSG_SPACE(sizeof(auxdata));
+    _tx = new Slot[NumSlots];
+    for (unsigned i = 0; i < NumSlots; ++i)
+      _txfree[i] = i;
+    _ntxfree = NumSlots;
+    return true;
+  }
+
+  /// zeroed submission entry, or NULL if the queue is full
+  io_uring_sqe *sqe() {
+    __sync_synchronize();
+    if (_sqtail - *_sq.head >= Entries)
+      return 0;
+    unsigned i = _sqtail & *_sq.mask;
+    io_uring_sqe *e = &_sqes[i];
+    ::memset(e, 0, sizeof(*e));
+    _sq.array[i] = i;
+    ++_sqtail;
+    ++_tosubmit;
+    return e;
+  }
+
+  /// submit all, and wait for completions if asked to
+  /// return -1 on fail
+  int submit(unsigned wait = 0) {
+    __sync_synchronize();
+    *_sq.tail = _sqtail;
+    __sync_synchronize();
+    unsigned n = _tosubmit;
+    if (!n && !wait)
+      return 0;
+    int r = enter(n, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (r >= 0) {
+      _tosubmit -= r;
+    } else if ((errno == EAGAIN) || (errno == EBUSY) || (errno == EINTR)) {
+      r = 0; // completions need reaping first
+    }
+    return r;
+  }
+
+  /// next completion, or NULL
+  const io_uring_cqe *peek() {
+    unsigned head = *_cq.head;
+    __sync_synchronize();
+    if (head == *_cq.tail)
+      return 0;
+    return &_cq.cqes[head & *_cq.mask];
+  }
+  void advance() {
+    __sync_synchronize();
+    ++*_cq.head;
+  }
+
+  /// provided buffer bid, as picked for a completion
+  char *buffer(unsigned bid) {
+    return (char *)&_bufs[NumBufs] + bid * BufSize;
+  }
+  /// give bid back to the kernel
+  void recycle(unsigned bid) {
+    io_uring_buf &b = _bufs[_brtail & (NumBufs - 1)];
+    b.addr = (uintptr_t)buffer(bid);
+    b.len = BufSize;
+    b.bid = bid;
+    __sync_synchronize();
+    _br->tail = ++_brtail;
+  }
+
+  static unsigned tag(const io_uring_cqe *c) { return c->user_data & 0xff; }
+  static unsigned index(const io_uring_cqe *c) { return c->user_data >> 8; }
+
+  /// post a multishot recvmsg on fd, its completions come with tag
+  bool recvmsg(int fd, unsigned tag) {
+    io_uring_sqe *e = sqe();
+    if (!e) return false;
+    e->opcode = IORING_OP_RECVMSG;
+    e->fd = fd;
+    e->addr = (uintptr_t)&_rxmsg;
+    e->len = 1;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = 0;
+    e->user_data = tag;
+    return true;
+  }
+
+  /// parse what recvmsg() put in buffer bid
+  void packet(unsigned bid, Packet &p) {
+    char *buf = buffer(bid);
+    const io_uring_recvmsg_out *out = (const io_uring_recvmsg_out *)buf;
+    char *name = buf + sizeof(*out);
+    char *control = name + _rxmsg.msg_namelen;
+    p.sll = (const sockaddr_ll *)name;
+    p.data = control + _rxmsg.msg_controllen;
+    p.size = out->payloadlen;
+    p.truncated = (out->flags & MSG_TRUNC) != 0;
+    p.status = 0;
+    msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = out->controllen;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if ((c->cmsg_level == SOL_PACKET) && (c->cmsg_type == PACKET_AUXDATA))
+        p.status = ((const auxdata *)CMSG_DATA(c))->tp_status;
+    }
+  }
+
+  bool canSend() const { return _ntxfree > 0; }
+
+  /// queue a copy of b to be sent on the raw IP socket fd (see IPSocket)
+  /// return 0 on try again
+  /// to ll if given, else to the IP destination of b
+  int sendmsg(int fd, const Buffer &b, const sockaddr_ll *ll = 0) {
+    const iphdr *ip = (const iphdr *)b.data();
+    unsigned tot_len = ntohs(ip->tot_len);
+    if (tot_len > b.size()) {
+      DBG("IP HDR FAILS LEN CHECK %d %d\n", tot_len, b.size());
+      return 1; // packet ignored!
+    }
+    if (!_ntxfree) return 0;
+    io_uring_sqe *e = sqe();
+    if (!e) return 0;
+    unsigned i = _txfree[--_ntxfree];
+    Slot &s = _tx[i];
+    s.b.copy(b);
+    ::memset(&s.msg, 0, sizeof(s.msg));
+    if (ll) {
+      s.sa.ll = *ll;
+      s.msg.msg_namelen = sizeof(s.sa.ll);
+    } else {
+      s.sa.in.sin_family = AF_INET;
+      s.sa.in.sin_port = 0;
+      s.sa.in.sin_addr.s_addr = ip->daddr;
+      s.msg.msg_namelen = sizeof(s.sa.in);
+    }
+    s.iov.iov_base = s.b.data();
+    s.iov.iov_len = tot_len;
+    s.msg.msg_name = &s.sa;
+    s.msg.msg_iov = &s.iov;
+    s.msg.msg_iovlen = 1;
+    e->opcode = IORING_OP_SENDMSG;
+    e->fd = fd;
+    e->addr = (uintptr_t)&s.msg;
+    e->len = 1;
+    e->user_data = Send | (i << 8);
+    return tot_len;
+  }
+  /// the send in slot i completed
+  void release(unsigned i) {
+    assert(_ntxfree < NumSlots);
+    _txfree[_ntxfree++] = i;
+  }
+};
+
+/**
+ * SocketIO through a Uring: a multishot recvmsg stays posted on each capture
+ * socket, and sends are batched until flush(). Completions of the receives
+ * are held until Barnacle asks for them, so that the completions of the sends
+ * behind them (which free up the queue) are never stuck.
+ *
+ * Nothing spills from the provided buffers, so a GRO aggregate makes it
+ * unsupported() and Barnacle restarts on plain SocketIO.
+ */
+class UringIO : public SocketIO {
+protected:
+  struct Held : public Queue<unsigned> {
+    Held() : Queue<unsigned>(Uring::NumBufs) {}
+  };
+  Uring _ring;
+  Held  _held[2];  // received buffers, per side
+  bool  _armed[2]; // is the multishot recvmsg posted
+  bool  _reaped;   // since the last select()
+  bool  _rx;       // does Barnacle want to recv()
+  bool  _failed;   // reap() did, recv() reports it
+
+  bool pending() { return !_held[WAN].empty() || !_held[LAN].empty(); }
+
+  /// take all completions, return false on fail
+  bool reap() {
+    const io_uring_cqe *c;
+    while ((c = _ring.peek())) {
+      unsigned tag = Uring::tag(c), flags = c->flags;
+      int res = c->res;
+      if (tag == Uring::Send) {
+        _ring.release(Uring::index(c));
+        _ring.advance();
+        if (res == -EMSGSIZE) {
+          ++_stats.toobig; // too late to bounce it
+        } else if (res < 0) {
+          ++_stats.drops;
+          DBG("Dropped packet: %s\n", strerror(-res));
+        }
+        continue;
+      }
+      _ring.advance();
+      if (!(flags & IORING_CQE_F_MORE))
+        _armed[tag] = false; // re-posted by want()
+      if (res < 0) {
+        if (res == -ENOBUFS)
+          continue; // all held
+        errno = -res;
+        if (res == -EINVAL) {
+          ERR("No multishot recvmsg on io_uring\n");
+          _unsupported = true;
+        }
+        return false;
+      }
+      if (flags & IORING_CQE_F_BUFFER) {
+        _held[tag].tail() = flags >> IORING_CQE_BUFFER_SHIFT;
+        _held[tag].pushTail();
+      }
+    }
+    return true;
+  }
+
+public:
+  UringIO(FilterSocket &ins, GSOBuffer *big) : SocketIO(ins, big) {}
+
+  bool open(Selector &sel) {
+    if (!SocketIO::open(sel))
+      return false;
+    if (!_ring.open()) {
+      ERR("Could not set up io_uring: %s\n", strerror(errno));
+      _unsupported = true; // use the sockets directly next time
+      return false;
+    }
+    _armed[WAN] = _armed[LAN] = false;
+    _failed = false;
+    _held[WAN].clear();
+    _held[LAN].clear();
+    sel.newFd(_ring.fd());
+    return true;
+  }
+
+  void close() {
+    _ring.close();
+    SocketIO::close();
+  }
+
+  bool want(Selector &sel, bool rx, bool tx) {
+    // NOTE: without buffers to spare the receive would fail right away
+    for (int i = WAN; i <= LAN; ++i) {
+      if (!_armed[i] && !pending())
+        _armed[i] = _ring.recvmsg(socket(i).fd(), i);
+    }
+    if (_ring.submit() < 0)
+      return false;
+    _rx = rx;
+    _reaped = false;
+    sel.wantRead(_ring.fd(), true);
+    sel.wantWrite(_ips.fd(), tx && _ring.canSend());
+    return true;
+  }
+  /// don't block with packets held
+  int select(Selector &sel, timeval *timeout = NULL) {
+    timeval tv = { 0, 0 };
+    bool now = _rx && pending();
+    int r = sel.select(now ? &tv : timeout);
+    return ((r == 0) && now) ? 1 : r;
+  }
+  bool canRecv(const Selector &sel, int side) {
+    if (!_reaped && sel.canRead(_ring.fd())) {
+      _reaped = true;
+      _failed = !reap();
+    }
+    return !_held[side].empty() || _failed;
+  }
+  bool canSend(const Selector &) { return _ring.canSend(); }
+
+  int recv(int side, Buffer &b) {
+    if (_failed)
+      return -1;
+    while (!_held[side].empty()) {
+      unsigned bid = _held[side].head();
+      _held[side].popHead();
+      Uring::Packet p;
+      _ring.packet(bid, p);
+      b.reset();
+      if (p.truncated || (p.size >= b.room())) {
+        _ring.recycle(bid);
+        ERR("Packet of %d bytes does not fit io_uring buffers\n", p.size);
+        _unsupported = true;
+        errno = EMSGSIZE;
+        return -1;
+      }
+      bool ok = (p.sll->sll_pkttype != PACKET_OUTGOING) &&
+                ((side == WAN) || _ins.allowed(p.sll->sll_addr));
+      if (ok) {
+        ::memcpy(b.data(), p.data, p.size);
+        b.put(p.size);
+        if (p.status & TP_STATUS_CSUMNOTREADY)
+          finish_partial_cksum(b);
+        if (side == LAN)
+          learnFrom(b, p.sll->sll_addr);
+      }
+      _ring.recycle(bid);
+      if (ok) {
+        ++_stats.rx[side];
+        return b.size();
+      }
+    }
+    return 0;
+  }
+  bool aggregates() const { return false; }
+  bool spilled() const { return false; }
+
+  int send(const Buffer &b) {
+    const uint8_t *mac = neighbor(b);
+    int l;
+    if (mac) {
+      sockaddr_ll ll;
+      _ins.address(ll, mac);
+      l = _ring.sendmsg(_ins.fd(), b, &ll);
+    } else {
+      l = _ring.sendmsg(_ips.fd(), b);
+    }
+    if (l > 0) ++_stats.tx;
+    return l;
+  }
+  bool flush() { return _ring.submit() >= 0; }
+};
+
+#endif // INCLUDED_URING_HH
@@ -0,0 +1,632 @@
+/*
+ *  This file is part of Barnacle Wifi Tether
+ *  Copyright (C) 2010 by Szymon Jakubczak
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Network I/O library for Barnacle: AF_XDP sockets */
+#ifndef INCLUDED_XDPSOCKET_HH
+#define INCLUDED_XDPSOCKET_HH
+
+#include <stddef.h> // for offsetof
+#include <sys/mman.h>
+#include <linux/if_link.h> // for XDP_FLAGS_XX
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#include "socket.hh"
+#include "bpf.hh"
+#include "backend.hh"
+
+/**
+ * XDP program that redirects to an AF_XDP socket the IPv4 frames accepted
+ * by a classic BPF filter (as built for the capture sockets), and passes
+ * everything else (ARP, traffic for this host) on to the kernel.
+ *
+ * The filter is translated instruction by instruction. A and X live in r7
+ * and r8, packet data in r9, the end of it in r3. Only what our filters use
+ * is supported: absolute and indirect loads (of the IP header or, at
+ * SKF_LL_OFF, the Ethernet header), ALU with constants, jumps and returns.
+ */
+class XdpProgram {
+public:
+  static const unsigned MaxLen = 4 * BPFProgram::MaxLen + 16;
+protected:
+  enum { A = 7, X = 8, DATA = 9, END = 3, CTX = 6 };
+  enum { PASS = -1, REDIRECT = -2 }; // jump targets, < 0 is a label
+
+  bpf_insn _insns[MaxLen];
+  int  _target[MaxLen];   // cBPF target of a jump to be resolved
+  unsigned _len;
+  bool _ok;
+
+  void add(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    if (_len >= MaxLen) { _ok = false; return; }
+    _target[_len] = 0;
+    bpf_insn &i = _insns[_len++];
+    i.code = code; i.dst_reg = dst; i.src_reg = src; i.off = off; i.imm = imm;
+  }
+  // resolved in compile(), target < 0 is a label, otherwise cBPF index + 1
+  void jump(uint8_t code, uint8_t dst, int32_t imm, int target) {
+    add(code, dst, 0, 0, imm);
+    if (_ok) _target[_len - 1] = target;
+  }
+  void mov(uint8_t dst, uint8_t src) { add(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0); }
+
+  /// A (or X if ldx) = packet[reg + off] of size, or PASS if out of bounds
+  void load(uint8_t dst, uint8_t base, int off, uint8_t size) {
+    unsigned n = (size == BPF_W) ? 4 : (size == BPF_H) ? 2 : 1;
+    mov(4, base);
+    add(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, off + n);
+    add(BPF_JMP | BPF_JGT | BPF_X, 4, END, 0, 0);
+    _target[_len - 1] = PASS;
+    add(BPF_LDX | size | BPF_MEM, dst, base, off, 0);
+    if (n > 1) // network order, like cBPF
+      add(BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, n * 8);
+  }
+
+  /// offset in the frame of a cBPF absolute offset
+  static bool frameOffset(uint32_t k, int &off) {
+    if (k < (uint32_t)SKF_AD_OFF) {
+      off = sizeof(ether_header) + k;
+    } else if (k >= (uint32_t)SKF_LL_OFF && k < (uint32_t)SKF_LL_OFF + 0x1000) {
+      off = k - SKF_LL_OFF;
+    } else if (k >= (uint32_t)SKF_NET_OFF && k < (uint32_t)SKF_NET_OFF + 0x1000) {
+      off = sizeof(ether_header) + k - SKF_NET_OFF;
+    } else {
+      return false; // ancillary data
+    }
+    return off < 0x1000;
+  }
+
+  bool translate(const sock_filter &f, unsigned i) {
+    int off;
+    switch (BPF_CLASS(f.code)) {
+    case BPF_LD:
+      if (BPF_MODE(f.code) == BPF_IMM) {
+        add(BPF_ALU | BPF_MOV | BPF_K, A, 0, 0, f.k);
+      } else if (BPF_MODE(f.code) == BPF_ABS) {
+        if (!frameOffset(f.k, off)) return false;
+        load(A, DATA, off, BPF_SIZE(f.code));
+      } else if (BPF_MODE(f.code) == BPF_IND) {
+        if (f.k >= 0x1000) return false;
+        mov(5, DATA);
+        add(BPF_ALU64 | BPF_ADD | BPF_X, 5, X, 0, 0);
+        load(A, 5, sizeof(ether_header) + f.k, BPF_SIZE(f.code));
+      } else {
+        return false;
+      }
+      return true;
+    case BPF_LDX:
+      if (BPF_MODE(f.code) == BPF_IMM) {
+        add(BPF_ALU | BPF_MOV | BPF_K, X, 0, 0, f.k);
+      } else if (BPF_MODE(f.code) == BPF_MSH) {
+        if (!frameOffset(f.k, off)) return false;
+        load(X, DATA, off, BPF_B);
+        add(BPF_ALU | BPF_AND | BPF_K, X, 0, 0, 0xF);
+        add(BPF_ALU | BPF_LSH | BPF_K, X, 0, 0, 2);
+      } else {
+        return false;
+      }
+      return true;
+    case BPF_ALU:
+      if ((BPF_SRC(f.code) != BPF_K) || (BPF_OP(f.code) == BPF_DIV) ||
+          (BPF_OP(f.code) == BPF_MOD))
+        return false;
+      add(BPF_ALU | BPF_OP(f.code) | BPF_K, A, 0, 0, f.k);
+      return true;
+    case BPF_JMP:
+      if (BPF_OP(f.code) == BPF_JA) {
+        jump(BPF_JMP | BPF_JA, 0, 0, i + 1 + f.k + 1);
+      } else {
+        // 32-bit compare, so that k is not sign-extended
+        jump(BPF_JMP32 | BPF_OP(f.code) | BPF_SRC(f.code), A, f.k, i + 1 + f.jt + 1);
+        if (BPF_SRC(f.code) == BPF_X)
+          _insns[_len - 1].src_reg = X;
+        jump(BPF_JMP | BPF_JA, 0, 0, i + 1 + f.jf + 1);
+      }
+      return true;
+    case BPF_RET:
+      if (BPF_RVAL(f.code) == BPF_K) {
+        jump(BPF_JMP | BPF_JA, 0, 0, f.k ? REDIRECT : PASS);
+      } else if (BPF_RVAL(f.code) == BPF_A) {
+        jump(BPF_JMP32 | BPF_JNE | BPF_K, A, 0, REDIRECT);
+        jump(BPF_JMP | BPF_JA, 0, 0, PASS);
+      } else {
+        return false;
+      }
+      return true;
+    case BPF_MISC:
+      if (BPF_MISCOP(f.code) == BPF_TAX) mov(X, A);
+      else                                mov(A, X);
+      return true;
+    }
+    return false; // BPF_ST, BPF_STX (scratch memory)
+  }
+
+public:
+  XdpProgram() : _len(0), _ok(true) {}
+
+  bool ok() const { return _ok; }
+  unsigned size() const { return _len; }
+
+  /// translate filter, frames that it accepts go to the socket in xskmap
+  bool compile(const BPFProgram &filter, int xskmap) {
+    _len = 0;
+    _ok = filter.ok();
+    unsigned start[BPFProgram::MaxLen + 1];
+
+    mov(CTX, 1);
+    add(BPF_LDX | BPF_W | BPF_MEM, DATA, CTX, offsetof(xdp_md, data), 0);
+    add(BPF_LDX | BPF_W | BPF_MEM, END, CTX, offsetof(xdp_md, data_end), 0);
+    add(BPF_ALU64 | BPF_MOV | BPF_K, A, 0, 0, 0);
+    add(BPF_ALU64 | BPF_MOV | BPF_K, X, 0, 0, 0);
+    // IPv4 only
+    load(4, DATA, offsetof(ether_header, ether_type), BPF_H);
+    jump(BPF_JMP32 | BPF_JNE | BPF_K, 4, ETHERTYPE_IP, PASS);
+
+    for (unsigned i = 0; _ok && (i < filter.size()); ++i) {
+      start[i] = _len;
+      _ok = translate(filter.insns()[i], i);
+    }
+    start[filter.size()] = _len; // cBPF never falls off the end
+    unsigned pass = _len;
+    add(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS);
+    add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    unsigned redirect = _len;
+    add(BPF_LDX | BPF_W | BPF_MEM, 2, CTX, offsetof(xdp_md, rx_queue_index), 0);
+    add(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, xskmap);
+    add(0, 0, 0, 0, 0); // second half of the 64-bit immediate
+    add(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS); // if no socket
+    add(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    if (!_ok) return false;
+
+    for (unsigned i = 0; i < _len; ++i) {
+      int t = _target[i];
+      if (!t) continue;
+      unsigned to;
+      if (t == PASS)          to = pass;
+      else if (t == REDIRECT) to = redirect;
+      else if ((unsigned)t - 1 <= filter.size()) to = start[t - 1];
+      else return _ok = false;
+      if ((to <= i) || (to - i - 1 > 0x7FFF)) return _ok = false;
+      _insns[i].off = to - i - 1;
+    }
+    return true;
+  }
+
+  /// return program fd or -1
+  int load() const {
+    if (!_ok) return -1;
+    bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = _len;
+    attr.insns = (uintptr_t)_insns;
+    attr.license = (uintptr_t)"GPL";
+    int fd = sys_bpf(BPF_PROG_LOAD, attr);
+    if (fd < 0) { // once more for the verifier log
+      int err = errno;
+      static char log[0x10000];
+      attr.log_buf = (uintptr_t)log;
+      attr.log_size = sizeof(log);
+      attr.log_level = 1;
+      log[0] = '\0';
+      sys_bpf(BPF_PROG_LOAD, attr);
+      DBG("XDP program rejected: %s\n%s\n", strerror(err), log);
+      errno = err;
+    }
+    return fd;
+  }
+};
+
+/**
+ * AF_XDP socket bound to queue 0 of an interface, an alternative to
+ * PacketSocket (capture) and IPSocket (injection) on it. Frames accepted by
+ * the XDP program never make it to the kernel stack. There is one UMEM per
+ * socket: half of the frames are in the fill ring waiting for packets, the
+ * other half is for transmission.
+ *
+ * NOTE: Only queue 0 is served, so on multi-queue NICs set
+ *   ethtool -L <iface> combined 1
+ * On veth (or any driver without native XDP), generic XDP in copy mode is
+ * used, which is slow but works anywhere, e.g. between network namespaces.
+ * Frames do not span UMEM chunks, so LRO/GRO must be off and MTU <= 2034.
+ */
+class XdpSocket : public BaseSocket {
+public:
+  static const unsigned FrameSize = 2048;
+  static const unsigned NumFrames = 1024;
+  static const unsigned RingSize = NumFrames / 2;
+protected:
+  struct Ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void     *descs;
+    void     *map;
+    size_t   len;
+    uint32_t cached; // producer or consumer, whichever is ours
+
+    bool mmap(int fd, const xdp_ring_offset &off, size_t elt, off_t pgoff) {
+      len = off.desc + RingSize * elt;
+      map = ::mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+      if (map == MAP_FAILED) { map = 0; return false; }
+      producer = (uint32_t *)((char *)map + off.producer);
+      consumer = (uint32_t *)((char *)map + off.consumer);
+      descs = (char *)map + off.desc;
+      return true;
+    }
+    void unmap() { if (map) ::munmap(map, len); map = 0; }
+    uint64_t &addr(uint32_t i) { return ((uint64_t *)descs)[i & (RingSize - 1)]; }
+    xdp_desc &desc(uint32_t i) { return ((xdp_desc *)descs)[i & (RingSize - 1)]; }
+    // the kernel is on the other end
+    uint32_t produced() { uint32_t p = *producer; __sync_synchronize(); return p; }
+    uint32_t consumed() { uint32_t c = *consumer; __sync_synchronize(); return c; }
+    void produce(uint32_t p) { __sync_synchronize(); *producer = p; }
+    void consume(uint32_t c) { __sync_synchronize(); *consumer = c; }
+  };
+
+  char     *_umem;
+  Ring     _fill, _comp, _rx, _tx;
+  uint64_t _free[RingSize]; // frames for tx
+  unsigned _nfree;
+  int      _ifindex;
+  int      _xskmap;
+  int      _link; // keeps the program attached
+  uint8_t  _mac[ETH_ALEN];
+
+  bool setRing(int opt, unsigned size) {
+    return ::setsockopt(_fd, SOL_XDP, opt, &size, sizeof(size)) == 0;
+  }
+
+  /// return completed tx frames to _free
+  void reclaim() {
+    uint32_t c = _comp.cached, p = _comp.produced();
+    for (; c != p; ++c)
+      _free[_nfree++] = _comp.addr(c);
+    _comp.consume(_comp.cached = c);
+  }
+
+public:
+  XdpSocket() : _umem(0), _nfree(0), _ifindex(0), _xskmap(-1), _link(-1) {
+    _fd = -1;
+    _fill.map = _comp.map = _rx.map = _tx.map = 0;
+  }
+
+  void close() {
+    if (_link >= 0) ::close(_link); // detaches the program
+    if (_xskmap >= 0) ::close(_xskmap);
+    _link = _xskmap = -1;
+    _fill.unmap(); _comp.unmap(); _rx.unmap(); _tx.unmap();
+    BaseSocket::close();
+    if (_umem) ::munmap(_umem, NumFrames * FrameSize);
+    _umem = 0;
+  }
+
+  bool open(const char *iface) {
+    close();
+    IfCtl ic(iface);
+    _ifindex = ic.getIndex();
+    if ((_ifindex <= 0) || !ic.getHwAddress(_mac))
+      return false;
+    if (ic.getHwType() != ARPHRD_ETHER) { // the program looks for an ethertype
+      errno = EPROTONOSUPPORT;
+      return false;
+    }
+    _fd = ::socket(AF_XDP, SOCK_RAW, 0);
+    if (_fd < 0)
+      return false;
+    void *umem = ::mmap(0, NumFrames * FrameSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (umem == MAP_FAILED) {
+      close();
+      return false;
+    }
+    _umem = (char *)umem;
+    xdp_umem_reg reg;
+    ::memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)_umem;
+    reg.len = NumFrames * FrameSize;
+    reg.chunk_size = FrameSize;
+    xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (::setsockopt(_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+        !setRing(XDP_UMEM_FILL_RING, RingSize) ||
+        !setRing(XDP_UMEM_COMPLETION_RING, RingSize) ||
+        !setRing(XDP_RX_RING, RingSize) ||
+        !setRing(XDP_TX_RING, RingSize) ||
+        ::getsockopt(_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) ||
+        !_fill.mmap(_fd, off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+        !_comp.mmap(_fd, off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        !_rx.mmap(_fd, off.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING) ||
+        !_tx.mmap(_fd, off.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING)) {
+      close();
+      return false;
+    }
+    // first half of the frames waits for packets, the rest is for tx
+    uint32_t p = _fill.produced();
+    for (unsigned i = 0; i < RingSize; ++i)
+      _fill.addr(p++) = i * FrameSize;
+    _fill.produce(_fill.cached = p);
+    _rx.cached = _rx.consumed();
+    _tx.cached = _tx.produced();
+    _comp.cached = _comp.consumed();
+    for (_nfree = 0; _nfree < RingSize; ++_nfree)
+      _free[_nfree] = (RingSize + _nfree) * FrameSize;
+
+    sockaddr_xdp sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sxdp_family = AF_XDP;
+    sa.sxdp_ifindex = _ifindex;
+    sa.sxdp_queue_id = 0;
+    bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 1;
+    if (::bind(_fd, (sockaddr *)&sa, sizeof(sa)) ||
+        ((_xskmap = sys_bpf(BPF_MAP_CREATE, attr)) < 0)) {
+      close();
+      return false;
+    }
+    uint32_t key = 0, value = _fd;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _xskmap;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, attr)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  /// (re)attach the XDP program built from filter, natively if possible
+  bool attach(const BPFProgram &filter) {
+    XdpProgram xp;
+    if (!xp.compile(filter, _xskmap)) {
+      errno = EINVAL;
+      return false;
+    }
+    int prog = xp.load();
+    if (prog < 0)
+      return false;
+    bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    bool ok;
+    if (_link >= 0) { // atomic replacement
+      attr.link_update.link_fd = _link;
+      attr.link_update.new_prog_fd = prog;
+      ok = (sys_bpf(BPF_LINK_UPDATE, attr) == 0);
+    } else {
+      attr.link_create.prog_fd = prog;
+      attr.link_create.target_ifindex = _ifindex;
+      attr.link_create.attach_type = BPF_XDP;
+      attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+      _link = sys_bpf(BPF_LINK_CREATE, attr);
+      if (_link < 0) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        _link = sys_bpf(BPF_LINK_CREATE, attr);
+      }
+      ok = (_link >= 0);
+    }
+    int err = errno;
+    ::close(prog); // the link holds on to it
+    errno = err;
+    return ok;
+  }
+
+  const uint8_t *mac() const { return _mac; }
+
+  /// copy the next IP packet into b, and its source MAC into src
+  /// return 0 on try again
+  int recv(Buffer &b, uint8_t *src) {
+    b.reset();
+    for (uint32_t c = _rx.cached; c != _rx.produced(); ) {
+      const xdp_desc &d = _rx.desc(c);
+      const char *frame = _umem + d.addr;
+      int len = (int)d.len - (int)sizeof(ether_header);
+      if ((len > 0) && ((unsigned)len < b.room())) {
+        ::memcpy(b.data(), frame + sizeof(ether_header), len);
+        ::memcpy(src, ((const ether_header *)frame)->ether_shost, ETH_ALEN);
+        b.put(len);
+      }
+      // the frame goes right back to the fill ring
+      _fill.addr(_fill.cached++) = d.addr & ~(uint64_t)(FrameSize - 1);
+      _fill.produce(_fill.cached);
+      _rx.consume(_rx.cached = ++c);
+      if (b.size())
+        return b.size();
+    }
+    return 0;
+  }
+
+  /// queue b in a frame to dst, flush() sends it
+  /// return 0 on try again, -1 on fail
+  int send(const Buffer &b, const uint8_t *dst) {
+    const iphdr *ip = (const iphdr *)b.data();
+    unsigned len = ntohs(ip->tot_len);
+    if (len > b.size()) {
+      DBG("IP HDR FAILS LEN CHECK %d %d\n", len, b.size());
+      return 1; // packet ignored!
+    }
+    if (len + sizeof(ether_header) > FrameSize) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if (!_nfree) reclaim();
+    if (!_nfree || (_tx.cached - _tx.consumed() >= RingSize)) {
+      flush();
+      return 0;
+    }
+    uint64_t addr = _free[--_nfree];
+    ether_header *eh = (ether_header *)(_umem + addr);
+    ::memcpy(eh->ether_dhost, dst, ETH_ALEN);
+    ::memcpy(eh->ether_shost, _mac, ETH_ALEN);
+    eh->ether_type = htons(ETHERTYPE_IP);
+    ::memcpy(eh + 1, b.data(), len);
+    xdp_desc &d = _tx.desc(_tx.cached);
+    d.addr = addr;
+    d.len = len + sizeof(ether_header);
+    d.options = 0;
+    _tx.produce(++_tx.cached);
+    return len;
+  }
+
+  /// kick the kernel to transmit what was queued
+  void flush() {
+    // in copy mode, each kick sends a small batch
+    for (unsigned i = 0; (i < RingSize) && (_tx.consumed() != _tx.cached); ++i) {
+      if ((::sendto(_fd, 0, 0, MSG_DONTWAIT, 0, 0) < 0) && (errno != EBUSY))
+        break; // try again next time
+    }
+    reclaim();
+  }
+};
+
+/**
+ * XdpSockets on both sides. Translated packets go out as frames to the
+ * neighbors learned from what came in, and through the raw IP socket to
+ * those we don't know yet (the kernel will ARP for them).
+ */
+class XdpIO : public Backend {
+protected:
+  XdpSocket     _xout;
+  XdpSocket     _xin;
+  FilterSocket  &_ins;  // only for the MAC filter
+  IPSocket      _ips;
+  Neighbors     _wan_neigh;
+  Neighbors     _lan_neigh;
+  in_addr_t     _wan_addr, _wan_mask;
+  in_addr_t     _subnet, _netmask; // LAN
+
+public:
+  XdpIO(FilterSocket &ins) : _ins(ins) { _ips.close(); }
+
+  bool open(Selector &sel) {
+    close();
+    _ips = IPSocket();
+    if (!_xout.open(_ifs[WAN]) || !_xin.open(_ifs[LAN])) {
+      ERR("Could not open AF_XDP sockets: %s\n", strerror(errno));
+      _unsupported = true; // use the other sockets next time
+      return false;
+    }
+    if(_ips.fd() < 0 || !_ips.bind()) {
+      ERR("Could not bind IP raw socket: %s\n", strerror(errno));
+      return false;
+    }
+    _ins.close(); // would capture everything for nothing
+    IfCtl ic_out(_ifs[WAN]), ic_in(_ifs[LAN]);
+    _wan_addr = ic_out.getAddress();
+    _wan_mask = ic_out.getMask();
+    _netmask = ic_in.getMask();
+    _subnet = ic_in.getAddress() & _netmask;
+    _wan_neigh.clear();
+    _lan_neigh.clear();
+    if (_busy_poll && (!_xout.setBusyPoll(_busy_poll) || !_xin.setBusyPoll(_busy_poll)))
+      LOG("Could not enable SO_BUSY_POLL: %s\n", strerror(errno));
+    if (_sndbuf && !_ips.setSndBuf(_sndbuf))
+      LOG("Could not set SO_SNDBUF: %s\n", strerror(errno));
+    if (_mark && !_ips.setMark(_mark))
+      LOG("Could not set SO_MARK: %s\n", strerror(errno));
+
+    sel.newFd(_xout.fd());
+    sel.newFd(_xin.fd());
+    sel.newFd(_ips.fd());
+    return true;
+  }
+
+  void close() {
+    _xout.close();
+    _xin.close();
+    _ips.close();
+  }
+
+  // NOTE: without the XDP programs we get nothing
+  bool attach(const BPFProgram &wan) {
+    BPFProgram p;
+    if (!_ins.program(p) || !_xin.attach(p) || !wan.ok() || !_xout.attach(wan)) {
+      _unsupported = true;
+      return false;
+    }
+    return true;
+  }
+
+  bool want(Selector &sel, bool rx, bool tx) {
+    sel.wantRead(_xin.fd(), rx);
+    sel.wantRead(_xout.fd(), rx);
+    sel.wantWrite(_ips.fd(), tx);
+    return true;
+  }
+  bool canRecv(const Selector &sel, int side) {
+    return sel.canRead(((side == WAN) ? _xout : _xin).fd());
+  }
+  bool canSend(const Selector &sel) { return sel.canWrite(_ips.fd()); }
+
+  int recv(int side, Buffer &b) {
+    uint8_t mac[ETH_ALEN];
+    int l;
+    if (side == WAN) {
+      l = _xout.recv(b, mac);
+      if (l > 0) {
+        in_addr_t saddr = ((const iphdr *)b.data())->saddr;
+        if ((saddr & _wan_mask) == (_wan_addr & _wan_mask))
+          _wan_neigh.learn(saddr, mac);
+        else
+          _wan_neigh.learnRouter(mac);
+      }
+    } else {
+      while (((l = _xin.recv(b, mac)) > 0) && !_ins.allowed(mac))
+        ; // the XDP program could not filter them all
+      if (l > 0) {
+        in_addr_t saddr = ((const iphdr *)b.data())->saddr;
+        if ((saddr & _netmask) == _subnet)
+          _lan_neigh.learn(saddr, mac);
+      }
+    }
+    if (l > 0) ++_stats.rx[side];
+    return l;
+  }
+
+  int send(const Buffer &b) {
+    in_addr_t daddr = ((const iphdr *)b.data())->daddr;
+    bool lan = ((daddr & _netmask) == _subnet);
+    bool onlink = lan || ((daddr & _wan_mask) == (_wan_addr & _wan_mask));
+    const uint8_t *mac = (lan ? _lan_neigh : _wan_neigh).find(daddr, onlink);
+    int l = !mac ? _ips.send(b) : lan ? _xin.send(b, mac) : _xout.send(b, mac);
+    if (l > 0) ++_stats.tx;
+    return l;
+  }
+  bool flush() {
+    _xin.flush();
+    _xout.flush();
+    return true;
+  }
+
+  void learn(in_addr_t addr, const uint8_t *mac) {
+    if ((addr & _netmask) == _subnet)
+      _lan_neigh.learn(addr, mac);
+  }
+};
+
+#endif // INCLUDED_XDPSOCKET_HH
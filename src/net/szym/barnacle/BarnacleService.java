@@ -415,6 +415,7 @@ public class BarnacleService extends android.app.Service {
 
         if (nat_ctrl == null)
             connectToNat(); // re-attempt to connect
+        tellNat("LEAS|" + cd.mac + "|" + cd.ip); // so the NAT need not wait to see it
 
         log(false, String.format(getString(R.string.connected), cd.toNiceString()));
         app.clientAdded(cd);